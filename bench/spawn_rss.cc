@@ -0,0 +1,83 @@
+// Spawns per second against the resident set size of the parent.
+//
+// Compares `Spell::cast` with a plain fork/exec, which has to copy the page
+// tables of the parent on every launch, and with launching through a
+// `Spawn_Server` started before the parent grew.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "spell.hh"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+constexpr const char *PROGRAM = "../tests/programs/hello_world.exe";
+constexpr int SPAWNS = 500;
+
+template <class F>
+double spawns_per_second (F &&f) {
+  const auto start = std::chrono::steady_clock::now ();
+  for (int i = 0; i < SPAWNS; ++i) {
+    f ();
+  }
+  const std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now () - start;
+  return SPAWNS / elapsed.count ();
+}
+
+void spell_spawn () {
+  spell::Spell (PROGRAM)
+    .set_stdout (spell::Stdio::Null)
+    .cast_status ();
+}
+
+#ifndef _WIN32
+spell::Spawn_Server *server = nullptr;
+
+void server_spawn () {
+  spell::Spell (PROGRAM)
+    .set_stdout (spell::Stdio::Null)
+    .spawn_server (server)
+    .cast_status ();
+}
+
+void fork_spawn () {
+  const pid_t pid = fork ();
+  if (pid == 0) {
+    const int null = open ("/dev/null", O_WRONLY);
+    dup2 (null, STDOUT_FILENO);
+    execl (PROGRAM, PROGRAM, nullptr);
+    _exit (127);
+  }
+  waitpid (pid, nullptr, 0);
+}
+#endif
+
+int main (int argc, char **argv) {
+  const std::size_t max_mib = argc > 1 ? std::strtoul (argv[1], nullptr, 10) : 2048;
+#ifndef _WIN32
+  spell::Spawn_Server spawn_server;
+  server = &spawn_server;
+#endif
+  std::vector<char> ballast;
+  std::printf ("%10s %14s %14s %14s\n", "rss (MiB)", "spell (1/s)", "server (1/s)", "fork (1/s)");
+  for (std::size_t mib = 0; mib <= max_mib; mib = mib ? mib * 2 : 128) {
+    // Touch every page so it is actually resident.
+    ballast.resize (mib << 20);
+    std::memset (ballast.data (), 1, ballast.size ());
+    const double spell_rate = spawns_per_second (spell_spawn);
+  #ifndef _WIN32
+    const double server_rate = spawns_per_second (server_spawn);
+    const double fork_rate = spawns_per_second (fork_spawn);
+  #else
+    const double server_rate = 0.0;
+    const double fork_rate = 0.0;
+  #endif
+    std::printf ("%10zu %14.0f %14.0f %14.0f\n", mib, spell_rate, server_rate, fork_rate);
+  }
+}
@@ -0,0 +1,73 @@
+// Spawns per second against the number of threads casting spells at once.
+//
+// Compares casting concurrently with casting behind a global lock, which is
+// what callers had to do while the library was not thread safe.
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spell.hh"
+
+constexpr const char *PROGRAM = "../tests/programs/hello_world.exe";
+constexpr int SPAWNS_PER_THREAD = 200;
+
+std::mutex global_lock;
+
+// Casts spells capturing their output so pipe ends leaking into children of
+// other threads would show up as delayed EOFs.
+template <bool Locked>
+void spawn_loop (int &failures) {
+  auto spell = spell::Spell (PROGRAM);
+  for (int i = 0; i < SPAWNS_PER_THREAD; ++i) {
+    std::optional<spell::Output> output;
+    if constexpr (Locked) {
+      std::lock_guard lock {global_lock};
+      output = spell.cast_output ();
+    }
+    else {
+      output = spell.cast_output ();
+    }
+    if (!output.has_value () || output->stdout_.empty ()) {
+      ++failures;
+    }
+  }
+}
+
+template <bool Locked>
+double spawns_per_second (unsigned threads, int &failures) {
+  std::vector<std::thread> pool;
+  std::vector<int> thread_failures (threads, 0);
+  const auto start = std::chrono::steady_clock::now ();
+  for (unsigned i = 0; i < threads; ++i) {
+    pool.emplace_back (spawn_loop<Locked>, std::ref (thread_failures[i]));
+  }
+  for (auto &t : pool) {
+    t.join ();
+  }
+  const std::chrono::duration<double> elapsed
+    = std::chrono::steady_clock::now () - start;
+  for (const int f : thread_failures) {
+    failures += f;
+  }
+  return threads * SPAWNS_PER_THREAD / elapsed.count ();
+}
+
+int main (int argc, char **argv) {
+  const unsigned max_threads = argc > 1
+    ? std::strtoul (argv[1], nullptr, 10)
+    : std::max (std::thread::hardware_concurrency (), 1u);
+  int failures = 0;
+  std::printf ("%8s %16s %16s\n", "threads", "parallel (1/s)", "locked (1/s)");
+  for (unsigned threads = 1; threads <= max_threads; threads *= 2) {
+    const double parallel = spawns_per_second<false> (threads, failures);
+    const double locked = spawns_per_second<true> (threads, failures);
+    std::printf ("%8u %16.0f %16.0f\n", threads, parallel, locked);
+  }
+  if (failures != 0) {
+    std::printf ("%d spawns failed\n", failures);
+    return 1;
+  }
+}
@@ -0,0 +1,262 @@
+// Microbenchmarks for tracking spawn latency and I/O throughput over time.
+//
+// Every benchmark collects one sample per iteration and reports percentiles
+// of them. The table goes to stdout, `--json FILE` additionally writes the
+// results in a machine-readable form so runs can be compared by scripts.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <numeric>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spell.hh"
+
+constexpr const char *HELLO_WORLD = "../tests/programs/hello_world.exe";
+constexpr const char *PRINT_BYTES = "../tests/programs/print_bytes.exe";
+constexpr int ENV_VARS = 10000;
+
+struct Result {
+  std::string name;
+  // Samples in microseconds, sorted.
+  std::vector<double> samples;
+  // Throughput derived from the median, if meaningful for the benchmark.
+  double throughput = 0.0;
+  const char *throughput_unit = nullptr;
+  int failures = 0;
+
+  // Nearest-rank percentile.
+  double percentile (double p) const {
+    const auto rank = static_cast<std::size_t> (p / 100.0 * (samples.size () - 1) + 0.5);
+    return samples[rank];
+  }
+
+  double mean () const {
+    return std::accumulate (samples.begin (), samples.end (), 0.0) / samples.size ();
+  }
+};
+
+double elapsed_us (std::chrono::steady_clock::time_point start) {
+  const std::chrono::duration<double, std::micro> elapsed
+    = std::chrono::steady_clock::now () - start;
+  return elapsed.count ();
+}
+
+// Runs `body` the given number of times, timing each run. `body` returns
+// false on failure.
+Result measure (std::string name, int iterations, const std::function<bool ()> &body) {
+  Result r;
+  r.name = std::move (name);
+  r.samples.reserve (iterations);
+  for (int i = 0; i < iterations; ++i) {
+    const auto start = std::chrono::steady_clock::now ();
+    const bool ok = body ();
+    r.samples.push_back (elapsed_us (start));
+    if (!ok) {
+      ++r.failures;
+    }
+  }
+  std::sort (r.samples.begin (), r.samples.end ());
+  return r;
+}
+
+Result cast_wait () {
+  auto spell = spell::Spell (HELLO_WORLD);
+  spell.set_stdout (spell::Stdio::Null);
+  auto r = measure ("cast_wait", 500, [&] () {
+    auto child = spell.cast ();
+    return child.has_value () && child->wait ().success ();
+  });
+  r.throughput = 1e6 / r.percentile (50);
+  r.throughput_unit = "spawns/s";
+  return r;
+}
+
+Result cast_output (const char *name, long bytes, int iterations) {
+  auto spell = spell::Spell (PRINT_BYTES);
+  spell.arg (std::to_string (bytes)).set_stderr (spell::Stdio::Null);
+  auto r = measure (name, iterations, [&] () {
+    const auto output = spell.cast_output ();
+    return output.has_value () && output->stdout_data ().size () == static_cast<std::size_t> (bytes);
+  });
+  r.throughput = bytes / r.percentile (50);
+  r.throughput_unit = "MB/s";
+  return r;
+}
+
+Result env_build () {
+  std::vector<std::string> keys;
+  for (int i = 0; i < ENV_VARS; ++i) {
+    keys.push_back ("SPELL_BENCH_" + std::to_string (i));
+  }
+  return measure ("env_build", 50, [&] () {
+    spell::Env env (false);
+    for (const auto &key : keys) {
+      env.set (key, "some value of moderate length");
+    }
+    return env.get (keys.back ()).size () != 0;
+  });
+}
+
+// Loading a large process environment and modifying it, which copies the
+// snapshot once it is iterated.
+Result env_load () {
+  for (int i = 0; i < ENV_VARS; ++i) {
+    const auto key = "SPELL_BENCH_" + std::to_string (i);
+    setenv (key.c_str (), "some value of moderate length", 1);
+  }
+  auto r = measure ("env_load", 50, [] () {
+    spell::Env env;
+    env.set ("SPELL_BENCH_EXTRA", "1");
+    return std::distance (env.begin (), env.end ()) > ENV_VARS;
+  });
+  for (int i = 0; i < ENV_VARS; ++i) {
+    unsetenv (("SPELL_BENCH_" + std::to_string (i)).c_str ());
+  }
+  return r;
+}
+
+Result from_string () {
+  std::string command_line = "program";
+  for (int i = 0; i < 100; ++i) {
+    command_line += i % 3 == 0 ? " plain" : i % 3 == 1 ? " 'quoted argument'" : " escaped\\ space";
+  }
+  auto r = measure ("from_string", 10000, [&] () {
+    return spell::Spell::from_string (command_line).get_args ().size () == 100;
+  });
+  r.throughput = 1e6 / r.percentile (50);
+  r.throughput_unit = "parses/s";
+  return r;
+}
+
+// The same short command line parsed at run time and at compile time.
+Result from_string_short () {
+  std::string revision = "HEAD";
+  return measure ("from_string_short", 10000, [&] () {
+    return spell::Spell::from_string ("git rev-parse --verify " + revision).get_args ().size () == 3;
+  });
+}
+
+Result command_short () {
+  std::string revision = "HEAD";
+  return measure ("command_short", 10000, [&] () {
+    return spell::Command<"git rev-parse --verify {}">::spell (revision).get_args ().size () == 3;
+  });
+}
+
+Result concurrent_cast (unsigned threads) {
+  constexpr int SPAWNS_PER_THREAD = 100;
+  std::vector<Result> partial (threads);
+  std::vector<std::thread> pool;
+  const auto start = std::chrono::steady_clock::now ();
+  for (unsigned i = 0; i < threads; ++i) {
+    pool.emplace_back ([&r = partial[i]] () {
+      auto spell = spell::Spell (HELLO_WORLD);
+      spell.set_stdout (spell::Stdio::Null);
+      r = measure ("", SPAWNS_PER_THREAD, [&] () {
+        auto child = spell.cast ();
+        return child.has_value () && child->wait ().success ();
+      });
+    });
+  }
+  for (auto &t : pool) {
+    t.join ();
+  }
+  const double total = elapsed_us (start);
+  Result r;
+  r.name = "concurrent_cast_" + std::to_string (threads);
+  for (const auto &p : partial) {
+    r.samples.insert (r.samples.end (), p.samples.begin (), p.samples.end ());
+    r.failures += p.failures;
+  }
+  std::sort (r.samples.begin (), r.samples.end ());
+  r.throughput = threads * SPAWNS_PER_THREAD * 1e6 / total;
+  r.throughput_unit = "spawns/s";
+  return r;
+}
+
+void print_table (const std::vector<Result> &results) {
+  std::printf ("%-22s %8s %10s %10s %10s %10s %10s  %s\n",
+               "", "n", "mean (us)", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)", "throughput");
+  for (const auto &r : results) {
+    std::printf ("%-22s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f",
+                 r.name.c_str (), r.samples.size (), r.mean (), r.percentile (50),
+                 r.percentile (90), r.percentile (99), r.samples.back ());
+    if (r.throughput_unit != nullptr) {
+      std::printf ("  %.1f %s", r.throughput, r.throughput_unit);
+    }
+    if (r.failures != 0) {
+      std::printf ("  (%d failed)", r.failures);
+    }
+    std::printf ("\n");
+  }
+}
+
+bool write_json (const char *path, const std::vector<Result> &results) {
+  FILE *f = std::fopen (path, "w");
+  if (f == nullptr) {
+    return false;
+  }
+  std::fprintf (f, "{\n  \"unit\": \"us\",\n  \"benchmarks\": [");
+  for (std::size_t i = 0; i < results.size (); ++i) {
+    const auto &r = results[i];
+    std::fprintf (f, "%s\n    {\"name\": \"%s\", \"iterations\": %zu, \"failures\": %d, "
+                  "\"mean\": %.3f, \"min\": %.3f, \"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f",
+                  i == 0 ? "" : ",", r.name.c_str (), r.samples.size (), r.failures,
+                  r.mean (), r.samples.front (), r.percentile (50), r.percentile (90),
+                  r.percentile (99), r.samples.back ());
+    if (r.throughput_unit != nullptr) {
+      std::fprintf (f, ", \"throughput\": %.3f, \"throughput_unit\": \"%s\"",
+                    r.throughput, r.throughput_unit);
+    }
+    std::fprintf (f, "}");
+  }
+  std::fprintf (f, "\n  ]\n}\n");
+  return std::fclose (f) == 0;
+}
+
+int main (int argc, char **argv) {
+  const char *json = nullptr;
+  bool quick = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::strcmp (argv[i], "--json") == 0 && i + 1 < argc) {
+      json = argv[++i];
+    }
+    else if (std::strcmp (argv[i], "--quick") == 0) {
+      quick = true;
+    }
+    else {
+      std::fprintf (stderr, "usage: %s [--quick] [--json FILE]\n", argv[0]);
+      return 2;
+    }
+  }
+
+  std::vector<Result> results;
+  results.push_back (cast_wait ());
+  results.push_back (cast_output ("cast_output_1k", 1000, 200));
+  results.push_back (cast_output ("cast_output_1m", 1000000, 50));
+  if (!quick) {
+    results.push_back (cast_output ("cast_output_1g", 1000000000, 3));
+  }
+  results.push_back (env_build ());
+  results.push_back (env_load ());
+  results.push_back (from_string ());
+  results.push_back (from_string_short ());
+  results.push_back (command_short ());
+  const unsigned threads = std::max (4u, std::thread::hardware_concurrency ());
+  results.push_back (concurrent_cast (threads));
+
+  print_table (results);
+  if (json != nullptr && !write_json (json, results)) {
+    std::fprintf (stderr, "could not write %s\n", json);
+    return 1;
+  }
+  for (const auto &r : results) {
+    if (r.failures != 0) {
+      return 1;
+    }
+  }
+}
@@ -0,0 +1,44 @@
+// Request latency of a Worker_Pool against launching a worker per request.
+//
+// Launching per request is measured with a pool that relaunches its worker
+// after every request, so both sides use the same framing code.
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "spell.hh"
+
+constexpr const char *PROGRAM = "../tests/programs/worker.exe";
+
+// Returns the median and 99th percentile latency in microseconds.
+std::pair<double, double> latency (std::size_t max_requests, int requests, int &failures) {
+  spell::Worker_Pool pool (spell::Spell (PROGRAM), 1, spell::Framing::Line, max_requests);
+  std::vector<double> samples;
+  samples.reserve (requests);
+  for (int i = 0; i < requests; ++i) {
+    const auto start = std::chrono::steady_clock::now ();
+    if (!pool.request ("ping").has_value ()) {
+      ++failures;
+    }
+    const std::chrono::duration<double, std::micro> elapsed
+      = std::chrono::steady_clock::now () - start;
+    samples.push_back (elapsed.count ());
+  }
+  std::sort (samples.begin (), samples.end ());
+  return {samples[samples.size () / 2], samples[samples.size () * 99 / 100]};
+}
+
+int main (int argc, char **argv) {
+  const int requests = argc > 1 ? std::atoi (argv[1]) : 2000;
+  int failures = 0;
+  std::printf ("%12s %12s %12s\n", "", "p50 (us)", "p99 (us)");
+  const auto [launch_p50, launch_p99] = latency (1, requests, failures);
+  std::printf ("%12s %12.1f %12.1f\n", "launch", launch_p50, launch_p99);
+  const auto [pool_p50, pool_p99] = latency (0, requests, failures);
+  std::printf ("%12s %12.1f %12.1f\n", "pool", pool_p50, pool_p99);
+  if (failures != 0) {
+    std::printf ("%d requests failed\n", failures);
+    return 1;
+  }
+}
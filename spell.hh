@@ -3,28 +3,67 @@
  */
 #pragma once
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <concepts>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <exception>
 #include <filesystem>
+#include <functional>
+#include <initializer_list>
+#include <iterator>
+#include <limits>
+#include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
+#include <shared_mutex>
 #include <span>
 #include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #ifdef _WIN32
 #include <Windows.h>
+#include <psapi.h>
 #else
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
+#include <spawn.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #endif
 
+#if defined (__linux__)
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#define SPELL_HAS_REACTOR 1
+#elif defined (__APPLE__) || defined (__FreeBSD__) || defined (__NetBSD__) \
+      || defined (__OpenBSD__) || defined (__DragonFly__)
+#include <sys/event.h>
+#define SPELL_HAS_REACTOR 1
+#endif
+
 namespace spell {
 
 /** @var INVALID_PIPE
@@ -66,6 +105,40 @@ using Pid = pid_t;
 constexpr Pipe_Handle INVALID_PIPE = -1;
 #endif
 
+#ifndef _WIN32
+class Child;
+class Spell;
+class Spawn_Server;
+
+namespace detail {
+class Exit_Claim;
+} // namespace detail
+#endif
+
+#ifdef SPELL_HAS_REACTOR
+class Reactor;
+
+namespace detail {
+class Read_Awaiter;
+class Wait_Awaiter;
+class Output_Awaiter;
+} // namespace detail
+#endif
+
+// posix_spawn can only be used if it can also change the working directory of
+// the child. This is a GNU/Apple extension.
+#if !defined (_WIN32) \
+    && ((defined (__GLIBC__) \
+         && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))) \
+        || defined (__APPLE__))
+#define SPELL_HAS_SPAWN_CHDIR 1
+#endif
+
+// Children can be restricted to a set of CPUs with Spell::cpu_affinity.
+#if defined (_WIN32) || defined (__linux__)
+#define SPELL_HAS_CPU_AFFINITY 1
+#endif
+
 namespace detail {
 class Env_Var {
 public:
@@ -78,11 +151,10 @@ public:
   explicit Env_Var (std::string_view key, std::string_view value)
   : data_ {}
   {
-    const auto value_off = key.size () + 1;
-    data_.resize (value_off + value.size ());
-    std::memcpy (data_.data (), key.data (), key.size ());
-    data_.data()[key.size ()] = '=';
-    std::memcpy (data_.data () + value_off, value.data (), value.size ());
+    data_.reserve (key.size () + 1 + value.size ());
+    data_.append (key);
+    data_.push_back ('=');
+    data_.append (value);
     eq_ = key.size ();
   }
 
@@ -145,6 +217,97 @@ using Env_Set = std::unordered_set<
   Env_Hash::transparent_key_equal
 >;
 
+inline Env_Set::const_iterator find_var (const Env_Set &set, std::string_view key) {
+#if (defined (__cpp_lib_generic_unordered_lookup) \
+     && __cpp_lib_generic_unordered_lookup == 201811L)
+  return set.find (key);
+#else
+  const auto search = Env_Var (key, std::string_view ());
+  return set.find (search);
+#endif
+}
+
+/**
+ * Immutable copy of the process environment, shared by all `Env` objects
+ * loaded while the environment did not change.
+ */
+struct Env_Snapshot {
+  Env_Set vars;
+#ifdef _WIN32
+  // The environment block it was created from.
+  std::string source;
+#else
+  // The `environ` array it was created from.
+  std::vector<const char *> source;
+#endif
+
+  // Whether the process environment is still the one the snapshot was taken
+  // of. This compares the variable pointers on Unix platforms, so in-place
+  // modifications of a string passed to `putenv` are not detected.
+  bool is_current () const {
+  #ifdef _WIN32
+    LPCH block = GetEnvironmentStrings ();
+    const char *end = block;
+    while (*end) {
+      end += std::strlen (end) + 1;
+    }
+    const bool same = std::string_view (block, end - block) == source;
+    FreeEnvironmentStringsA (block);
+    return same;
+  #else
+    std::size_t i = 0;
+    for (char **envp = environ; *envp; ++envp, ++i) {
+      if (i == source.size () || source[i] != *envp) {
+        return false;
+      }
+    }
+    return i == source.size ();
+  #endif
+  }
+
+  static std::shared_ptr<const Env_Snapshot> take () {
+    auto snapshot = std::make_shared<Env_Snapshot> ();
+  #ifdef _WIN32
+    LPCH block = GetEnvironmentStrings ();
+    const char *envp = block;
+    std::size_t len;
+    while ((len = std::strlen (envp)) != 0) {
+      snapshot->vars.emplace (std::string_view (envp, len));
+      envp += len + 1;
+    }
+    snapshot->source.assign (block, static_cast<std::size_t> (envp - block));
+    FreeEnvironmentStringsA (block);
+  #else
+    for (char **envp = environ; *envp; ++envp) {
+      snapshot->vars.emplace (*envp);
+      snapshot->source.push_back (*envp);
+    }
+  #endif
+    return snapshot;
+  }
+};
+
+/// Returns a snapshot of the current process environment, reusing the
+/// previous one if the environment did not change since.
+inline std::shared_ptr<const Env_Snapshot> env_snapshot () {
+  static std::mutex mutex;
+  static std::shared_ptr<const Env_Snapshot> cached;
+  std::shared_ptr<const Env_Snapshot> snapshot;
+  {
+    std::lock_guard lock {mutex};
+    snapshot = cached;
+  }
+  // The lock is only held for exchanging the pointer so threads loading
+  // environments don't wait on each other while comparing or copying.
+  if (snapshot && snapshot->is_current ()) {
+    return snapshot;
+  }
+  snapshot = Env_Snapshot::take ();
+  std::lock_guard lock {mutex};
+  cached = snapshot;
+  return snapshot;
+}
+
 
 inline Pipe_Handle duplicate_pipe (Pipe_Handle h) {
 #ifdef _WIN32
@@ -153,11 +316,21 @@ inline Pipe_Handle duplicate_pipe (Pipe_Handle h) {
   DuplicateHandle (proc, h, proc, &hh, 0, TRUE, DUPLICATE_SAME_ACCESS);
   return hh;
 #else
-  return dup (h);
+  // The duplicate must not leak into children spawned by other threads, the
+  // spawn functions make the copies they hand to a child inheritable.
+  return fcntl (h, F_DUPFD_CLOEXEC, 0);
 #endif
 }
 
 
+/// Returns a process-wide unique number, used to identify states of mutable
+/// objects.
+inline std::uint64_t next_version () {
+  static std::atomic<std::uint64_t> counter {0};
+  return ++counter;
+}
+
+
 inline void close_pipe (Pipe_Handle h) {
 #ifdef _WIN32
   CloseHandle (h);
@@ -168,6 +341,78 @@ inline void close_pipe (Pipe_Handle h) {
 
 } // namespace detail
 
+/**
+ * @brief How a file is opened for @ref Stdio::File.
+ */
+enum class File_Mode {
+  /// Open an existing file for reading.
+  Read,
+  /// Create the file or truncate it and open it for writing.
+  Truncate,
+  /// Create the file or open it for writing at its end.
+  Append
+};
+
+/**
+ * @brief The result of a non-blocking read or write.
+ */
+class Io_Result {
+public:
+  /// @brief What happened.
+  enum class Status {
+    /// Some data was transferred, or a read reached EOF.
+    Done,
+    /// Nothing could be transferred without blocking.
+    Would_Block,
+    /// The operation failed.
+    Failed
+  };
+
+  explicit Io_Result (Status status, std::size_t count = 0)
+  : status_ (status),
+    count_ (count)
+  {}
+
+  /**
+   * @brief Returns what happened.
+   */
+  Status status () const {
+    return status_;
+  }
+
+  /**
+   * @brief Returns the number of bytes transferred, 0 unless @ref done.
+   */
+  std::size_t count () const {
+    return count_;
+  }
+
+  /**
+   * @brief Whether data was transferred or a read reached EOF.
+   */
+  bool done () const {
+    return status_ == Status::Done;
+  }
+
+  /**
+   * @brief Whether the operation would have blocked.
+   */
+  bool would_block () const {
+    return status_ == Status::Would_Block;
+  }
+
+  /**
+   * @brief Whether the operation failed.
+   */
+  bool failed () const {
+    return status_ == Status::Failed;
+  }
+
+private:
+  Status status_;
+  std::size_t count_;
+};
+
 /**
  * @brief One end of an anonymous pipe.
  */
@@ -198,6 +443,7 @@ class Anonymous_Pipe {
 protected:
   using Pipes = Pipes_Base<Anonymous_Pipe>;
   friend class Spell;
+  friend class Pipeline;
 
   static Pipes create () {
   #ifdef _WIN32
@@ -207,7 +453,9 @@ protected:
       .bInheritHandle = true
     };
     HANDLE r = INVALID_HANDLE_VALUE, w = INVALID_HANDLE_VALUE;
-    CreatePipe (&r, &w, &sa, 0);
+    // The default buffer is a single page, which makes the writer wait for
+    // the reader after every few kilobytes.
+    CreatePipe (&r, &w, &sa, CHUNK_SIZE);
     return Pipes {r, w};
   #else
     int p[2] = { INVALID_PIPE, INVALID_PIPE };
@@ -216,33 +464,157 @@ protected:
   #endif
   }
 
+  // Creates a pipe for output of a child, whose read end stays in this
+  // process.
+  // On Windows the read end is an overlapped named pipe so multiple of them
+  // can be waited on together, see `detail::drain`. The write end stays
+  // synchronous as that is what children expect.
+  static Pipes create_output () {
+  #ifdef _WIN32
+    static std::atomic<unsigned long> counter {0};
+    char name[64];
+    std::snprintf (
+      name, sizeof (name), "\\\\.\\pipe\\spell-%lu-%lu",
+      static_cast<unsigned long> (GetCurrentProcessId ()), counter++
+    );
+    SECURITY_ATTRIBUTES sa = {
+      .nLength = sizeof (SECURITY_ATTRIBUTES),
+      .lpSecurityDescriptor = nullptr,
+      .bInheritHandle = true
+    };
+    HANDLE r = CreateNamedPipeA (
+      name,
+      PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+      PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+      1,
+      CHUNK_SIZE,
+      CHUNK_SIZE,
+      0,
+      &sa
+    );
+    if (r == INVALID_HANDLE_VALUE) {
+      return create ();
+    }
+    HANDLE w = CreateFileA (name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (w == INVALID_HANDLE_VALUE) {
+      CloseHandle (r);
+      return create ();
+    }
+    Anonymous_Pipe read {r};
+    read.overlapped_ = true;
+    return Pipes {std::move (read), Anonymous_Pipe {w}};
+  #else
+    return create ();
+  #endif
+  }
+
   #ifdef _WIN32
-  static Pipes create_inherit (int device) {
-    const HANDLE h = GetStdHandle (device);
-    return Pipes {detail::duplicate_pipe (h), detail::duplicate_pipe (h)};
+  static Anonymous_Pipe create_inherit (int device) {
+    return detail::duplicate_pipe (GetStdHandle (device));
+  }
+  #else
+  static Anonymous_Pipe create_inherit (FILE *stream) {
+    return detail::duplicate_pipe (fileno (stream));
+  }
+  #endif
+
+  static Anonymous_Pipe create_duplicate (Pipe_Handle h) {
+    return detail::duplicate_pipe (h);
   }
+
+  static Anonymous_Pipe create_file (const std::filesystem::path &path, File_Mode mode) {
+  #ifdef _WIN32
+    SECURITY_ATTRIBUTES sa = {
+      .nLength = sizeof (SECURITY_ATTRIBUTES),
+      .lpSecurityDescriptor = nullptr,
+      .bInheritHandle = true
+    };
+    const DWORD access = mode == File_Mode::Read ? GENERIC_READ
+                       : mode == File_Mode::Append ? FILE_APPEND_DATA
+                       : GENERIC_WRITE;
+    const DWORD disposition = mode == File_Mode::Read ? OPEN_EXISTING
+                            : mode == File_Mode::Append ? OPEN_ALWAYS
+                            : CREATE_ALWAYS;
+    return CreateFileW (
+      path.c_str (),
+      access,
+      FILE_SHARE_READ | FILE_SHARE_WRITE,
+      &sa,
+      disposition,
+      FILE_ATTRIBUTE_NORMAL,
+      nullptr
+    );
   #else
-  static Pipes create_inherit (FILE *stream) {
-    const int h = fileno (stream);
-    return Pipes {detail::duplicate_pipe (h), detail::duplicate_pipe (h)};
+    const int flags = mode == File_Mode::Read ? O_RDONLY
+                    : mode == File_Mode::Append ? O_WRONLY | O_CREAT | O_APPEND
+                    : O_WRONLY | O_CREAT | O_TRUNC;
+    return open (path.c_str (), flags | O_CLOEXEC, 0666);
+  #endif
   }
+
+  // Creates an anonymous file for Stdio::Mapped.
+  static Anonymous_Pipe create_memory () {
+  #ifdef _WIN32
+    SECURITY_ATTRIBUTES sa = {
+      .nLength = sizeof (SECURITY_ATTRIBUTES),
+      .lpSecurityDescriptor = nullptr,
+      .bInheritHandle = true
+    };
+    char dir[MAX_PATH + 1];
+    char path[MAX_PATH + 1];
+    if (GetTempPathA (sizeof (dir), dir) == 0 || GetTempFileNameA (dir, "spl", 0, path) == 0) {
+      return INVALID_PIPE;
+    }
+    // A temporary file is mostly kept in memory by the cache manager.
+    return CreateFileA (
+      path,
+      GENERIC_READ | GENERIC_WRITE,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+      &sa,
+      CREATE_ALWAYS,
+      FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE,
+      nullptr
+    );
+  #else
+  #if defined (__linux__) && defined (MFD_CLOEXEC)
+    if (const int fd = memfd_create ("spell-output", MFD_CLOEXEC); fd >= 0) {
+      return fd;
+    }
+  #endif
+    const char *tmp = std::getenv ("TMPDIR");
+    std::string path = tmp != nullptr && *tmp != '\0' ? tmp : "/tmp";
+    path += "/spell-output-XXXXXX";
+    // Created close-on-exec so a child launched by another thread meanwhile
+    // does not inherit it.
+    const int fd = mkostemp (path.data (), O_CLOEXEC);
+    if (fd < 0) {
+      return INVALID_PIPE;
+    }
+    unlink (path.c_str ());
+    return fd;
   #endif
+  }
 
-  static Pipes create_null () {
+  static Anonymous_Pipe create_null () {
   #ifdef _WIN32
+    SECURITY_ATTRIBUTES sa = {
+      .nLength = sizeof (SECURITY_ATTRIBUTES),
+      .lpSecurityDescriptor = nullptr,
+      .bInheritHandle = true
+    };
     HANDLE h = CreateFileA (
       "nul",
       GENERIC_READ | GENERIC_WRITE,
       FILE_SHARE_READ | FILE_SHARE_WRITE,
-      nullptr,
+      &sa,
       OPEN_EXISTING,
       FILE_ATTRIBUTE_NORMAL,
       nullptr
     );
   #else
-    int h = open("/dev/null", O_RDWR);
+    int h = open ("/dev/null", O_RDWR | O_CLOEXEC);
   #endif
-    return Pipes{h, h};
+    return h;
   }
 
 public:
@@ -261,6 +633,9 @@ public:
   Anonymous_Pipe (Anonymous_Pipe &&from)
   : inner_ (from.handle ())
   {
+  #ifdef _WIN32
+    overlapped_ = std::exchange (from.overlapped_, false);
+  #endif
     from.inner_ = INVALID_PIPE;
   }
 
@@ -282,6 +657,9 @@ public:
    */
   Anonymous_Pipe& operator= (Anonymous_Pipe &&from) {
     drop ();
+  #ifdef _WIN32
+    overlapped_ = from.overlapped_;
+  #endif
     inner_ = from.take ();
     return *this;
   }
@@ -293,12 +671,28 @@ public:
     return inner_;
   }
 
+#ifdef _WIN32
+  /**
+   * @brief Whether the handle was opened for overlapped I/O.
+   *
+   * This is the case for the ends of piped stdout and stderr, the methods of
+   * the pipe still block like they do for other handles, except for
+   * @ref try_read.
+   */
+  bool overlapped () const {
+    return overlapped_;
+  }
+#endif
+
   /**
    * @brief Invalidates the pipe and returns the handle it held.
    */
   [[nodiscard]] Pipe_Handle take () {
     const auto h = handle ();
     inner_ = INVALID_PIPE;
+  #ifdef _WIN32
+    overlapped_ = false;
+  #endif
     return h;
   }
 
@@ -312,6 +706,9 @@ public:
       detail::close_pipe (inner_);
       inner_ = INVALID_PIPE;
     }
+  #ifdef _WIN32
+    overlapped_ = false;
+  #endif
   }
 
   /**
@@ -323,7 +720,7 @@ public:
   std::optional<std::size_t> read (auto *buf, std::size_t count) {
   #ifdef _WIN32
     DWORD nread;
-    if (ReadFile (handle (), reinterpret_cast<void *> (buf), count, &nread, nullptr)) {
+    if (read_file (reinterpret_cast<void *> (buf), count, &nread)) {
       return nread;
     } else {
       return std::nullopt;
@@ -348,16 +745,21 @@ public:
    */
   std::optional<std::size_t> read_all (std::vector<char> &out) {
   #ifdef _WIN32
-    static char buf[64];
-    DWORD nread;
-    bool success;
+    DWORD bytes;
     out.clear ();
-    do {
-      if ((success = ReadFile (handle (), buf, sizeof (buf), &nread, nullptr))) {
-        out.insert (out.end (), buf, buf + nread);
+    if (!PeekNamedPipe (handle (), nullptr, 0, nullptr, &bytes, nullptr)) {
+      return GetLastError () == ERROR_BROKEN_PIPE ? std::optional<std::size_t> (0) : std::nullopt;
+    }
+    if (bytes) {
+      out.resize (bytes);
+      if (auto r = read (out.data (), bytes); r.has_value ()) {
+        out.resize (r.value ());
+        return r;
       }
-    } while (success && nread > 0);
-    return success;
+      out.clear ();
+      return std::nullopt;
+    }
+    return 0;
   #else
     int bytes;
     if (ioctl (handle (), FIONREAD, &bytes) < 0) {
@@ -426,965 +828,6408 @@ public:
     return true;
   }
 
-private:
-  Pipe_Handle inner_;
-};
-
-/// @brief List of command arguments.
-using Args = std::vector<std::string>;
-
-/**
- * @brief An environment mapping.
- */
-class Env {
-public:
-  using iterator = detail::Env_Set::iterator;
-  using const_iterator = detail::Env_Set::const_iterator;
-
-public:
+#ifndef _WIN32
   /**
-   * @brief Creates an environment mapping that's either empty or copies the
-   *        current processes environment.
+   * @brief Writes all data from the given buffers, in order.
    *
-   * @param load - Whether to load the current processes environment.
+   * This uses `writev`, so many small buffers are written with few system
+   * calls and without concatenating them first. Partial writes continue
+   * where they stopped.
+   *
+   * @param bufs - the buffers to write.
+   * @return whether writing was successful.
    */
-  Env (bool load = true)
-  : data_ {}
-  {
-    if (load) {
-      this->load();
-    }
+  bool write_all (std::span<const iovec> bufs) {
+    return write_vectored (bufs, [] (const iovec &v) { return v; });
   }
+#endif
 
   /**
-   * @brief Loads the current environment from the system.
+   * @brief Writes all the given strings, in order.
+   *
+   * On Unix platforms this uses `writev`, see
+   * @ref write_all(std::span<const iovec>).
+   *
+   * @param strings - the strings to write.
+   * @return whether writing was successful.
    */
-  void load() {
+  bool write_all (std::span<const std::string_view> strings) {
   #ifdef _WIN32
-    LPCH envp = GetEnvironmentStrings ();
-    std::size_t len;
-    while ((len = std::strlen (envp)) != 0) {
-      data_.emplace (envp);
-      envp += len + 1;
+    for (const auto &str : strings) {
+      if (!write_all (str.data (), str.size ())) {
+        return false;
+      }
     }
+    return true;
   #else
-    for (char **envp = environ; *envp; ++envp) {
-      data_.emplace (*envp);
-    }
+    return write_vectored (strings, [] (std::string_view str) {
+      return iovec {const_cast<char *> (str.data ()), str.size ()};
+    });
   #endif
   }
 
   /**
-   * @brief Gets the value of a variable.
+   * @brief Returns the capacity of the pipe in bytes.
    *
-   * @param key - Name of the variable.
-   * @return value of the variable of an empty string if does not exist.
+   * Only supported on Linux.
+   *
+   * @return the capacity or `std::nullopt` if it is not known.
    */
-  std::string_view get (std::string_view key) const {
-    if (auto it = find (key); it != data_.end ()) {
-      return it->value ();
+  std::optional<std::size_t> capacity () const {
+  #ifdef F_GETPIPE_SZ
+    if (const int n = fcntl (handle (), F_GETPIPE_SZ); n >= 0) {
+      return n;
     }
-    return {};
+  #endif
+    return std::nullopt;
   }
 
   /**
-   * @brief Alias for @ref get().
+   * @brief Changes the capacity of the pipe.
    *
-   * Cannot be used to insert/change a value.
+   * A larger pipe lets a writer run further ahead before it has to wait for
+   * the reader. The kernel may round the size up, and limits how large it
+   * may be for unprivileged processes. Only supported on Linux.
+   *
+   * @param bytes - the requested capacity.
+   * @return the new capacity or `std::nullopt` if it could not be changed.
    */
-  std::string_view operator[] (std::string_view key) const {
-    return get (key);
+  std::optional<std::size_t> set_capacity (std::size_t bytes) {
+  #ifdef F_SETPIPE_SZ
+    if (const int n = fcntl (handle (), F_SETPIPE_SZ, static_cast<int> (bytes)); n >= 0) {
+      return n;
+    }
+  #else
+    (void)bytes;
+  #endif
+    return std::nullopt;
   }
 
   /**
-   * @brief Insert of change a variable.
-   * @param key - Name of the variable.
-   * @param value - Value of the variable.
+   * @brief Enables or disables non-blocking mode.
+   *
+   * In non-blocking mode @ref read and @ref write fail instead of blocking,
+   * use @ref try_read and @ref try_write to tell that apart from errors.
+   *
+   * @param enabled - whether the pipe should be non-blocking.
+   * @return whether the mode could be changed.
    */
-  void set (std::string_view key, std::string_view value) {
-    if (auto it = find (key); it != data_.end ()) {
-      // The hashset gives us a constant iterator as we shouldn't mutate
-      // elements of a set. However both hashing and comparison of `Env_Var`s
-      // only depends on the key part so we can safely change the value here.
-      auto &x = const_cast<detail::Env_Var &> (*it);
-      x.value (value);
-    }
-    else {
-      data_.emplace (key, value);
+  bool set_nonblocking (bool enabled = true) {
+  #ifdef _WIN32
+    DWORD mode = PIPE_READMODE_BYTE | (enabled ? PIPE_NOWAIT : PIPE_WAIT);
+    return SetNamedPipeHandleState (handle (), &mode, nullptr, nullptr);
+  #else
+    const int flags = fcntl (handle (), F_GETFL);
+    if (flags < 0) {
+      return false;
     }
+    const int new_flags = enabled ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+    return new_flags == flags || fcntl (handle (), F_SETFL, new_flags) == 0;
+  #endif
   }
 
   /**
-   * @brief Removes a variable.
-   * @param key - Name of the variable.
+   * @brief Reads from the pipe without blocking.
+   *
+   * The pipe has to be in non-blocking mode, see @ref set_nonblocking.
+   * Overlapped pipes on Windows, see @ref overlapped, do not need to be:
+   * a read that does not finish right away is cancelled instead.
+   *
+   * @param buf - buffer to read into.
+   * @param count - maximum number of bytes to read.
+   * @return the number of bytes read, 0 at EOF, or whether it would have
+   *         blocked or failed.
    */
-  void remove (std::string_view key) {
-    if (auto it = find (key); it != data_.end ()) {
-      data_.erase (it);
+  Io_Result try_read (void *buf, std::size_t count) {
+  #ifdef _WIN32
+    DWORD nread;
+    if (read_file (buf, count, &nread, false)) {
+      return Io_Result (Io_Result::Status::Done, nread);
     }
-  }
-
-  /**
-   * @brief Change the name of a variable.
-   * @param key - Current name of the variable.
-   * @param key_key - Name to give to the variable.
-   */
-  void rename (std::string_view key, std::string_view new_key) {
-    if (auto it = find (key); it != data_.end ()) {
-      auto var = std::move (*it);
-      var.key (new_key);
-      data_.erase (it);
-      data_.insert (var);
+    switch (GetLastError ()) {
+    case ERROR_NO_DATA:
+      return Io_Result (Io_Result::Status::Would_Block);
+    case ERROR_BROKEN_PIPE:
+      return Io_Result (Io_Result::Status::Done, 0);
+    default:
+      return Io_Result (Io_Result::Status::Failed);
     }
+  #else
+    for (;;) {
+      if (const auto n = ::read (handle (), buf, count); n >= 0) {
+        return Io_Result (Io_Result::Status::Done, n);
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return Io_Result (Io_Result::Status::Would_Block);
+      }
+      if (errno != EINTR) {
+        return Io_Result (Io_Result::Status::Failed);
+      }
+    }
+  #endif
   }
 
   /**
-   * @brief Removes all variables.
+   * @brief Writes to the pipe without blocking.
+   *
+   * The pipe has to be in non-blocking mode, see @ref set_nonblocking. Only
+   * part of the data may be written if the pipe has too little space left.
+   *
+   * @param buf - data to write.
+   * @param count - number of bytes to write.
+   * @return the number of bytes written, or whether it would have blocked or
+   *         failed.
    */
-  void clear () {
-    data_.clear ();
+  Io_Result try_write (const void *buf, std::size_t count) {
+  #ifdef _WIN32
+    DWORD written;
+    if (!WriteFile (handle (), buf, count, &written, nullptr)) {
+      return Io_Result (Io_Result::Status::Failed);
+    }
+    // Non-blocking pipes report a full pipe as writing nothing.
+    if (written == 0 && count != 0) {
+      return Io_Result (Io_Result::Status::Would_Block);
+    }
+    return Io_Result (Io_Result::Status::Done, written);
+  #else
+    for (;;) {
+      if (const auto n = ::write (handle (), buf, count); n >= 0) {
+        return Io_Result (Io_Result::Status::Done, n);
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return Io_Result (Io_Result::Status::Would_Block);
+      }
+      if (errno != EINTR) {
+        return Io_Result (Io_Result::Status::Failed);
+      }
+    }
+  #endif
   }
 
   /**
-   * @brief Returns an iterator pointing to the first element.
+   * @brief Waits until the pipe can be read from without blocking.
+   *
+   * This is also the case once the other end was closed.
+   *
+   * @param timeout_ms - maximum time to wait in milliseconds, or a negative
+   *                     value to wait indefinitely.
+   * @return whether the pipe is readable, false on timeout or error.
    */
-  iterator begin () {
-    return data_.begin ();
+  bool wait_readable (int timeout_ms = -1) {
+  #ifdef _WIN32
+    // Anonymous pipes cannot be waited on, so this polls them.
+    const auto deadline = std::chrono::steady_clock::now ()
+                        + std::chrono::milliseconds (timeout_ms);
+    for (;;) {
+      DWORD available;
+      if (!PeekNamedPipe (handle (), nullptr, 0, nullptr, &available, nullptr)) {
+        return GetLastError () == ERROR_BROKEN_PIPE;
+      }
+      if (available != 0) {
+        return true;
+      }
+      if (timeout_ms >= 0 && std::chrono::steady_clock::now () >= deadline) {
+        return false;
+      }
+      Sleep (1);
+    }
+  #else
+    return wait_for (POLLIN, timeout_ms);
+  #endif
   }
 
-  /// @copydoc begin
-  const_iterator begin() const {
-    return data_.begin();
+  /**
+   * @brief Waits until the pipe can be written to without blocking.
+   *
+   * This is also the case once the other end was closed, writing will fail
+   * then.
+   *
+   * On Windows anonymous pipes cannot be waited on for this, so it always
+   * returns true immediately.
+   *
+   * @param timeout_ms - maximum time to wait in milliseconds, or a negative
+   *                     value to wait indefinitely.
+   * @return whether the pipe is writable, false on timeout or error.
+   */
+  bool wait_writable (int timeout_ms = -1) {
+  #ifdef _WIN32
+    (void)timeout_ms;
+    return handle () != INVALID_PIPE;
+  #else
+    return wait_for (POLLOUT, timeout_ms);
+  #endif
   }
 
-  /// @copydoc begin
-  const_iterator cbegin() const {
-    return data_.cbegin();
+  /**
+   * @brief Moves data from the pipe to another handle.
+   *
+   * On Linux this uses `splice` so the data never gets copied to user space,
+   * on other platforms or destinations `splice` does not support it falls back
+   * to a buffered loop.
+   *
+   * @param fd - the destination file, socket, or pipe.
+   * @param count - maximum number of bytes to move, stops earlier at EOF.
+   * @return the number of bytes moved or `std::nullopt` if an error occurred.
+   */
+  std::optional<std::size_t> splice_to (
+    Pipe_Handle fd, std::size_t count = std::numeric_limits<std::size_t>::max ()
+  ) {
+    std::size_t total = 0;
+  #ifdef __linux__
+    while (total < count) {
+      const auto n = ::splice (
+        handle (), nullptr, fd, nullptr, std::min (count - total, CHUNK_SIZE), SPLICE_F_MOVE
+      );
+      if (n > 0) {
+        total += n;
+      }
+      else if (n == 0) {
+        return total;
+      }
+      else if (errno == EINVAL && total == 0) {
+        break;
+      }
+      else if (errno != EINTR) {
+        return std::nullopt;
+      }
+    }
+  #endif
+    return copy_loop (handle (), fd, INVALID_PIPE, count - total, total);
   }
 
   /**
-   * @brief Returns an iterator pointing to the past-the-end element.
+   * @brief Moves data from the pipe to two handles at once.
+   *
+   * On Linux, if `first` is a pipe, the data is duplicated into it with `tee`
+   * and then moved into `second` with `splice`, so it never gets copied to
+   * user space. Otherwise this falls back to a buffered loop.
+   *
+   * @param first - the first destination, ideally a pipe.
+   * @param second - the second destination.
+   * @param count - maximum number of bytes to move, stops earlier at EOF.
+   * @return the number of bytes moved or `std::nullopt` if an error occurred.
    */
-  iterator end () {
-    return data_.end ();
+  std::optional<std::size_t> tee_to (
+    Pipe_Handle first,
+    Pipe_Handle second,
+    std::size_t count = std::numeric_limits<std::size_t>::max ()
+  ) {
+    std::size_t total = 0;
+  #ifdef __linux__
+    while (total < count) {
+      // `tee` returns 0 both at EOF and for an empty pipe, so wait for data
+      // first.
+      pollfd pfd {handle (), POLLIN, 0};
+      if (poll (&pfd, 1, -1) < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return std::nullopt;
+      }
+      auto n = ::tee (handle (), first, std::min (count - total, CHUNK_SIZE), 0);
+      if (n < 0) {
+        if (errno == EINVAL && total == 0) {
+          break;
+        }
+        if (errno == EINTR) {
+          continue;
+        }
+        return std::nullopt;
+      }
+      if (n == 0) {
+        return total;
+      }
+      // Consume exactly what was duplicated.
+      while (n > 0) {
+        const auto m = ::splice (handle (), nullptr, second, nullptr, n, SPLICE_F_MOVE);
+        if (m <= 0) {
+          if (m < 0 && errno == EINTR) {
+            continue;
+          }
+          return std::nullopt;
+        }
+        n -= m;
+        total += m;
+      }
+    }
+  #endif
+    return copy_loop (handle (), first, second, count - total, total);
   }
 
-  /// @copydoc end
-  const_iterator end() const {
-    return data_.end();
+  /**
+   * @brief Moves data from a file into the pipe.
+   *
+   * Reads from the current position of `fd`. On Linux this uses `splice` so
+   * the data never gets copied to user space, on other platforms it falls
+   * back to a buffered loop.
+   *
+   * @param fd - the file to read from.
+   * @param count - maximum number of bytes to move, stops earlier at EOF.
+   * @return the number of bytes moved or `std::nullopt` if an error occurred.
+   */
+  std::optional<std::size_t> copy_from_file (
+    Pipe_Handle fd, std::size_t count = std::numeric_limits<std::size_t>::max ()
+  ) {
+    std::size_t total = 0;
+  #ifdef __linux__
+    while (total < count) {
+      const auto n = ::splice (
+        fd, nullptr, handle (), nullptr, std::min (count - total, CHUNK_SIZE), SPLICE_F_MOVE
+      );
+      if (n > 0) {
+        total += n;
+      }
+      else if (n == 0) {
+        return total;
+      }
+      else if (errno == EINVAL && total == 0) {
+        break;
+      }
+      else if (errno != EINTR) {
+        return std::nullopt;
+      }
+    }
+  #endif
+    return copy_loop (fd, handle (), INVALID_PIPE, count - total, total);
   }
 
-  /// @copydoc end
-  const_iterator cend() const {
-    return data_.cend();
-  }
+#ifdef SPELL_HAS_REACTOR
+  /**
+   * @brief Reads from the pipe once it becomes readable, without blocking the
+   *        thread.
+   *
+   * `co_await pipe.async_read (reactor, buf, count)` suspends the calling
+   * coroutine until the pipe is readable and then behaves like @ref read.
+   * Only one coroutine may wait on a pipe at a time.
+   */
+  detail::Read_Awaiter async_read (Reactor &reactor, void *buf, std::size_t count);
+#endif
 
 private:
-  detail::Env_Set::iterator find (std::string_view key)
-  {
-  #if (defined (__cpp_lib_generic_unordered_lookup) \
-       && __cpp_lib_generic_unordered_lookup == 201811L)
-    return data_.find (key);
-  #else
-    const auto search = detail::Env_Var (key, std::string_view ());
-    return data_.find (search);
-  #endif
-  }
+  static constexpr std::size_t CHUNK_SIZE = 64 * 1024;
 
-  detail::Env_Set::const_iterator find (std::string_view key) const
-  {
-  #if (defined (__cpp_lib_generic_unordered_lookup) \
-       && __cpp_lib_generic_unordered_lookup == 201811L)
-    return data_.find (key);
+#ifndef _WIN32
+  // Writes the buffers `to_iovec` turns the elements into until all of them
+  // are written.
+  template <class T, class F>
+  bool write_vectored (std::span<const T> elements, F &&to_iovec) {
+  #ifdef IOV_MAX
+    constexpr std::size_t MAX_BATCH = std::min (IOV_MAX, 1024);
   #else
-    const auto search = detail::Env_Var (key, std::string_view ());
-    return data_.find (search);
+    constexpr std::size_t MAX_BATCH = 16;
   #endif
+    iovec batch[MAX_BATCH];
+    std::size_t next = 0;
+    // Bytes of the element at `next` which were already written.
+    std::size_t offset = 0;
+    while (next < elements.size ()) {
+      std::size_t n = 0;
+      for (std::size_t i = next; i < elements.size () && n < MAX_BATCH; ++i, ++n) {
+        batch[n] = to_iovec (elements[i]);
+      }
+      batch[0].iov_base = static_cast<char *> (batch[0].iov_base) + offset;
+      batch[0].iov_len -= offset;
+      const auto written = ::writev (handle (), batch, n);
+      if (written < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      auto left = static_cast<std::size_t> (written);
+      for (; next < elements.size (); ++next, offset = 0) {
+        const auto rest = to_iovec (elements[next]).iov_len - offset;
+        if (left < rest) {
+          offset += left;
+          break;
+        }
+        left -= rest;
+      }
+    }
+    return true;
   }
 
-protected:
-  friend class Spell;
+  bool wait_for (short events, int timeout_ms) {
+    using Clock = std::chrono::steady_clock;
+    const auto deadline = Clock::now () + std::chrono::milliseconds (timeout_ms);
+    pollfd pfd {handle (), events, 0};
+    for (;;) {
+      const int n = poll (&pfd, 1, timeout_ms);
+      if (n >= 0) {
+        return n > 0 && !(pfd.revents & POLLNVAL);
+      }
+      if (errno != EINTR) {
+        return false;
+      }
+      if (timeout_ms > 0) {
+        const auto left = std::chrono::ceil<std::chrono::milliseconds> (deadline - Clock::now ());
+        timeout_ms = std::max<int> (left.count (), 0);
+      }
+    }
+  }
+#endif
 
-  // Used by the Spell class to return a constant reference to an empty
-  // environment if its optional is `std::nullopt`.
-  static const Env& empty_env () {
-    static Env instance {false};
-    // The running processes environment may have changed between calls so we
-    // need to load it every time this is called.
-    instance.clear();
-    instance.load();
-    return instance;
+  // Copies up to `count` bytes from `from` to `to` and `also` (if valid)
+  // through a buffer. `total` is the number of bytes that have already been
+  // moved by the caller.
+  static std::optional<std::size_t> copy_loop (
+    Pipe_Handle from, Pipe_Handle to, Pipe_Handle also, std::size_t count, std::size_t total
+  ) {
+    char buf[16 * 1024];
+    Anonymous_Pipe src {from}, dst {to}, dst2 {also};
+    std::optional<std::size_t> result = total;
+    while (count) {
+      const auto r = src.read (buf, std::min (count, sizeof (buf)));
+      if (!r.has_value ()) {
+      #ifndef _WIN32
+        if (errno == EINTR) {
+          continue;
+        }
+      #else
+        // A closed pipe is reported as an error on Windows.
+        if (GetLastError () == ERROR_BROKEN_PIPE) {
+          break;
+        }
+      #endif
+        result = std::nullopt;
+        break;
+      }
+      if (r.value () == 0) {
+        break;
+      }
+      if (!dst.write_all (buf, r.value ())
+          || (also != INVALID_PIPE && !dst2.write_all (buf, r.value ()))) {
+        result = std::nullopt;
+        break;
+      }
+      count -= r.value ();
+      *result += r.value ();
+    }
+    // The handles are borrowed.
+    (void)src.take ();
+    (void)dst.take ();
+    (void)dst2.take ();
+    return result;
   }
 
-private:
-  detail::Env_Set data_;
-};
+#ifdef _WIN32
+  // Reads like a synchronous ReadFile. On overlapped pipes a read that does
+  // not finish right away is cancelled unless `wait` is set, which fails
+  // with ERROR_NO_DATA like a read of a non-blocking pipe.
+  BOOL read_file (void *buf, std::size_t count, DWORD *nread, bool wait = true) {
+    if (!overlapped_) {
+      return ReadFile (handle (), buf, static_cast<DWORD> (count), nread, nullptr);
+    }
+    // Each read has its own event, the handle is also signaled by reads
+    // other threads started on it.
+    OVERLAPPED ov {};
+    ov.hEvent = CreateEventA (nullptr, true, false, nullptr);
+    if (ov.hEvent == nullptr) {
+      return false;
+    }
+    BOOL ok = ReadFile (handle (), buf, static_cast<DWORD> (count), nullptr, &ov)
+              || GetLastError () == ERROR_IO_PENDING;
+    if (ok) {
+      if (!wait) {
+        // Fails if the read already finished, which keeps its result.
+        CancelIoEx (handle (), &ov);
+      }
+      ok = GetOverlappedResult (handle (), &ov, nread, true);
+    }
+    const DWORD error = GetLastError ();
+    CloseHandle (ov.hEvent);
+    SetLastError (!wait && error == ERROR_OPERATION_ABORTED ? ERROR_NO_DATA : error);
+    return ok;
+  }
+#endif
 
-/**
- * @brief Describes what to do with a standard I/O stream for a child process.
- *
- * Used for the `set_stdin`, `set_stdout`, and `set_stderr` methods of @ref Spell.
- */
-enum class Stdio {
-  Default,
-  Inherit,
-  Piped,
-  Null
+  Pipe_Handle inner_;
+#ifdef _WIN32
+  bool overlapped_ = false;
+#endif
 };
 
+namespace detail {
+// A vector of trivially copyable elements that stores up to `N` of them
+// inline before allocating.
+template <class T, std::size_t N>
+class Small_Vector {
+  static_assert (std::is_trivially_copyable_v<T>);
 
-/**
- * @brief Describes the result of a process.
- */
-class Exit_Status {
 public:
-  explicit Exit_Status (int code)
-  : code_ (code)
-  {}
+  Small_Vector () = default;
 
-  /**
-   * @brief Returns the exit code.
-   */
-  int code () const {
-    return code_;
+  Small_Vector (const Small_Vector &other) {
+    append (other.data (), other.size ());
   }
 
-  /**
-   * @brief Was the exit status zero?
-   */
-  bool success () const {
-    return code () == 0;
+  Small_Vector (Small_Vector &&other) noexcept {
+    *this = std::move (other);
+  }
+
+  Small_Vector& operator= (const Small_Vector &other) {
+    if (this != &other) {
+      size_ = 0;
+      append (other.data (), other.size ());
+    }
+    return *this;
+  }
+
+  Small_Vector& operator= (Small_Vector &&other) noexcept {
+    if (this == &other) {
+      return *this;
+    }
+    if (other.heap_) {
+      heap_ = std::move (other.heap_);
+      data_ = heap_.get ();
+      capacity_ = other.capacity_;
+    }
+    else {
+      heap_.reset ();
+      data_ = inline_;
+      capacity_ = N;
+      std::copy_n (other.inline_, other.size_, inline_);
+    }
+    size_ = other.size_;
+    other.data_ = other.inline_;
+    other.capacity_ = N;
+    other.size_ = 0;
+    return *this;
+  }
+
+  T* data () {
+    return data_;
+  }
+
+  const T* data () const {
+    return data_;
+  }
+
+  std::size_t size () const {
+    return size_;
+  }
+
+  T& operator[] (std::size_t i) {
+    return data_[i];
+  }
+
+  const T& operator[] (std::size_t i) const {
+    return data_[i];
+  }
+
+  void reserve (std::size_t n) {
+    if (n <= capacity_) {
+      return;
+    }
+    const auto capacity = std::max (n, capacity_ * 2);
+    auto heap = std::make_unique<T[]> (capacity);
+    std::copy_n (data_, size_, heap.get ());
+    heap_ = std::move (heap);
+    data_ = heap_.get ();
+    capacity_ = capacity;
+  }
+
+  void push_back (const T &value) {
+    append (&value, 1);
+  }
+
+  // `values` may point into the vector itself.
+  void append (const T *values, std::size_t count) {
+    if (size_ + count > capacity_) {
+      const bool inside = values >= data_ && values < data_ + size_;
+      const auto offset = values - data_;
+      reserve (size_ + count);
+      if (inside) {
+        values = data_ + offset;
+      }
+    }
+    std::copy_n (values, count, data_ + size_);
+    size_ += count;
+  }
+
+  void pop_back () {
+    --size_;
+  }
+
+  void clear () {
+    size_ = 0;
   }
 
 private:
-  int code_;
+  T inline_[N] {};
+  std::unique_ptr<T[]> heap_;
+  T *data_ = inline_;
+  std::size_t size_ = 0;
+  std::size_t capacity_ = N;
 };
+} // namespace detail
 
 /**
- * @brief The output of a finished process.
+ * @brief List of command arguments.
+ *
+ * The bytes of all arguments are stored in a single buffer, with the first
+ * few short arguments fitting into the object itself, so adding them does not
+ * allocate. Arguments added with @ref borrow are not copied at all, the
+ * caller has to keep the memory alive and unchanged while the arguments are
+ * used. The arguments are not terminated, launching a spell copies them into
+ * the argument array it passes to the system.
+ *
+ * Elements are accessed through @ref Arg handles that behave like a reference
+ * to a string: they convert to `std::string_view`, compare with strings, and
+ * can be assigned to or have individual characters modified. Writing to a
+ * borrowed argument copies it first.
  */
-struct Output {
-  Output (Exit_Status &&s)
-  : status (s),
-    stdout_ {},
-    stderr_ {}
-  {}
+class Args {
+  struct Slot {
+    // Points to the argument if it is borrowed.
+    const char *borrowed = nullptr;
+    // Offset into `bytes_` if it is not borrowed.
+    std::size_t offset = 0;
+    std::size_t size = 0;
+  };
 
-  /**
-   * The status of the process.
-   */
-  Exit_Status status;
+public:
+  class iterator;
 
   /**
-   * The data that the process wrote to stdout.
+   * @brief A reference to a single argument.
    */
-  std::vector<char> stdout_;
+  class Arg {
+  public:
+    operator std::string_view () const {
+      return owner_->view (index_);
+    }
 
-  /**
-   * The data that the process wrote to stderr.
-   */
-  std::vector<char> stderr_;
+    std::string_view view () const {
+      return owner_->view (index_);
+    }
 
-  /**
-   * @brief Constructs a container out of the data that the process wrote to stdout.
-   * @tparam Container Any type that can be constructed from a begin-end pair of iterators over `char`s.
-   */
-  template <class Container>
-    Container collect_stdout () const {
-      return Container { stdout_.begin (), stdout_.end () };
+    const char* data () const {
+      return view ().data ();
     }
 
-  /**
-   * @brief Constructs a container out of the data that the process wrote to stderr.
-   * @tparam Container Any type that can be constructed from a begin-end pair of iterators over `char`s.
-   */
-  template <class Container>
-    Container collect_stderr () const {
-      return Container { stderr_.begin (), stderr_.end () };
+    std::size_t size () const {
+      return owner_->slots_[index_].size;
     }
-};
 
-/**
- * @brief Representation of a running or exited child process.
- */
-class Child {
-protected:
-  Child (Pid pid, Anonymous_Pipe &&i, Anonymous_Pipe &&o, Anonymous_Pipe &&e)
-  : pid_ (pid),
-    status_ (-1),
-    stdin_ (std::move (i)),
-    stdout_ (std::move (o)),
-    stderr_ (std::move (e))
-  {}
-  friend class Spell;
+    bool empty () const {
+      return size () == 0;
+    }
 
-public:
-  /**
-   * @brief Returns the process ID.
-   *
-   * Note: This is actually the processes handle on Windows.
-   */
-  Pid id () const {
-    return pid_;
-  }
+    /**
+     * @brief Whether the argument refers to memory of the caller.
+     */
+    bool borrowed () const {
+      return owner_->slots_[index_].borrowed != nullptr;
+    }
+
+    char& operator[] (std::size_t i) {
+      return owner_->own (index_)[i];
+    }
+
+    char operator[] (std::size_t i) const {
+      return view ()[i];
+    }
+
+    /**
+     * @brief Replaces the argument with a copy of the given string.
+     */
+    Arg& operator= (std::string_view value) {
+      owner_->assign (index_, value);
+      return *this;
+    }
+
+    /// @copydoc operator=(std::string_view)
+    Arg& operator= (const Arg &other) {
+      return *this = other.view ();
+    }
+
+    friend bool operator== (const Arg &lhs, const Arg &rhs) {
+      return lhs.view () == rhs.view ();
+    }
+
+    friend bool operator== (const Arg &lhs, std::string_view rhs) {
+      return lhs.view () == rhs;
+    }
+
+  private:
+    friend class Args;
+    friend class iterator;
+
+    Arg (Args *owner, std::size_t index)
+    : owner_ (owner),
+      index_ (index)
+    {}
+
+    Args *owner_;
+    std::size_t index_;
+  };
 
   /**
-   * @brief Gets the exit status of the child if it has already exited.
+   * @brief Iterates over @ref Arg handles.
    *
-   * @return If the child has exited, then the exit status of the child if returned.
-   *         If the exit status is not available then `std::nullopt` is returned.
+   * The handle is stored in the iterator, so `for (auto &arg : args)` works,
+   * but references to it do not outlive the iterator.
    */
-  std::optional<Exit_Status> try_wait () {
-  #ifdef _WIN32
-    if (WaitForSingleObject (id (), 0) == WAIT_OBJECT_0) {
-      DWORD status;
-      GetExitCodeProcess (id (), &status);
-      status_ = status;
-      CloseHandle (id ());
-      return Exit_Status (status_);
+  class iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = Arg;
+    using difference_type = std::ptrdiff_t;
+    using pointer = Arg*;
+    using reference = Arg&;
+
+    Arg& operator* () const {
+      return arg_;
     }
-  #else
-    if (int status = 0; waitpid (id (), &status, WNOHANG) > 0) {
-      status_ = status;
-      return Exit_Status (status);
+
+    Arg* operator-> () const {
+      return &arg_;
     }
-  #endif
-    return std::nullopt;
-  }
+
+    iterator& operator++ () {
+      ++arg_.index_;
+      return *this;
+    }
+
+    iterator operator++ (int) {
+      auto copy = *this;
+      ++arg_.index_;
+      return copy;
+    }
+
+    bool operator== (const iterator &other) const {
+      return arg_.index_ == other.arg_.index_;
+    }
+
+  private:
+    friend class Args;
+
+    iterator (Args *owner, std::size_t index)
+    : arg_ (owner, index)
+    {}
+
+    mutable Arg arg_;
+  };
 
   /**
-   * @brief Waits for the child to exit, returning its exit status.
-   *
-   * This function will continue to have the same return value after it has
-   * been called at least once.
-   *
-   * The stdin of the child gets closed before waiting to prevent a deadlock.
+   * @brief Iterates over the arguments as `std::string_view`s.
    */
-  Exit_Status wait () {
-  #ifdef _WIN32
-    if (status_ != -1) {
-      return Exit_Status (status_);
+  class const_iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = void;
+    using reference = std::string_view;
+
+    std::string_view operator* () const {
+      return owner_->view (index_);
     }
-    stdin_.drop ();
-    DWORD status;
-    WaitForSingleObject (id (), INFINITE);
-    GetExitCodeProcess (id (), &status);
-    CloseHandle (id ());
-    return Exit_Status (status);
-  #else
-    if (status_ != -1) {
-      return Exit_Status (WEXITSTATUS (status_));
+
+    const_iterator& operator++ () {
+      ++index_;
+      return *this;
+    }
+
+    const_iterator operator++ (int) {
+      auto copy = *this;
+      ++index_;
+      return copy;
+    }
+
+    friend bool operator== (const const_iterator &lhs, const const_iterator &rhs) {
+      return lhs.index_ == rhs.index_;
+    }
+
+  private:
+    friend class Args;
+
+    const_iterator (const Args *owner, std::size_t index)
+    : owner_ (owner),
+      index_ (index)
+    {}
+
+    const Args *owner_;
+    std::size_t index_;
+  };
+
+  Args () = default;
+
+  Args (std::initializer_list<std::string_view> args) {
+    reserve (args.size ());
+    for (const auto arg : args) {
+      push_back (arg);
     }
-    stdin_.drop ();
-    int status;
-    pid_t wpid;
-    while ((wpid = waitpid (id (), &status, 0)) > 0) {}
-    status_ = status;
-    return Exit_Status (WEXITSTATUS (status));
-  #endif
   }
 
-  /**
-   * @brief Waits for the child to exit, collecting its remaining output and returning it.
-   *
-   * The returned @ref Output instance will continue to have the same exit status after it
-   * has been called at least once but the stdout and stderr will only contain data after
-   * the first call.
-   *
-   * The stdin of the child gets closed before waiting to prevent a deadlock.
-   */
-  Output wait_with_output () {
-    Output o {wait ()};
-    stdout_.read_all (o.stdout_);
-    stderr_.read_all (o.stderr_);
-    return o;
+  std::size_t size () const {
+    return slots_.size ();
   }
 
-  /**
-   * @brief Forces the child process to exit.
-   *
-   * This is equivalent to sending a SIGKILL on Unix platforms and calling
-   * TerminateProcess on Windows.
-   *
-   * @return Whether the child was killed (`true`) or had already exited (`false`).
-   */
-  bool kill () {
-  #ifdef _WIN32
-    if (TerminateProcess (id (), 0)) {
-      CloseHandle (id ());
-      return true;
-    }
-    return false;
-  #else
-    return ::kill (id (), SIGKILL) != -1;
-  #endif
+  bool empty () const {
+    return size () == 0;
+  }
+
+  Arg operator[] (std::size_t i) {
+    return Arg (this, i);
+  }
+
+  std::string_view operator[] (std::size_t i) const {
+    return view (i);
+  }
+
+  iterator begin () {
+    return iterator (this, 0);
+  }
+
+  iterator end () {
+    return iterator (this, size ());
+  }
+
+  const_iterator begin () const {
+    return const_iterator (this, 0);
+  }
+
+  const_iterator end () const {
+    return const_iterator (this, size ());
   }
 
   /**
-   * @brief Returns a reference to the childs standard input (stdin).
+   * @brief Reserves space for the given number of arguments and bytes of
+   *        copied arguments.
    */
-  Anonymous_Pipe& get_stdin () {
-    return stdin_;
+  void reserve (std::size_t count, std::size_t bytes = 0) {
+    slots_.reserve (count);
+    bytes_.reserve (bytes);
   }
 
   /**
-   * @brief Returns a reference to the childs standard output (stdout).
+   * @brief Appends a copy of the argument.
    */
-  Anonymous_Pipe& get_stdout () {
-    return stdout_;
+  void push_back (std::string_view arg) {
+    const auto offset = append_bytes (arg);
+    slots_.push_back ({nullptr, offset, arg.size ()});
+  }
+
+  /// @copydoc push_back
+  void emplace_back (std::string_view arg) {
+    push_back (arg);
   }
 
   /**
-   * @brief Returns a reference to the childs standard error (stderr).
+   * @brief Appends the argument without copying it.
+   *
+   * The memory of `arg` has to stay valid and unchanged as long as the
+   * argument is part of the list.
    */
-  Anonymous_Pipe& get_stderr () {
-    return stderr_;
+  void borrow (std::string_view arg) {
+    slots_.push_back ({arg.data (), 0, arg.size ()});
+  }
+
+  void pop_back () {
+    slots_.pop_back ();
+  }
+
+  void clear () {
+    slots_.clear ();
+    bytes_.clear ();
+  }
+
+  friend bool operator== (const Args &lhs, const Args &rhs) {
+    return std::equal (lhs.begin (), lhs.end (), rhs.begin (), rhs.end ());
   }
 
 private:
-  Pid pid_;
-  int status_;
-  Anonymous_Pipe stdin_;
-  Anonymous_Pipe stdout_;
-  Anonymous_Pipe stderr_;
+  std::string_view view (std::size_t i) const {
+    const auto &slot = slots_[i];
+    return std::string_view (
+      slot.borrowed != nullptr ? slot.borrowed : bytes_.data () + slot.offset,
+      slot.size
+    );
+  }
+
+  // Copies the bytes and returns their offset.
+  std::size_t append_bytes (std::string_view str) {
+    const auto offset = bytes_.size ();
+    bytes_.append (str.data (), str.size ());
+    return offset;
+  }
+
+  // Returns the writable bytes of the argument, copying it if it is borrowed.
+  char* own (std::size_t i) {
+    auto &slot = slots_[i];
+    if (slot.borrowed != nullptr) {
+      slot.offset = append_bytes (std::string_view (slot.borrowed, slot.size));
+      slot.borrowed = nullptr;
+    }
+    return bytes_.data () + slot.offset;
+  }
+
+  void assign (std::size_t i, std::string_view value) {
+    auto &slot = slots_[i];
+    if (slot.borrowed == nullptr && value.size () <= slot.size) {
+      char *data = bytes_.data () + slot.offset;
+      std::memmove (data, value.data (), value.size ());
+    }
+    else {
+      // The old bytes stay unused until the list is cleared.
+      slot.offset = append_bytes (value);
+      slot.borrowed = nullptr;
+    }
+    slot.size = value.size ();
+  }
+
+  detail::Small_Vector<char, 128> bytes_;
+  detail::Small_Vector<Slot, 8> slots_;
 };
 
+namespace detail {
+class Exec_Block;
+} // namespace detail
 
 /**
- * Command builder.
+ * @brief An environment mapping.
  *
- * `Spell(program)` generates a spell in the default configuration.
- * Additional builder methods allow the configuration to be changed prior to launch.
- * All of these builder methods return a reference to the spell, unless stated otherwise.
+ * A mapping loaded from the current process environment does not copy it.
+ * Instead it refers to a shared snapshot of it and only stores the variables
+ * set or removed on top of it. The whole mapping is only copied once it is
+ * iterated.
  */
-class Spell {
+class Env {
+public:
+  using iterator = detail::Env_Set::iterator;
+  using const_iterator = detail::Env_Set::const_iterator;
+
 public:
   /**
-   * @brief Constructs a new `Spell` for launching the program at path `program`.
-   *
-   * It has the following configuration:
-   *  - No arguments to the program
-   *  - Inherit the environment of the current process
-   *  - Inherit the current working directory
-   *  - stdin/stdout/stderr are set to @ref Stdio::Default
+   * @brief Creates an environment mapping that's either empty or copies the
+   *        current processes environment.
    *
-   *  If `program` is not an absolute path it is resolved by respective process
-   *  execution function (CreateProcess for Windows, execvpe for other platforms).
+   * @param load - Whether to load the current processes environment.
+   */
+  Env (bool load = true)
+  : base_ {},
+    data_ {},
+    removed_ {},
+    version_ (detail::next_version ())
+  {
+    if (load) {
+      this->load();
+    }
+  }
+
+  /**
+   * @brief Loads the current environment from the system.
    *
-   *  @param program - path or name of the program
+   * Variables that are already in the mapping are not changed.
    */
-  Spell (std::string_view program)
-  : program_ (program),
-    args_ {},
-    env_ (std::nullopt),
-    working_dir_ (std::filesystem::current_path ()),
-    stdout_ (Stdio::Default),
-    stderr_ (Stdio::Default),
-    stdin_ (Stdio::Default)
-  {}
+  void load() {
+    version_ = detail::next_version ();
+    auto snapshot = detail::env_snapshot ();
+    if (!base_ && data_.empty () && removed_.empty ()) {
+      base_ = std::move (snapshot);
+      return;
+    }
+    flatten ();
+    for (const auto &var : snapshot->vars) {
+      data_.insert (var);
+    }
+  }
 
   /**
-   * @brief Constructs a spell from the given command line string.
+   * @brief Gets the value of a variable.
    *
-   * Takes a string containing a program and it's argument (for example 'echo Hello World')
-   * and turns it into a spell for that program with the given arguments.
+   * @param key - Name of the variable.
+   * @return value of the variable of an empty string if does not exist.
+   */
+  std::string_view get (std::string_view key) const {
+    if (const auto var = find (key)) {
+      return var->value ();
+    }
+    return {};
+  }
+
+  /**
+   * @brief Alias for @ref get().
    *
-   * @param command_line - Space-delimited string of the program and it's arguments.
-   *                       Spaces can be escaped with a blackslash and are ignored
-   *                       inside a string. Strings use either single or double quotes,
-   *                       the quotes will not be included in the argument added to the
-   *                       spell.
-   * @return A @ref Spell object with arguments from the given command line string.
+   * Cannot be used to insert/change a value.
    */
-  static Spell from_string (std::string_view command_line) {
-    std::string chomped;
-    auto chomp = [&] () -> const std::string& {
-      auto it = command_line.begin ();
-      const auto end = command_line.end ();
-      auto in_string = '\0';
-      chomped.clear ();
-      for (; it != end; ++it) {
-        switch (*it) {
-          case '\\':
-            ++it;
-            if (it == end) {
-              break;
-            }
-            chomped.push_back (*it);
-            break;
-          case '\'':
-          case '"':
-            if (in_string == '\0') {
-              in_string = *it;
-            }
-            else if (*it == in_string) {
-              in_string = '\0';
-            }
-            else {
-              chomped.push_back (*it);
-            }
-            break;
-          case ' ':
-            if (in_string == '\0') {
-              goto break_;
-            }
-            else {
-              chomped.push_back (' ');
-            }
-            break;
-          default:
-            chomped.push_back (*it);
-            break;
-        }
-      }
-    break_:
-      command_line.remove_prefix (std::distance (command_line.begin (), it));
-      while (command_line.front () == ' ') {
-        command_line.remove_prefix (1);
-      }
-      return chomped;
-    };
-    auto spell = Spell (chomp ());
-    std::string_view arg;
-    while (!(arg = chomp ()).empty ()) {
-      spell.arg (arg);
-    }
-    return spell;
+  std::string_view operator[] (std::string_view key) const {
+    return get (key);
   }
 
   /**
-   * @brief Returns the path to the program that was given to the constructor.
+   * @brief Insert of change a variable.
+   * @param key - Name of the variable.
+   * @param value - Value of the variable.
    */
-  std::string_view get_program () const {
-    return program_;
+  void set (std::string_view key, std::string_view value) {
+    version_ = detail::next_version ();
+    if (auto it = detail::find_var (removed_, key); it != removed_.end ()) {
+      removed_.erase (it);
+    }
+    if (auto it = detail::find_var (data_, key); it != data_.end ()) {
+      // The hashset gives us a constant iterator as we shouldn't mutate
+      // elements of a set. However both hashing and comparison of `Env_Var`s
+      // only depends on the key part so we can safely change the value here.
+      auto &x = const_cast<detail::Env_Var &> (*it);
+      x.value (value);
+    }
+    else {
+      data_.emplace (key, value);
+    }
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Arguments
-
   /**
-   * @brief Adds an argument to pass to the program.
-   *
-   * These are equivalent to the individual `argv` elements so only one arguments can be passed per use.
-   * Use @ref args to pass multiple arguments.
-   *
-   * @param arg - the argument to add.
+   * @brief Removes a variable.
+   * @param key - Name of the variable.
    */
-  Spell& arg (std::string_view arg) {
-    args_.emplace_back (arg);
-    return *this;
+  void remove (std::string_view key) {
+    if (!find (key)) {
+      return;
+    }
+    version_ = detail::next_version ();
+    if (auto it = detail::find_var (data_, key); it != data_.end ()) {
+      data_.erase (it);
+    }
+    if (base_ && detail::find_var (base_->vars, key) != base_->vars.end ()) {
+      removed_.emplace (key, std::string_view ());
+    }
   }
 
   /**
-   * @brief Adds multiple arguments to add to the program.
-   *
-   * Use @ref arg to pass a single argument.
-   *
-   * @param args - the arguments to add.
+   * @brief Change the name of a variable.
+   * @param key - Current name of the variable.
+   * @param key_key - Name to give to the variable.
    */
-  Spell& args (const std::vector<std::string_view> &args) {
-    for (const auto &a : args) {
-      args_.emplace_back (a);
+  void rename (std::string_view key, std::string_view new_key) {
+    if (const auto var = find (key)) {
+      const std::string value {var->value ()};
+      remove (key);
+      set (new_key, value);
     }
-    return *this;
   }
 
-  /// @copydoc args
-  template <class... Args>
-  Spell& args (const Args&... args) {
-    (args_.emplace_back (args), ...);
-    return *this;
+  /**
+   * @brief Removes all variables.
+   */
+  void clear () {
+    version_ = detail::next_version ();
+    base_.reset ();
+    data_.clear ();
+    removed_.clear ();
   }
 
   /**
-   * @brief Returns a mutable reference to the arguments.
+   * @brief Returns an iterator pointing to the first element.
    */
-  Args& get_args () {
-    return args_;
+  iterator begin () {
+    flatten ();
+    return data_.begin ();
+  }
+
+  /// @copydoc begin
+  const_iterator begin() const {
+    flatten ();
+    return data_.begin();
+  }
+
+  /// @copydoc begin
+  const_iterator cbegin() const {
+    flatten ();
+    return data_.cbegin();
   }
 
   /**
-   * @brief Returns a constant reference to the arguments.
+   * @brief Returns an iterator pointing to the past-the-end element.
    */
-  const Args& get_args () const {
-    return args_;
+  iterator end () {
+    flatten ();
+    return data_.end ();
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Environment
+  /// @copydoc end
+  const_iterator end() const {
+    flatten ();
+    return data_.end();
+  }
+
+  /// @copydoc end
+  const_iterator cend() const {
+    flatten ();
+    return data_.cend();
+  }
 
   /**
-   * @brief Inserts or updates an environment variable.
-   * @param key - name of the variable
-   * @param val - value of the variable
+   * @brief Returns a number identifying the current contents.
+   *
+   * It changes whenever the mapping is modified, copies of a mapping have the
+   * same version as the original until either of them is modified.
    */
-  Spell& env (std::string_view key, std::string_view val) {
-    if (!env_.has_value ()) {
-      env_.emplace ();
+  std::uint64_t version () const {
+    return version_;
+  }
+
+private:
+  const detail::Env_Var* find (std::string_view key) const {
+    if (auto it = detail::find_var (data_, key); it != data_.end ()) {
+      return &*it;
     }
-    env_->set (key, val);
-    return *this;
+    if (!base_ || detail::find_var (removed_, key) != removed_.end ()) {
+      return nullptr;
+    }
+    if (auto it = detail::find_var (base_->vars, key); it != base_->vars.end ()) {
+      return &*it;
+    }
+    return nullptr;
   }
 
-  /**
-   * @brief Adds of updates multiple environment variables.
-   * @param vars - Span of {key, value} pairs
-   */
-  Spell& envs (std::span<std::pair<std::string_view, std::string_view>> vars) {
-    if (!env_.has_value ()) {
-      env_.emplace ();
+  // Calls `f` with every variable in the mapping without copying the
+  // snapshot.
+  template <class F>
+  void for_each (F &&f) const {
+    for (const auto &var : data_) {
+      f (var);
     }
-    for (const auto &[key, val] : vars) {
-      env_->set (key, val);
+    if (!base_) {
+      return;
+    }
+    for (const auto &var : base_->vars) {
+      if (detail::find_var (data_, var.key ()) == data_.end ()
+          && detail::find_var (removed_, var.key ()) == removed_.end ()) {
+        f (var);
+      }
     }
-    return *this;
   }
 
-  /**
-   * @brief Clears the entire environment for the child process.
-   */
-  Spell& env_clear () {
-    if (!env_.has_value ()) {
-      env_.emplace (false);
+  // Copies the variables of the snapshot into the mapping. This does not
+  // change the contents of the mapping, only how they are stored, so it is
+  // done for iteration over constant mappings as well.
+  void flatten () const {
+    if (!base_) {
+      return;
     }
-    else {
-      env_->clear ();
+    for (const auto &var : base_->vars) {
+      if (detail::find_var (removed_, var.key ()) == removed_.end ()) {
+        // Does not replace variables that have been set.
+        data_.insert (var);
+      }
     }
-    return *this;
+    base_.reset ();
+    removed_.clear ();
   }
 
-  /**
-   * @brief Removes an environment variable.
-   * @param key - name of the variable.
-   */
-  Spell& env_remove (std::string_view key) {
-    if (!env_.has_value ()) {
-      env_.emplace ();
+protected:
+  friend class Spell;
+  friend class detail::Exec_Block;
+
+  // Used by the Spell class to return a constant reference to an empty
+  // environment if its optional is `std::nullopt`.
+  static const Env& empty_env () {
+    // One per thread since the instance is modified.
+    thread_local Env instance {false};
+    // The running processes environment may have changed between calls so we
+    // need to load it every time this is called. This only takes a new
+    // snapshot if it did change.
+    if (instance.base_ != detail::env_snapshot ()) {
+      instance.clear();
+      instance.load();
     }
-    env_->remove (key);
+    return instance;
+  }
+
+private:
+  mutable std::shared_ptr<const detail::Env_Snapshot> base_;
+  mutable detail::Env_Set data_;
+  // Variables of the snapshot that have been removed, only the keys are used.
+  mutable detail::Env_Set removed_;
+  std::uint64_t version_;
+};
+
+namespace detail {
+
+/**
+ * Program, arguments, and environment of a spell, serialized into the form
+ * needed for launching a process.
+ *
+ * On Unix platforms the `argv` and `envp` arrays and all the string bytes
+ * they point to live in a single allocation. Copies are empty and need to be
+ * built again as they would point into the arena of the original.
+ */
+class Exec_Block {
+public:
+  Exec_Block () = default;
+
+  Exec_Block (const Exec_Block &)
+  : Exec_Block ()
+  {}
+
+  Exec_Block (Exec_Block &&) = default;
+
+  Exec_Block& operator= (const Exec_Block &) {
+    invalidate ();
     return *this;
   }
 
-  /**
-   * @brief Get a mutable reference to the environment for the child process.
-   *
-   * See @ref Env.
-   */
-  Env& get_envs () {
-    if (!env_.has_value ()) {
-      env_.emplace ();
+  Exec_Block& operator= (Exec_Block &&) = default;
+
+  void invalidate () {
+    valid_ = false;
+  }
+
+  /// Whether the block was built from the given arguments and environment.
+  bool matches (const Args &args, const Env *env) const {
+    if (!valid_ || (env != nullptr) != has_env_
+        || (env != nullptr && env->version () != env_version_)
+        || args.size () != argc_) {
+      return false;
     }
-    return env_.value ();
+    for (std::size_t i = 0; i < args.size (); ++i) {
+    #ifdef _WIN32
+      const std::string_view arg = args_[i];
+    #else
+      const std::string_view arg = arena_[i + 1];
+    #endif
+      if (arg != args[i]) {
+        return false;
+      }
+    }
+    return true;
   }
 
-  /**
-   * @brief Get a constant reference to the environment for the child process.
-   *
-   * See @ref Env.
-   */
-  const Env& get_envs () const {
-    if (!env_.has_value ()) {
-      return Env::empty_env ();
+  void build (std::string_view program, const Args &args, const Env *env) {
+    has_env_ = env != nullptr;
+    env_version_ = has_env_ ? env->version () : 0;
+    argc_ = args.size ();
+  #ifdef _WIN32
+    command_line_.assign (program);
+    for (const auto &arg : args) {
+      command_line_.push_back (' ');
+      command_line_.append (arg);
     }
-    return env_.value ();
+    environment_.clear ();
+    if (has_env_) {
+      env->for_each ([this] (const Env_Var &var) {
+        environment_.append (var.unwrap ());
+        environment_.push_back ('\0');
+      });
+      // The block is terminated by an empty string.
+      environment_.push_back ('\0');
+    }
+    args_.clear ();
+    for (const auto arg : args) {
+      args_.emplace_back (arg);
+    }
+  #else
+    std::size_t slots = args.size () + 2;
+    std::size_t bytes = program.size () + 1;
+    for (const auto &arg : args) {
+      bytes += arg.size () + 1;
+    }
+    if (has_env_) {
+      env->for_each ([&slots, &bytes] (const Env_Var &var) {
+        ++slots;
+        bytes += var.unwrap ().size () + 1;
+      });
+      ++slots;
+    }
+    arena_.assign (slots + (bytes + sizeof (char *) - 1) / sizeof (char *), nullptr);
+    char **p = arena_.data ();
+    char *b = reinterpret_cast<char *> (p + slots);
+    auto put = [&p, &b] (std::string_view str) {
+      *p++ = b;
+      std::memcpy (b, str.data (), str.size ());
+      b += str.size ();
+      *b++ = '\0';
+    };
+    put (program);
+    for (const auto &arg : args) {
+      put (arg);
+    }
+    *p++ = nullptr;
+    envp_ = 0;
+    if (has_env_) {
+      envp_ = static_cast<std::size_t> (p - arena_.data ());
+      env->for_each ([&put] (const Env_Var &var) {
+        put (var.unwrap ());
+      });
+      *p++ = nullptr;
+    }
+  #endif
+    valid_ = true;
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Directory
+#ifdef _WIN32
+  char* command_line () {
+    return command_line_.data ();
+  }
 
-  /**
-   * @brief Sets the working directory for the child process.
-   *
-   * The given path gets canonicalized.
-   *
-   * @param dir - absolute or relative path to working directory.
-   */
-  Spell& current_dir (const std::filesystem::path &dir) {
-    if (dir.is_absolute ())
-      working_dir_ = dir;
-    else
-      working_dir_ = std::filesystem::weakly_canonical (working_dir_ / dir);
-    return *this;
+  /// Returns `nullptr` if the environment is inherited.
+  void* environment () {
+    return has_env_ ? reinterpret_cast<void *> (environment_.data ()) : nullptr;
+  }
+#else
+  const char* program () const {
+    return arena_[0];
   }
 
-  /**
-   * @brief Returns the working directory for the child process.
-   */
-  const std::filesystem::path &get_current_dir () const {
-    return working_dir_;
+  char* const* argv () const {
+    return arena_.data ();
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Streams
+  /// Returns `nullptr` if the environment is inherited.
+  char* const* envp () const {
+    return has_env_ ? arena_.data () + envp_ : nullptr;
+  }
+#endif
 
-  /**
-   * @brief Configuration for the child process's standard output handle.
-   *
-   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
-   * and defaults to @ref Stdio::Piped when used with @ref cast_output.
+private:
+#ifdef _WIN32
+  std::string command_line_;
+  std::string environment_;
+  std::vector<std::string> args_;
+#else
+  std::vector<char *> arena_;
+  std::size_t envp_ = 0;
+#endif
+  std::size_t argc_ = 0;
+  std::uint64_t env_version_ = 0;
+  bool has_env_ = false;
+  bool valid_ = false;
+};
+
+} // namespace detail
+
+/**
+ * @brief Describes what to do with a standard I/O stream for a child process.
+ *
+ * Used for the `set_stdin`, `set_stdout`, and `set_stderr` methods of @ref Spell.
+ * Besides the constants @ref Default, @ref Inherit, @ref Piped, and @ref Null
+ * a stream can be connected to a file with @ref File, or to an existing
+ * handle with @ref from_handle. These are given to the child directly, no
+ * data passes through the calling process.
+ */
+class Stdio {
+  enum class Kind {
+    Default,
+    Inherit,
+    Piped,
+    Null,
+    File,
+    Handle,
+    Mapped
+  };
+
+  Stdio (Kind kind)
+  : kind_ (kind),
+    path_ {},
+    mode_ (File_Mode::Read),
+    handle_ (INVALID_PIPE)
+  {}
+
+  friend class Spell;
+
+public:
+  /// @brief Use the default of the function used to launch the child.
+  static const Stdio Default;
+  /// @brief The child inherits the stream of the calling process.
+  static const Stdio Inherit;
+  /// @brief A pipe connecting the stream to the calling process is created.
+  static const Stdio Piped;
+  /// @brief The stream is connected to the null device.
+  static const Stdio Null;
+  /**
+   * @brief The stream is written to an anonymous in-memory file, which
+   *        @ref Output maps once the child has exited.
    *
-   * See @ref Stdio.
+   * This avoids copying large outputs through a pipe, see
+   * @ref Output::stdout_data. The file is only read by
+   * @ref Child::wait_with_output and the functions using it, the pipe
+   * returned by @ref Child::get_stdout or @ref Child::get_stderr is
+   * invalid. Launching fails if it is used for stdin.
    *
-   * @param cfg - new configuration or @ref Stdio::Default.
+   * Uses `memfd_create` on Linux, an unlinked temporary file on other Unix
+   * platforms, and a temporary file that is deleted once closed on Windows.
    */
-  Spell& set_stdout (Stdio cfg) {
-    stdout_ = cfg;
-    return *this;
+  static const Stdio Mapped;
+
+  /**
+   * @brief Connects the stream to a file.
+   *
+   * The file is opened every time the child is launched, if it cannot be
+   * opened launching fails.
+   *
+   * @param path - path to the file.
+   * @param mode - how to open the file, see @ref File_Mode.
+   */
+  static Stdio File (const std::filesystem::path &path, File_Mode mode = File_Mode::Truncate) {
+    Stdio s {Kind::File};
+    s.path_ = path;
+    s.mode_ = mode;
+    return s;
   }
 
   /**
-   * @brief Configuration for the child process's standard error handle.
+   * @brief Connects the stream to an existing handle.
    *
-   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
-   * and defaults to @ref Stdio::Piped when used with @ref cast_output.
+   * The handle gets duplicated when the child is launched, it remains owned
+   * by the caller and has to stay open until then.
    *
-   * See @ref Stdio.
+   * @param h - file, pipe, or socket handle.
+   */
+  static Stdio from_handle (Pipe_Handle h) {
+    Stdio s {Kind::Handle};
+    s.handle_ = h;
+    return s;
+  }
+
+  bool operator== (const Stdio &other) const = default;
+
+private:
+  Kind kind_;
+  std::filesystem::path path_;
+  File_Mode mode_;
+  Pipe_Handle handle_;
+};
+
+inline const Stdio Stdio::Default {Stdio::Kind::Default};
+inline const Stdio Stdio::Inherit {Stdio::Kind::Inherit};
+inline const Stdio Stdio::Piped {Stdio::Kind::Piped};
+inline const Stdio Stdio::Null {Stdio::Kind::Null};
+inline const Stdio Stdio::Mapped {Stdio::Kind::Mapped};
+
+
+/**
+ * @brief Resources used by an exited process.
+ */
+struct Resource_Usage {
+  /** Time spent executing in user mode. */
+  std::chrono::microseconds user_time {0};
+  /** Time spent executing in kernel mode. */
+  std::chrono::microseconds system_time {0};
+  /** Peak resident set size in bytes (the peak working set on Windows). */
+  std::size_t max_rss = 0;
+  /**
+   * Page faults that required I/O. On Windows this is the total number of
+   * page faults, which also includes soft faults.
+   */
+  long major_faults = 0;
+  /** Context switches because the process waited for a resource, 0 on Windows. */
+  long voluntary_context_switches = 0;
+  /** Context switches because the process was preempted, 0 on Windows. */
+  long involuntary_context_switches = 0;
+};
+
+/**
+ * @brief Points in time of the lifetime of a child, as seen by the parent.
+ *
+ * The time between @ref spawn_start and @ref exec is spent launching the
+ * process in the parent, the time after it is spent in the child.
+ */
+struct Timings {
+  using Time_Point = std::chrono::steady_clock::time_point;
+
+  /** When the parent started setting up the child. */
+  Time_Point spawn_start {};
+  /**
+   * When launching the child completed. For children started with `fork`
+   * or `posix_spawn` this is after its program was executed successfully.
+   */
+  Time_Point exec {};
+  /**
+   * When the first byte of output of the child was read by
+   * @ref Child::wait_with_output or @ref Child::wait_streaming, if any.
+   */
+  std::optional<Time_Point> first_output;
+  /** When the exit of the child was collected by the parent. */
+  Time_Point exit {};
+
+  /**
+   * @brief Returns the time spent launching the child.
+   */
+  std::chrono::steady_clock::duration spawn_latency () const {
+    return exec - spawn_start;
+  }
+
+  /**
+   * @brief Returns the total time from launching the child until its exit
+   *        was collected.
+   */
+  std::chrono::steady_clock::duration wall_time () const {
+    return exit - spawn_start;
+  }
+};
+
+/**
+ * @brief Describes the result of a process.
+ */
+class Exit_Status {
+public:
+  explicit Exit_Status (int code, int signal = 0, bool timed_out = false)
+  : code_ (code),
+    signal_ (signal),
+    timed_out_ (timed_out)
+  {}
+
+  /**
+   * @brief Returns the exit code.
    *
-   * @param cfg - new configuration or @ref Stdio::Default.
+   * If the process was terminated by a signal this is 128 plus the number
+   * of the signal, like shells report it.
+   */
+  int code () const {
+    return code_;
+  }
+
+  /**
+   * @brief Returns the number of the signal that terminated the process, or
+   *        0 if it exited normally.
+   *
+   * Always 0 on Windows.
+   */
+  int signal () const {
+    return signal_;
+  }
+
+  /**
+   * @brief Whether the process was stopped because it exceeded its
+   *        timeout, see @ref Spell::timeout.
+   */
+  bool timed_out () const {
+    return timed_out_;
+  }
+
+  /**
+   * @brief Did the process exit by itself with an exit status of zero?
+   */
+  bool success () const {
+    return code () == 0 && signal () == 0 && !timed_out ();
+  }
+
+  /**
+   * @brief Returns the resources used by the process.
+   *
+   * This is `std::nullopt` if the status did not come from waiting on a
+   * child, or if the usage of the child could not be collected.
+   */
+  const std::optional<Resource_Usage>& resource_usage () const {
+    return usage_;
+  }
+
+  /**
+   * @brief Returns when the process was launched and exited.
+   *
+   * All time points are default constructed if the status did not come
+   * from waiting on a child.
+   */
+  const Timings& timings () const {
+    return timings_;
+  }
+
+private:
+  friend class Child;
+
+  int code_;
+  int signal_;
+  bool timed_out_;
+  std::optional<Resource_Usage> usage_;
+  Timings timings_;
+};
+
+namespace detail {
+
+/// A read-only mapping of a whole file.
+class Mapping {
+public:
+  /// Maps the file, returns `nullptr` if it is empty or cannot be mapped.
+  static std::shared_ptr<const Mapping> map (Pipe_Handle file) {
+  #ifdef _WIN32
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx (file, &size) || size.QuadPart == 0) {
+      return nullptr;
+    }
+    HANDLE section = CreateFileMappingA (file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (section == nullptr) {
+      return nullptr;
+    }
+    // The view keeps the section alive.
+    void *view = MapViewOfFile (section, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle (section);
+    if (view == nullptr) {
+      return nullptr;
+    }
+    return std::shared_ptr<const Mapping> (
+      new Mapping (static_cast<const char *> (view), static_cast<std::size_t> (size.QuadPart))
+    );
+  #else
+    struct stat st;
+    if (fstat (file, &st) != 0 || st.st_size <= 0) {
+      return nullptr;
+    }
+    const auto size = static_cast<std::size_t> (st.st_size);
+    void *data = mmap (nullptr, size, PROT_READ, MAP_SHARED, file, 0);
+    if (data == MAP_FAILED) {
+      return nullptr;
+    }
+    return std::shared_ptr<const Mapping> (new Mapping (static_cast<const char *> (data), size));
+  #endif
+  }
+
+  Mapping (const Mapping &) = delete;
+  Mapping& operator= (const Mapping &) = delete;
+
+  ~Mapping () {
+  #ifdef _WIN32
+    UnmapViewOfFile (data_);
+  #else
+    munmap (const_cast<char *> (data_), size_);
+  #endif
+  }
+
+  std::span<const char> data () const {
+    return {data_, size_};
+  }
+
+private:
+  Mapping (const char *data, std::size_t size)
+  : data_ (data),
+    size_ (size)
+  {}
+
+  const char *data_;
+  std::size_t size_;
+};
+
+} // namespace detail
+
+/**
+ * @brief The output of a finished process.
+ */
+struct Output {
+  Output (Exit_Status &&s)
+  : status (s),
+    stdout_ {},
+    stderr_ {}
+  {}
+
+  /**
+   * The status of the process.
+   */
+  Exit_Status status;
+
+  /**
+   * The data that the process wrote to stdout.
+   */
+  std::vector<char> stdout_;
+
+  /**
+   * The data that the process wrote to stderr.
+   */
+  std::vector<char> stderr_;
+
+  /**
+   * The mapped stdout of the process if it was captured with
+   * @ref Stdio::Mapped and was not empty, `stdout_` is empty then.
+   */
+  std::shared_ptr<const detail::Mapping> stdout_mapping_;
+
+  /**
+   * The mapped stderr of the process, see `stdout_mapping_`.
+   */
+  std::shared_ptr<const detail::Mapping> stderr_mapping_;
+
+  /**
+   * @brief Returns the data that the process wrote to stdout.
+   *
+   * For output captured with @ref Stdio::Mapped this refers to the mapping
+   * instead of copying it, it stays valid for as long as this output or a
+   * copy of it exists.
+   */
+  std::span<const char> stdout_data () const {
+    return stdout_mapping_ ? stdout_mapping_->data () : std::span<const char> (stdout_);
+  }
+
+  /**
+   * @brief Returns the data that the process wrote to stderr.
+   *
+   * See @ref stdout_data.
+   */
+  std::span<const char> stderr_data () const {
+    return stderr_mapping_ ? stderr_mapping_->data () : std::span<const char> (stderr_);
+  }
+
+  /**
+   * @brief Constructs a container out of the data that the process wrote to stdout.
+   * @tparam Container Any type that can be constructed from a begin-end pair of iterators over `char`s.
+   */
+  template <class Container>
+    Container collect_stdout () const {
+      const auto data = stdout_data ();
+      return Container { data.begin (), data.end () };
+    }
+
+  /**
+   * @brief Constructs a container out of the data that the process wrote to stderr.
+   * @tparam Container Any type that can be constructed from a begin-end pair of iterators over `char`s.
+   */
+  template <class Container>
+    Container collect_stderr () const {
+      const auto data = stderr_data ();
+      return Container { data.begin (), data.end () };
+    }
+
+  /**
+   * @brief Moves the data that the process wrote to stdout out of the output.
+   *
+   * Unlike @ref collect_stdout this does not copy the data, unless it was
+   * captured with @ref Stdio::Mapped. The output is empty afterwards.
+   */
+  std::vector<char> take_stdout () {
+    return take (stdout_, stdout_mapping_);
+  }
+
+  /**
+   * @brief Moves the data that the process wrote to stderr out of the output.
+   *
+   * See @ref take_stdout.
+   */
+  std::vector<char> take_stderr () {
+    return take (stderr_, stderr_mapping_);
+  }
+
+private:
+  static std::vector<char> take (std::vector<char> &data, std::shared_ptr<const detail::Mapping> &mapping) {
+    if (mapping) {
+      const auto mapped = mapping->data ();
+      mapping.reset ();
+      return std::vector<char> (mapped.begin (), mapped.end ());
+    }
+    return std::exchange (data, {});
+  }
+};
+
+/**
+ * @brief A thread-safe pool of buffers for the output of children.
+ *
+ * Spells given a pool with @ref Spell::buffer_pool take the buffers their
+ * output is read into from it, so buffers that were returned with
+ * @ref release or @ref recycle are reused with their capacity instead of
+ * being allocated and grown again for every child. The buffers used for
+ * streaming output are returned automatically.
+ *
+ * The pool must outlive the spells and children using it.
+ */
+class Buffer_Pool {
+public:
+  /**
+   * @param max_buffers - the number of buffers to keep at most.
+   * @param max_capacity - buffers with a larger capacity are freed instead
+   *                       of being kept.
+   */
+  explicit Buffer_Pool (std::size_t max_buffers = 16, std::size_t max_capacity = 16 * 1024 * 1024)
+  : max_buffers_ (max_buffers),
+    max_capacity_ (max_capacity)
+  {}
+
+  Buffer_Pool (const Buffer_Pool &) = delete;
+  Buffer_Pool& operator= (const Buffer_Pool &) = delete;
+
+  /**
+   * @brief Returns an empty buffer from the pool, or a new one if the pool
+   *        is empty.
+   */
+  std::vector<char> acquire () {
+    std::lock_guard lock {mutex_};
+    if (buffers_.empty ()) {
+      return {};
+    }
+    auto buffer = std::move (buffers_.back ());
+    buffers_.pop_back ();
+    return buffer;
+  }
+
+  /**
+   * @brief Puts a buffer back into the pool.
+   *
+   * Its contents are discarded, buffers without capacity or that would
+   * exceed the limits of the pool are freed.
+   */
+  void release (std::vector<char> &&buffer) {
+    if (buffer.capacity () == 0 || buffer.capacity () > max_capacity_) {
+      return;
+    }
+    buffer.clear ();
+    std::lock_guard lock {mutex_};
+    if (buffers_.size () < max_buffers_) {
+      buffers_.push_back (std::move (buffer));
+    }
+  }
+
+  /**
+   * @brief Puts the stdout and stderr buffers of an output back into the
+   *        pool.
+   *
+   * Use @ref Output::take_stdout first to keep one of them.
+   */
+  void recycle (Output &&output) {
+    release (std::move (output.stdout_));
+    release (std::move (output.stderr_));
+  }
+
+  /**
+   * @brief Returns the number of buffers in the pool.
+   */
+  std::size_t size () const {
+    std::lock_guard lock {mutex_};
+    return buffers_.size ();
+  }
+
+private:
+  std::size_t max_buffers_;
+  std::size_t max_capacity_;
+  mutable std::mutex mutex_;
+  std::vector<std::vector<char>> buffers_;
+};
+
+/**
+ * @brief Splits a stream of output into records without copying them.
+ *
+ * Records are separated by a delimiter, `'\n'` by default or `'\0'` for
+ * the output of tools like `find -print0`. The delimiter is not part of the
+ * returned records, a last record that is not terminated is still returned.
+ *
+ * Reading from a pipe only keeps the incomplete record at the end of the
+ * buffer between reads, and bytes that were already searched are not
+ * searched again, so records can be spread over any number of reads.
+ * Reading from collected output does not copy at all.
+ *
+ * The returned views are valid until the next record is read.
+ */
+class Line_Reader {
+public:
+  /**
+   * @brief Reads records from the pipe until it reaches end of file.
+   *
+   * Read errors end the records like end of file. The pipe must outlive the
+   * reader.
+   */
+  explicit Line_Reader (Anonymous_Pipe &pipe, char delimiter = '\n')
+  : pipe_ (&pipe),
+    delimiter_ (delimiter)
+  {}
+
+  /**
+   * @brief Reads records from the given bytes, which must outlive the
+   *        reader.
+   */
+  explicit Line_Reader (std::span<const char> data, char delimiter = '\n')
+  : data_ (data.data ()),
+    end_ (data.size ()),
+    delimiter_ (delimiter)
+  {}
+
+  /**
+   * @brief Reads records from the collected stdout of a child.
+   */
+  explicit Line_Reader (const Output &output, char delimiter = '\n')
+  : Line_Reader (output.stdout_data (), delimiter)
+  {}
+
+  Line_Reader (const Line_Reader &) = delete;
+  Line_Reader& operator= (const Line_Reader &) = delete;
+
+  /**
+   * @brief Returns the next record, or `std::nullopt` if there are none left.
+   */
+  std::optional<std::string_view> next () {
+    for (;;) {
+      if (scanned_ < end_) {
+        if (const auto *found = static_cast<const char *> (
+              std::memchr (data_ + scanned_, delimiter_, end_ - scanned_))) {
+          const auto pos = static_cast<std::size_t> (found - data_);
+          const std::string_view record (data_ + begin_, pos - begin_);
+          begin_ = scanned_ = pos + 1;
+          return record;
+        }
+        scanned_ = end_;
+      }
+      if (!fill ()) {
+        if (begin_ == end_) {
+          return std::nullopt;
+        }
+        const std::string_view record (data_ + begin_, end_ - begin_);
+        begin_ = end_;
+        return record;
+      }
+    }
+  }
+
+  class iterator {
+  public:
+    using iterator_category = std::input_iterator_tag;
+    using value_type = std::string_view;
+    using difference_type = std::ptrdiff_t;
+    using pointer = const std::string_view*;
+    using reference = const std::string_view&;
+
+    iterator () = default;
+
+    const std::string_view& operator* () const {
+      return *record_;
+    }
+
+    const std::string_view* operator-> () const {
+      return &*record_;
+    }
+
+    iterator& operator++ () {
+      record_ = reader_->next ();
+      return *this;
+    }
+
+    void operator++ (int) {
+      ++*this;
+    }
+
+    bool operator== (const iterator &other) const {
+      return record_.has_value () == other.record_.has_value ();
+    }
+
+  private:
+    friend class Line_Reader;
+
+    explicit iterator (Line_Reader *reader)
+    : reader_ (reader),
+      record_ (reader->next ())
+    {}
+
+    Line_Reader *reader_ = nullptr;
+    std::optional<std::string_view> record_;
+  };
+
+  /**
+   * @brief Reads the first record, iterating consumes the records.
+   */
+  iterator begin () {
+    return iterator (this);
+  }
+
+  iterator end () {
+    return iterator ();
+  }
+
+private:
+  // Reads more data after the incomplete record at the end of the buffer.
+  bool fill () {
+    constexpr std::size_t READ_SIZE = 64 * 1024;
+    if (pipe_ == nullptr) {
+      return false;
+    }
+    if (begin_ != 0) {
+      std::memmove (buffer_.data (), buffer_.data () + begin_, end_ - begin_);
+      end_ -= begin_;
+      scanned_ -= begin_;
+      begin_ = 0;
+    }
+    if (buffer_.size () - end_ < READ_SIZE / 2) {
+      buffer_.resize (std::max (buffer_.size () * 2, READ_SIZE));
+    }
+    data_ = buffer_.data ();
+    for (;;) {
+      const auto r = pipe_->read (buffer_.data () + end_, buffer_.size () - end_);
+    #ifndef _WIN32
+      if (!r.has_value () && errno == EINTR) {
+        continue;
+      }
+    #endif
+      if (r.value_or (0) == 0) {
+        pipe_ = nullptr;
+        return false;
+      }
+      end_ += r.value ();
+      return true;
+    }
+  }
+
+  Anonymous_Pipe *pipe_ = nullptr;
+  std::vector<char> buffer_;
+  const char *data_ = nullptr;
+  // Start of the current record.
+  std::size_t begin_ = 0;
+  // End of the data that was searched for the delimiter.
+  std::size_t scanned_ = 0;
+  std::size_t end_ = 0;
+  char delimiter_;
+};
+
+/**
+ * @brief Receives output of a child process as it arrives.
+ *
+ * The span is only valid for the duration of the call, its buffer is reused
+ * for the next chunk.
+ */
+using Chunk_Callback = std::function<void (std::span<const char>)>;
+
+namespace detail {
+
+/// A pipe that gets read until EOF, appending everything to `out`.
+/// If `sink` is set, `out` is only used as a buffer for passing chunks to it
+/// and does not grow beyond `STREAM_CHUNK_SIZE`. An empty sink discards the
+/// data.
+/// `first_output` receives the time of the first read that returned data.
+struct Drain_Target {
+  Anonymous_Pipe &pipe;
+  std::vector<char> &out;
+  const Chunk_Callback *sink = nullptr;
+  std::optional<Timings::Time_Point> first_output {};
+};
+
+inline void note_output (Drain_Target &t) {
+  if (!t.first_output.has_value ()) {
+    t.first_output = std::chrono::steady_clock::now ();
+  }
+}
+
+inline constexpr std::size_t STREAM_CHUNK_SIZE = 64 * 1024;
+
+/// Makes room for the next read of the target, growing its output
+/// geometrically unless it has a sink.
+/// Returns the offset in `t.out` to read to, up to its end.
+inline std::size_t prepare_read (Drain_Target &t) {
+  constexpr std::size_t MIN_READ = 4096;
+  constexpr std::size_t MAX_READ = 64 * 1024;
+  auto &out = t.out;
+  if (t.sink != nullptr) {
+    if (out.size () < STREAM_CHUNK_SIZE) {
+      out.resize (STREAM_CHUNK_SIZE);
+    }
+    return 0;
+  }
+  if (out.capacity () - out.size () < MIN_READ) {
+    out.reserve (std::max (out.capacity () * 2, MIN_READ * 4));
+  }
+  // Only the part that is read into is resized, growing to the whole
+  // capacity would zero the entire unused remainder on every read.
+  const auto size = out.size ();
+  out.resize (std::min (out.capacity (), size + MAX_READ));
+  return size;
+}
+
+/// Keeps the `n` bytes read to `offset` after @ref prepare_read or passes
+/// them to the sink.
+/// Returns false if nothing was read, meaning the pipe reached EOF or
+/// reading failed.
+inline bool finish_read (Drain_Target &t, std::size_t offset, std::size_t n) {
+  if (t.sink == nullptr) {
+    t.out.resize (offset + n);
+  }
+  if (n == 0) {
+    return false;
+  }
+  note_output (t);
+  if (t.sink != nullptr && *t.sink) {
+    (*t.sink) (std::span<const char> (t.out.data () + offset, n));
+  }
+  return true;
+}
+
+/// Reads once from the target, growing its output geometrically or passing
+/// it to its sink.
+/// Returns false once the pipe reached EOF or reading failed.
+inline bool drain_some (Drain_Target &t) {
+  const auto offset = prepare_read (t);
+  for (;;) {
+    const auto r = t.pipe.read (t.out.data () + offset, t.out.size () - offset);
+  #ifndef _WIN32
+    if (!r.has_value () && errno == EINTR) {
+      continue;
+    }
+  #endif
+    return finish_read (t, offset, r.value_or (0));
+  }
+}
+
+#ifdef _WIN32
+// An overlapped read of a drain target, which signals `ov.hEvent` when it
+// finished.
+struct Overlapped_Read {
+  Drain_Target *target;
+  OVERLAPPED ov;
+  std::size_t offset;
+
+  // Returns false if the read could not be started, which also happens at
+  // EOF.
+  bool start () {
+    const HANDLE event = ov.hEvent;
+    ov = {};
+    ov.hEvent = event;
+    offset = prepare_read (*target);
+    auto &out = target->out;
+    if (ReadFile (
+          target->pipe.handle (), out.data () + offset,
+          static_cast<DWORD> (out.size () - offset), nullptr, &ov
+        )
+        || GetLastError () == ERROR_IO_PENDING) {
+      return true;
+    }
+    finish_read (*target, offset, 0);
+    return false;
+  }
+
+  // Returns false once the pipe reached EOF or reading failed.
+  bool finish (bool wait) {
+    DWORD n = 0;
+    const bool ok = GetOverlappedResult (target->pipe.handle (), &ov, &n, wait);
+    return finish_read (*target, offset, ok ? n : 0);
+  }
+};
+
+/// Whether `drain` can honour a deadline for the targets, which it can if
+/// all of them are waited on.
+inline bool drain_waits (std::span<const Drain_Target> targets) {
+  std::size_t waited = 0;
+  for (const auto &t : targets) {
+    if (t.pipe.handle () == INVALID_PIPE) {
+      continue;
+    }
+    if (!t.pipe.overlapped () || ++waited > MAXIMUM_WAIT_OBJECTS) {
+      return false;
+    }
+  }
+  return true;
+}
+#endif
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+/// Returns the milliseconds left until `deadline`, rounded up, for use as a
+/// poll timeout.
+inline int remaining_ms (Deadline deadline) {
+  const auto left = std::chrono::ceil<std::chrono::milliseconds> (
+    deadline - std::chrono::steady_clock::now ()
+  ).count ();
+  return static_cast<int> (std::clamp<decltype (left)> (left, 0, std::numeric_limits<int>::max ()));
+}
+
+/**
+ * Reads all targets until they reach EOF, without blocking on any of them
+ * while another one has data available. Targets with an invalid pipe are
+ * ignored.
+ *
+ * Returns false if the deadline passed first. On Windows it is ignored
+ * unless all targets are overlapped pipes, see @ref drain_waits.
+ */
+inline bool drain (std::span<Drain_Target> targets, std::optional<Deadline> deadline = std::nullopt) {
+#ifdef _WIN32
+  // Overlapped pipes are read together by waiting for the events of their
+  // pending reads. Anonymous pipes cannot be waited on, so they are read on
+  // their own threads, except for the first one if nothing else is read on
+  // this thread.
+  std::vector<Overlapped_Read> reads;
+  std::vector<Drain_Target *> blocking;
+  reads.reserve (targets.size ());
+  for (auto &t : targets) {
+    if (t.pipe.handle () == INVALID_PIPE) {
+      continue;
+    }
+    if (!t.pipe.overlapped () || reads.size () == MAXIMUM_WAIT_OBJECTS) {
+      blocking.push_back (&t);
+      continue;
+    }
+    const HANDLE event = CreateEventA (nullptr, true, false, nullptr);
+    if (event == nullptr) {
+      blocking.push_back (&t);
+      continue;
+    }
+    reads.push_back ({&t, {}, 0});
+    reads.back ().ov.hEvent = event;
+  }
+  std::vector<std::thread> threads;
+  for (std::size_t i = reads.empty () ? 1 : 0; i < blocking.size (); ++i) {
+    threads.emplace_back ([t = blocking[i]] () { while (drain_some (*t)) {} });
+  }
+  if (reads.empty () && !blocking.empty ()) {
+    while (drain_some (*blocking[0])) {}
+  }
+
+  std::vector<Overlapped_Read *> pending;
+  std::vector<HANDLE> events;
+  for (auto &r : reads) {
+    if (r.start ()) {
+      pending.push_back (&r);
+    }
+  }
+  bool done = true;
+  while (!pending.empty ()) {
+    events.clear ();
+    for (const auto *r : pending) {
+      events.push_back (r->ov.hEvent);
+    }
+    const DWORD result = WaitForMultipleObjects (
+      static_cast<DWORD> (events.size ()), events.data (), false,
+      deadline ? static_cast<DWORD> (remaining_ms (*deadline)) : INFINITE
+    );
+    if (result == WAIT_TIMEOUT) {
+      done = false;
+      break;
+    }
+    if (result >= WAIT_OBJECT_0 + events.size ()) {
+      break;
+    }
+    const auto i = result - WAIT_OBJECT_0;
+    if (!pending[i]->finish (false) || !pending[i]->start ()) {
+      pending.erase (pending.begin () + i);
+    }
+  }
+  // Reads still in progress would write to the buffers after returning.
+  for (auto *r : pending) {
+    CancelIoEx (r->target->pipe.handle (), &r->ov);
+    r->finish (true);
+  }
+  for (auto &r : reads) {
+    CloseHandle (r.ov.hEvent);
+  }
+
+  for (auto &t : threads) {
+    t.join ();
+  }
+  return done;
+#else
+  std::vector<pollfd> fds;
+  std::vector<Drain_Target *> open;
+  fds.reserve (targets.size ());
+  open.reserve (targets.size ());
+  for (auto &t : targets) {
+    if (t.pipe.handle () != INVALID_PIPE) {
+      fds.push_back ({t.pipe.handle (), POLLIN, 0});
+      open.push_back (&t);
+    }
+  }
+  while (!fds.empty ()) {
+    const int n = poll (fds.data (), fds.size (), deadline ? remaining_ms (*deadline) : -1);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return true;
+    }
+    if (n == 0) {
+      return false;
+    }
+    for (std::size_t i = fds.size (); i-- > 0;) {
+      if (fds[i].revents == 0) {
+        continue;
+      }
+      if (!drain_some (*open[i])) {
+        fds.erase (fds.begin () + i);
+        open.erase (open.begin () + i);
+      }
+    }
+  }
+  return true;
+#endif
+}
+
+/// Returns a file descriptor that becomes readable when the process exits or
+/// INVALID_PIPE if pidfds are not supported.
+inline Pipe_Handle pidfd_open (Pid pid) {
+#if defined (__linux__) && defined (SYS_pidfd_open)
+  return static_cast<Pipe_Handle> (syscall (SYS_pidfd_open, pid, 0));
+#else
+  (void)pid;
+  return INVALID_PIPE;
+#endif
+}
+
+#ifndef _WIN32
+inline Resource_Usage to_resource_usage (const rusage &ru) {
+  using std::chrono::seconds, std::chrono::microseconds;
+  Resource_Usage usage;
+  usage.user_time = seconds (ru.ru_utime.tv_sec) + microseconds (ru.ru_utime.tv_usec);
+  usage.system_time = seconds (ru.ru_stime.tv_sec) + microseconds (ru.ru_stime.tv_usec);
+#ifdef __APPLE__
+  usage.max_rss = static_cast<std::size_t> (ru.ru_maxrss);
+#else
+  // Reported in kilobytes everywhere else.
+  usage.max_rss = static_cast<std::size_t> (ru.ru_maxrss) * 1024;
+#endif
+  usage.major_faults = ru.ru_majflt;
+  usage.voluntary_context_switches = ru.ru_nvcsw;
+  usage.involuntary_context_switches = ru.ru_nivcsw;
+  return usage;
+}
+#endif
+
+/// Limits for waiting on a child, see @ref Spell::timeout.
+struct Timeout {
+  Deadline deadline;
+  std::chrono::milliseconds grace;
+};
+
+} // namespace detail
+
+#ifndef _WIN32
+namespace detail {
+
+// Sent to the spawn server with the stdin, stdout, and stderr handles of the
+// child attached, followed by `size` bytes of NUL-terminated strings: the
+// arguments (the first one being the program), the environment, and the
+// working directory.
+struct Spawn_Request {
+  std::uint32_t argc;
+  // -1 if the environment of the server is inherited.
+  std::int32_t envc;
+  std::uint32_t change_dir;
+  // Whether the child leads a new process group.
+  std::uint32_t new_group;
+  std::uint32_t size;
+  // Echoed in the reply, requests may be sent by several threads at once.
+  std::uint32_t sequence;
+};
+
+// Sent by the spawn server after each request and whenever a child exited.
+struct Spawn_Reply {
+  // The launched or exited child, -1 if launching failed.
+  std::int32_t pid;
+  // Raw wait status of an exited child.
+  std::int32_t status;
+  std::uint32_t exited;
+  // The sequence number of the request, for replies to requests.
+  std::uint32_t sequence;
+  // Resources used by an exited child.
+  Resource_Usage usage;
+};
+
+// The exit of a child reaped by the spawn server or the reaper.
+struct Exit_Record {
+  // Raw wait status.
+  int status;
+  // Not available if the server was lost.
+  std::optional<Resource_Usage> usage;
+};
+
+// Status reported for children whose exit is not known, like the exit code
+// of a shell that could not run the program.
+inline constexpr int LOST_STATUS = 127 << 8;
+
+inline bool read_exact (int fd, void *buf, std::size_t count) {
+  auto *p = static_cast<char *> (buf);
+  while (count) {
+    const auto n = ::read (fd, p, count);
+    if (n > 0) {
+      p += n;
+      count -= n;
+    }
+    else if (n == 0 || errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+inline bool write_exact (int fd, const void *buf, std::size_t count) {
+  auto *p = static_cast<const char *> (buf);
+  while (count) {
+    const auto n = ::write (fd, p, count);
+    if (n >= 0) {
+      p += n;
+      count -= n;
+    }
+    else if (errno != EINTR) {
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace detail
+
+/**
+ * @brief A helper process that launches children on behalf of this one.
+ *
+ * The cost of launching a process grows with the size of the parent, even
+ * with `posix_spawn`. The server is forked when it's constructed, which
+ * should happen early, before the process grows or starts other threads.
+ * Spells are launched through it with @ref Spell::spawn_server. Their
+ * configuration and the handles for their streams are sent to it over a
+ * Unix socket, and it reports the exits of its children back.
+ *
+ * Children launched by the server are not children of this process.
+ * @ref Child::wait and @ref Child::try_wait get their exit status from the
+ * server instead. The server must outlive all children launched through it.
+ * It may be used from multiple threads.
+ *
+ * Only available on Unix platforms.
+ */
+class Spawn_Server {
+public:
+  /**
+   * @brief Forks the server process.
+   *
+   * Use @ref valid to check whether it could be started.
+   */
+  Spawn_Server ()
+  : socket_ (INVALID_PIPE),
+    pid_ (-1),
+    env_ (detail::env_snapshot ())
+  {
+    int fds[2];
+    if (socketpair (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+      return;
+    }
+    const pid_t pid = fork ();
+    if (pid < 0) {
+      ::close (fds[0]);
+      ::close (fds[1]);
+      return;
+    }
+    if (pid == 0) {
+      ::close (fds[0]);
+      serve (fds[1]);
+    }
+    ::close (fds[1]);
+    socket_ = fds[0];
+    pid_ = pid;
+  }
+
+  Spawn_Server (const Spawn_Server &) = delete;
+  Spawn_Server& operator= (const Spawn_Server &) = delete;
+
+  /**
+   * @brief Stops the server.
+   *
+   * Children that are still running are not affected.
+   */
+  ~Spawn_Server () {
+    if (!valid ()) {
+      return;
+    }
+    ::close (socket_);
+    while (waitpid (pid_, nullptr, 0) < 0 && errno == EINTR) {}
+  }
+
+  /**
+   * @brief Whether the server process was started successfully.
+   */
+  bool valid () const {
+    return socket_ != INVALID_PIPE;
+  }
+
+  /**
+   * @brief Returns the process ID of the server.
+   */
+  Pid id () const {
+    return pid_;
+  }
+
+private:
+  friend class Spell;
+  friend class Child;
+  friend class detail::Exit_Claim;
+
+  std::optional<Pid> launch (
+    const detail::Exec_Block &exec,
+    const std::filesystem::path *dir,
+    Pipe_Handle in,
+    Pipe_Handle out,
+    Pipe_Handle err,
+    bool new_group
+  ) {
+    // Only sending the request is serialized, the replies are matched to the
+    // requests by their sequence number.
+    std::unique_lock launch_lock {launch_mutex_};
+    auto &payload = request_;
+    payload.clear ();
+    auto put = [&payload] (std::string_view str) {
+      payload.insert (payload.end (), str.begin (), str.end ());
+      payload.push_back ('\0');
+    };
+    const std::uint32_t sequence = next_sequence_++;
+    detail::Spawn_Request request {0, -1, dir != nullptr, new_group, 0, sequence};
+    for (char *const *arg = exec.argv (); *arg; ++arg) {
+      put (*arg);
+      ++request.argc;
+    }
+    char *const *envp = exec.envp ();
+    // The server has the environment of the time it was started.
+    if (envp == nullptr && detail::env_snapshot () != env_) {
+      envp = environ;
+    }
+    if (envp != nullptr) {
+      request.envc = 0;
+      for (; *envp; ++envp) {
+        put (*envp);
+        ++request.envc;
+      }
+    }
+    if (dir != nullptr) {
+      put (dir->native ());
+    }
+    request.size = payload.size ();
+
+    iovec iov {&request, sizeof (request)};
+    alignas (cmsghdr) char control[CMSG_SPACE (3 * sizeof (int))] = {};
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN (3 * sizeof (int));
+    const int fds[] = {in, out, err};
+    std::memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+    ssize_t sent;
+    while ((sent = sendmsg (socket_, &msg, 0)) < 0 && errno == EINTR) {}
+    if (sent != sizeof (request)
+        || !detail::write_exact (socket_, payload.data (), payload.size ())) {
+      return std::nullopt;
+    }
+    launch_lock.unlock ();
+
+    std::unique_lock lock {mutex_};
+    receive_until (lock, [this, sequence] () { return launched_.contains (sequence); });
+    const auto it = launched_.find (sequence);
+    // No reply arrives once the server was lost.
+    if (it == launched_.end ()) {
+      return std::nullopt;
+    }
+    const Pid pid = it->second;
+    launched_.erase (it);
+    if (pid < 0) {
+      return std::nullopt;
+    }
+    return pid;
+  }
+
+  // Returns the raw wait status and resource usage of a child of the server.
+  detail::Exit_Record wait (Pid pid) {
+    std::unique_lock lock {mutex_};
+    receive_until (lock, [this, pid] () { return exited_.contains (pid); });
+    return take_status (pid);
+  }
+
+  std::optional<detail::Exit_Record> try_wait (Pid pid) {
+    std::unique_lock lock {mutex_};
+    // Messages already sent by the server are read without blocking, unless
+    // another thread is reading them.
+    while (!exited_.contains (pid) && !reading_ && !lost_) {
+      pollfd pfd {socket_, POLLIN, 0};
+      if (poll (&pfd, 1, 0) <= 0) {
+        break;
+      }
+      receive_one (lock);
+    }
+    if (!exited_.contains (pid) && !lost_) {
+      return std::nullopt;
+    }
+    return take_status (pid);
+  }
+
+  // Drops the exit status of a child that is not going to be waited for,
+  // now or once it is received.
+  void forget (Pid pid) {
+    std::lock_guard lock {mutex_};
+    if (exited_.erase (pid) == 0 && !lost_) {
+      forgotten_.insert (pid);
+    }
+  }
+
+  detail::Exit_Record take_status (Pid pid) {
+    // Exits received before the connection was lost are still reported.
+    const auto it = exited_.find (pid);
+    if (it == exited_.end ()) {
+      return {detail::LOST_STATUS, std::nullopt};
+    }
+    const detail::Exit_Record exit = it->second;
+    exited_.erase (it);
+    return exit;
+  }
+
+  // Reads messages until `ready` is true or the connection was lost. Only
+  // one thread reads at a time, the others wait for it to notify them.
+  template <class Ready>
+  void receive_until (std::unique_lock<std::mutex> &lock, Ready &&ready) {
+    while (!ready () && !lost_) {
+      if (reading_) {
+        received_.wait (lock);
+      }
+      else {
+        receive_one (lock);
+      }
+    }
+  }
+
+  void receive_one (std::unique_lock<std::mutex> &lock) {
+    reading_ = true;
+    lock.unlock ();
+    detail::Spawn_Reply reply;
+    const bool ok = detail::read_exact (socket_, &reply, sizeof (reply));
+    lock.lock ();
+    reading_ = false;
+    if (!ok) {
+      lost_ = true;
+    }
+    else if (reply.exited) {
+      if (forgotten_.erase (reply.pid) == 0) {
+        exited_[reply.pid] = {reply.status, reply.usage};
+      }
+    }
+    else {
+      launched_[reply.sequence] = reply.pid;
+    }
+    received_.notify_all ();
+  }
+
+  // The main loop of the server process.
+  [[noreturn]] static void serve (int socket);
+
+  Pipe_Handle socket_;
+  Pid pid_;
+  std::shared_ptr<const detail::Env_Snapshot> env_;
+  // Held while a request is sent.
+  std::mutex launch_mutex_;
+  std::vector<char> request_;
+  std::uint32_t next_sequence_ = 0;
+  std::mutex mutex_;
+  std::condition_variable received_;
+  bool reading_ = false;
+  bool lost_ = false;
+  // Replies to requests that were not taken yet, by sequence number.
+  std::unordered_map<std::uint32_t, Pid> launched_;
+  std::unordered_map<Pid, detail::Exit_Record> exited_;
+  // Children whose exit is dropped when it is received.
+  std::unordered_set<Pid> forgotten_;
+};
+
+/**
+ * @brief A process-wide thread that reaps the exited children of spells.
+ *
+ * Once enabled, a SIGCHLD handler wakes a thread that reaps every exited
+ * child of the process in one batch and hands their exit statuses to the
+ * children waiting for them. @ref Child::try_wait then only looks up the
+ * status, and waiting for many children costs no thread or system call
+ * per child.
+ *
+ * It replaces any SIGCHLD handler, and statuses of children that were not
+ * launched by a spell after it was enabled are discarded, so other code of
+ * the process cannot wait for its own children anymore. It cannot be
+ * disabled again.
+ *
+ * Only available on Unix platforms.
+ */
+class Reaper {
+public:
+  /**
+   * @brief Starts the reaper if it is not running yet.
+   *
+   * @return Whether the reaper is running.
+   */
+  static bool enable () {
+    auto &r = instance ();
+    std::lock_guard lock {r.mutex_};
+    if (r.enabled_) {
+      return true;
+    }
+    int wake[2];
+    if (pipe2 (wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+      return false;
+    }
+    wake_ = wake[1];
+    struct sigaction action {};
+    action.sa_handler = [] (int) {
+      const int saved = errno;
+      (void)!::write (wake_, "", 1);
+      errno = saved;
+    };
+    action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset (&action.sa_mask);
+    sigaction (SIGCHLD, &action, nullptr);
+    std::thread (&Reaper::run, &r, wake[0]).detach ();
+    r.enabled_ = true;
+    return true;
+  }
+
+  /**
+   * @brief Whether the reaper is running.
+   */
+  static bool enabled () {
+    return instance ().enabled_;
+  }
+
+private:
+  friend class Child;
+  friend class Spell;
+  friend class Spawn_Server;
+  friend class detail::Exit_Claim;
+  friend std::optional<Child> orphan (Spell &spell);
+
+  struct Slot {
+    std::optional<detail::Exit_Record> exit;
+    // The thread waiting for the exit, if any.
+    std::condition_variable *waiter = nullptr;
+  };
+
+  static Reaper& instance () {
+    static Reaper reaper;
+    return reaper;
+  }
+
+  // Held shared while a child is launched and adopted, so the reaper cannot
+  // discard its exit for not being adopted yet.
+  std::optional<std::shared_lock<std::shared_mutex>> launch_guard () {
+    if (!enabled_) {
+      return std::nullopt;
+    }
+    return std::shared_lock {launch_mutex_};
+  }
+
+  // Starts keeping the exit status of a child launched under the launch
+  // guard.
+  void adopt (Pid pid) {
+    std::lock_guard lock {mutex_};
+    // A previous child with the same pid that was never waited for.
+    slots_[pid] = Slot {};
+  }
+
+  void forget (Pid pid) {
+    std::lock_guard lock {mutex_};
+    slots_.erase (pid);
+  }
+
+  std::optional<detail::Exit_Record> try_wait (Pid pid) {
+    std::lock_guard lock {mutex_};
+    return take (pid);
+  }
+
+  std::optional<detail::Exit_Record> wait_until (Pid pid, std::optional<detail::Deadline> deadline) {
+    std::unique_lock lock {mutex_};
+    const auto it = slots_.find (pid);
+    if (it == slots_.end ()) {
+      return std::nullopt;
+    }
+    auto &slot = it->second;
+    std::condition_variable exited;
+    slot.waiter = &exited;
+    auto ready = [&slot] () { return slot.exit.has_value (); };
+    if (deadline.has_value ()) {
+      exited.wait_until (lock, *deadline, ready);
+    }
+    else {
+      exited.wait (lock, ready);
+    }
+    slot.waiter = nullptr;
+    return take (pid);
+  }
+
+  // Whether the child has exited, without taking its status.
+  bool has_exited (Pid pid) {
+    std::lock_guard lock {mutex_};
+    const auto it = slots_.find (pid);
+    return it == slots_.end () || it->second.exit.has_value ();
+  }
+
+  std::optional<detail::Exit_Record> take (Pid pid) {
+    const auto it = slots_.find (pid);
+    if (it == slots_.end () || !it->second.exit.has_value ()) {
+      return std::nullopt;
+    }
+    auto exit = it->second.exit;
+    slots_.erase (it);
+    return exit;
+  }
+
+  [[noreturn]] void run (int wake) {
+    std::vector<std::pair<Pid, detail::Exit_Record>> batch;
+    pollfd pfd {wake, POLLIN, 0};
+    for (;;) {
+      batch.clear ();
+      int status;
+      rusage usage;
+      pid_t pid;
+      while ((pid = wait4 (-1, &status, WNOHANG, &usage)) > 0) {
+        batch.push_back ({pid, {status, detail::to_resource_usage (usage)}});
+      }
+      if (!batch.empty ()) {
+        std::unique_lock launch {launch_mutex_};
+        std::lock_guard lock {mutex_};
+        for (const auto &[pid, exit] : batch) {
+          const auto it = slots_.find (pid);
+          if (it == slots_.end ()) {
+            continue;
+          }
+          it->second.exit = exit;
+          if (it->second.waiter != nullptr) {
+            it->second.waiter->notify_one ();
+          }
+        }
+      }
+      while (poll (&pfd, 1, -1) < 0 && errno == EINTR) {}
+      char buf[64];
+      while (::read (wake, buf, sizeof (buf)) > 0) {}
+    }
+  }
+
+  // Write end of the pipe the SIGCHLD handler wakes the thread through.
+  static inline int wake_ = -1;
+  std::atomic<bool> enabled_ = false;
+  std::shared_mutex launch_mutex_;
+  std::mutex mutex_;
+  std::unordered_map<Pid, Slot> slots_;
+};
+
+namespace detail {
+
+// The claim of a child on the exit status kept for it by the spawn server
+// that launched it or by the Reaper. It is transferred when moved, and
+// dropped when destroyed before the status was taken, so children that are
+// never waited for do not leave their status behind.
+class Exit_Claim {
+public:
+  Exit_Claim () = default;
+
+  Exit_Claim (Pid pid, Spawn_Server *server, bool reaper)
+  : pid_ (pid),
+    server_ (server),
+    reaper_ (reaper),
+    pending_ (server != nullptr || reaper)
+  {}
+
+  Exit_Claim (Exit_Claim &&other) noexcept
+  : pid_ (other.pid_),
+    server_ (other.server_),
+    reaper_ (other.reaper_),
+    pending_ (std::exchange (other.pending_, false))
+  {}
+
+  Exit_Claim& operator= (Exit_Claim &&other) noexcept {
+    if (this != &other) {
+      drop ();
+      pid_ = other.pid_;
+      server_ = other.server_;
+      reaper_ = other.reaper_;
+      pending_ = std::exchange (other.pending_, false);
+    }
+    return *this;
+  }
+
+  ~Exit_Claim () {
+    drop ();
+  }
+
+  // The server that launched the child, which has to be asked for its exit
+  // status.
+  Spawn_Server* server () const {
+    return server_;
+  }
+
+  // Whether the child is reaped by the Reaper.
+  bool reaper () const {
+    return reaper_;
+  }
+
+  // Called once the exit status was taken.
+  void taken () {
+    pending_ = false;
+  }
+
+private:
+  void drop () {
+    if (!pending_) {
+      return;
+    }
+    if (server_ != nullptr) {
+      server_->forget (pid_);
+    }
+    else {
+      Reaper::instance ().forget (pid_);
+    }
+    pending_ = false;
+  }
+
+  Pid pid_ = -1;
+  Spawn_Server *server_ = nullptr;
+  bool reaper_ = false;
+  bool pending_ = false;
+};
+
+} // namespace detail
+#endif
+
+/**
+ * @brief Representation of a running or exited child process.
+ */
+class Child {
+protected:
+  Child (Pid pid, Anonymous_Pipe &&i, Anonymous_Pipe &&o, Anonymous_Pipe &&e)
+  : pid_ (pid),
+    status_ (-1),
+    stdin_ (std::move (i)),
+    stdout_ (std::move (o)),
+    stderr_ (std::move (e))
+  {}
+
+#ifndef _WIN32
+  Child (Pid pid, Anonymous_Pipe &&i, Anonymous_Pipe &&o, Anonymous_Pipe &&e, Spawn_Server *server)
+  : Child (pid, std::move (i), std::move (o), std::move (e))
+  {
+    exit_ = detail::Exit_Claim (pid, server, false);
+  }
+#endif
+  friend class Spell;
+#ifdef SPELL_HAS_REACTOR
+  friend class Reactor;
+  friend class detail::Wait_Awaiter;
+  friend class detail::Output_Awaiter;
+#endif
+
+public:
+  /**
+   * @brief Returns the process ID.
+   *
+   * Note: This is actually the processes handle on Windows.
+   */
+  Pid id () const {
+    return pid_;
+  }
+
+  /**
+   * @brief Gets the exit status of the child if it has already exited.
+   *
+   * @return If the child has exited, then the exit status of the child if returned.
+   *         If the exit status is not available then `std::nullopt` is returned.
+   */
+  std::optional<Exit_Status> try_wait () {
+  #ifdef _WIN32
+    if (status_ != -1) {
+      return exit_status ();
+    }
+    if (WaitForSingleObject (id (), 0) == WAIT_OBJECT_0) {
+      reaped ();
+      return exit_status ();
+    }
+  #else
+    if (status_ != -1) {
+      return exit_status ();
+    }
+    if (exit_.server () != nullptr) {
+      if (const auto exit = exit_.server ()->try_wait (id ()); exit.has_value ()) {
+        reaped (exit->status, exit->usage);
+        return exit_status ();
+      }
+      return std::nullopt;
+    }
+    if (exit_.reaper ()) {
+      if (const auto exit = Reaper::instance ().try_wait (id ()); exit.has_value ()) {
+        reaped (exit->status, exit->usage);
+        return exit_status ();
+      }
+      return std::nullopt;
+    }
+    int status = 0;
+    rusage usage;
+    if (wait4 (id (), &status, WNOHANG, &usage) > 0) {
+      reaped (status, detail::to_resource_usage (usage));
+      return exit_status ();
+    }
+  #endif
+    return std::nullopt;
+  }
+
+  /**
+   * @brief Waits for the child to exit, returning its exit status.
+   *
+   * This function will continue to have the same return value after it has
+   * been called at least once.
+   *
+   * The stdin of the child gets closed before waiting to prevent a deadlock.
+   */
+  Exit_Status wait () {
+  #ifdef _WIN32
+    if (status_ != -1) {
+      return exit_status ();
+    }
+    stdin_.drop ();
+    WaitForSingleObject (id (), INFINITE);
+    reaped ();
+    return exit_status ();
+  #else
+    if (status_ != -1) {
+      return exit_status ();
+    }
+    stdin_.drop ();
+    if (exit_.server () != nullptr) {
+      const auto exit = exit_.server ()->wait (id ());
+      reaped (exit.status, exit.usage);
+      return exit_status ();
+    }
+    if (exit_.reaper ()) {
+      const auto exit = Reaper::instance ().wait_until (id (), std::nullopt);
+      // Without a slot the exit was already taken or never kept.
+      reaped (exit ? exit->status : detail::LOST_STATUS, exit ? exit->usage : std::nullopt);
+      return exit_status ();
+    }
+    int status = 0;
+    rusage usage;
+    pid_t pid;
+    while ((pid = wait4 (id (), &status, 0, &usage)) < 0 && errno == EINTR) {}
+    reaped (status, pid > 0 ? std::optional (detail::to_resource_usage (usage)) : std::nullopt);
+    return exit_status ();
+  #endif
+  }
+
+  /**
+   * @brief Waits for the child to exit for at most the given duration.
+   *
+   * Unlike @ref wait this does not close the stdin of the child unless it
+   * has exited, and the child is not stopped if it is still running.
+   *
+   * @param timeout - maximum time to wait.
+   * @return the exit status of the child or `std::nullopt` if it is still
+   *         running.
+   */
+  template <class Rep, class Period>
+  std::optional<Exit_Status> wait_for (const std::chrono::duration<Rep, Period> &timeout) {
+    return wait_until (std::chrono::steady_clock::now () + timeout);
+  }
+
+  /**
+   * @brief Waits for the child to exit until the given point in time.
+   *
+   * See @ref wait_for.
+   *
+   * @param deadline - when to stop waiting.
+   * @return the exit status of the child or `std::nullopt` if it is still
+   *         running.
+   */
+  template <class Clock, class Duration>
+  std::optional<Exit_Status> wait_until (const std::chrono::time_point<Clock, Duration> &deadline) {
+    if (auto status = try_wait (); status.has_value ()) {
+      return status;
+    }
+    const auto steady_deadline = std::chrono::steady_clock::now ()
+      + std::chrono::ceil<std::chrono::steady_clock::duration> (deadline - Clock::now ());
+    if (!wait_exited (steady_deadline)) {
+      return std::nullopt;
+    }
+    return wait ();
+  }
+
+  /**
+   * @brief Waits for the child to exit, collecting its remaining output and returning it.
+   *
+   * The returned @ref Output instance will continue to have the same exit status after it
+   * has been called at least once but the stdout and stderr will only contain data after
+   * the first call.
+   *
+   * The stdin of the child gets closed before waiting to prevent a deadlock.
+   * Stdout and stderr are read concurrently while the child is running, so
+   * the child never blocks on a full pipe, and the child is only reaped once
+   * both reached EOF.
+   */
+  Output wait_with_output () {
+    return wait_with_output (std::nullopt);
+  }
+
+  /**
+   * @brief Waits for the child to exit, passing its output to the given
+   *        callbacks as it arrives.
+   *
+   * Unlike @ref wait_with_output this runs in constant memory: each stream
+   * is read into a fixed-size buffer that is reused for every chunk. Output
+   * of a piped stream without a callback is discarded.
+   *
+   * The stdin of the child gets closed before waiting to prevent a deadlock.
+   *
+   * @param on_stdout - Called with each chunk read from stdout.
+   * @param on_stderr - Called with each chunk read from stderr.
+   * @return the exit status of the child.
+   */
+  Exit_Status wait_streaming (
+    const Chunk_Callback &on_stdout, const Chunk_Callback &on_stderr = nullptr
+  ) {
+    return wait_streaming (on_stdout, on_stderr, std::nullopt);
+  }
+
+#ifdef SPELL_HAS_REACTOR
+  /**
+   * @brief Waits for the child to exit without blocking the thread.
+   *
+   * `co_await child.async_wait (reactor)` suspends the calling coroutine until
+   * the child has exited and returns its @ref Exit_Status, like @ref wait.
+   */
+  detail::Wait_Awaiter async_wait (Reactor &reactor);
+
+  /**
+   * @brief Collects the output of the child without blocking the thread.
+   *
+   * `co_await child.async_wait_with_output (reactor)` suspends the calling
+   * coroutine until the child has exited and its output was read, like
+   * @ref wait_with_output.
+   */
+  detail::Output_Awaiter async_wait_with_output (Reactor &reactor);
+#endif
+
+  /**
+   * @brief Forces the child process to exit.
+   *
+   * This is equivalent to sending a SIGKILL on Unix platforms and calling
+   * TerminateProcess on Windows.
+   *
+   * @return Whether the child was killed (`true`) or had already exited (`false`).
+   */
+  bool kill () {
+  #ifdef _WIN32
+    // The handle is still needed for getting the exit status.
+    return TerminateProcess (id (), 0);
+  #else
+    return ::kill (id (), SIGKILL) != -1;
+  #endif
+  }
+
+  /**
+   * @brief Asks the child process to exit.
+   *
+   * This sends a SIGTERM on Unix platforms, which the child may handle to
+   * clean up before exiting. On Windows this is the same as @ref kill.
+   *
+   * @return Whether the request was sent.
+   */
+  bool terminate () {
+  #ifdef _WIN32
+    return kill ();
+  #else
+    return ::kill (id (), SIGTERM) != -1;
+  #endif
+  }
+
+  /**
+   * @brief Forces the child and all processes in its process group to exit.
+   *
+   * The whole group is killed with a single `killpg`, or by terminating
+   * the Job Object of the child on Windows, so descendants that still hold
+   * the output pipes open cannot keep a read blocked. This requires the
+   * child to have been cast with @ref Spell::new_process_group, otherwise
+   * only the child is killed like with @ref kill.
+   *
+   * With `reap` set this waits for the child afterwards, on Unix platforms
+   * every process of the group that is a child of this process is reaped
+   * as well. Descendants only become children of this process if it is a
+   * subreaper, see @ref set_child_subreaper.
+   *
+   * @param reap - whether to wait for the killed processes.
+   * @return Whether the signal was sent (`true`) or no process was left
+   *         (`false`).
+   */
+  bool kill_tree (bool reap = false) {
+  #ifdef _WIN32
+    const bool killed = job_ ? TerminateJobObject (job_.get (), 1) : kill ();
+    if (reap) {
+      wait ();
+    }
+    return killed;
+  #else
+    if (!group_) {
+      const bool killed = kill ();
+      if (reap) {
+        wait ();
+      }
+      return killed;
+    }
+    const bool killed = killpg (id (), SIGKILL) != -1;
+    if (reap) {
+      reap_group ();
+    }
+    return killed;
+  #endif
+  }
+
+  /**
+   * @brief Returns a reference to the childs standard input (stdin).
+   */
+  Anonymous_Pipe& get_stdin () {
+    return stdin_;
+  }
+
+  /**
+   * @brief Returns a reference to the childs standard output (stdout).
+   */
+  Anonymous_Pipe& get_stdout () {
+    return stdout_;
+  }
+
+  /**
+   * @brief Returns a reference to the childs standard error (stderr).
+   */
+  Anonymous_Pipe& get_stderr () {
+    return stderr_;
+  }
+
+private:
+  Exit_Status exit_status () const {
+  #ifdef _WIN32
+    Exit_Status status (status_, 0, timed_out_);
+  #else
+    Exit_Status status = WIFSIGNALED (status_)
+      ? Exit_Status (128 + WTERMSIG (status_), WTERMSIG (status_), timed_out_)
+      : Exit_Status (WEXITSTATUS (status_), 0, timed_out_);
+  #endif
+    status.usage_ = usage_;
+    status.timings_ = timings_;
+    return status;
+  }
+
+  // Asks the child to exit for exceeding its timeout, or forces it to with
+  // `force`. If it leads a process group the whole group is signaled.
+  void signal_stop ([[maybe_unused]] bool force) {
+  #ifdef _WIN32
+    if (job_) {
+      TerminateJobObject (job_.get (), 1);
+      return;
+    }
+    kill ();
+  #else
+    if (group_) {
+      killpg (id (), force ? SIGKILL : SIGTERM);
+    }
+    else if (force) {
+      kill ();
+    }
+    else {
+      terminate ();
+    }
+  #endif
+  }
+
+#ifndef _WIN32
+  // Reaps every child of this process in the process group of the child,
+  // including the child itself.
+  void reap_group () {
+    // The reaper collects the other processes of the group.
+    if (exit_.server () != nullptr || exit_.reaper ()) {
+      wait ();
+      return;
+    }
+    int status = 0;
+    rusage usage;
+    pid_t pid;
+    while ((pid = wait4 (-id (), &status, 0, &usage)) > 0 || (pid < 0 && errno == EINTR)) {
+      if (pid == id ()) {
+        reaped (status, detail::to_resource_usage (usage));
+      }
+    }
+    // The child may have left the group.
+    wait ();
+  }
+#endif
+
+  // Called when the exit watch of a reactor fired.  The child has exited
+  // unless the watch is polled, but the reaper may not have recorded its
+  // status yet, so wait for it instead of missing the only notification.
+  std::optional<Exit_Status> try_wait_watched ([[maybe_unused]] bool polled) {
+#ifndef _WIN32
+    if (exit_.reaper () && !polled) {
+      return wait ();
+    }
+#endif
+    return try_wait ();
+  }
+
+#ifdef _WIN32
+  // Collects the exit code and resource usage of the exited child and
+  // closes its handle.
+  void reaped () {
+    DWORD code;
+    GetExitCodeProcess (id (), &code);
+    auto to_us = [] (const FILETIME &t) {
+      const auto ticks = (static_cast<std::uint64_t> (t.dwHighDateTime) << 32) | t.dwLowDateTime;
+      // FILETIMEs count 100 nanosecond intervals.
+      return std::chrono::microseconds (ticks / 10);
+    };
+    FILETIME creation, exit, kernel, user;
+    PROCESS_MEMORY_COUNTERS memory;
+    if (GetProcessTimes (id (), &creation, &exit, &kernel, &user)
+        && GetProcessMemoryInfo (id (), &memory, sizeof (memory))) {
+      Resource_Usage usage;
+      usage.user_time = to_us (user);
+      usage.system_time = to_us (kernel);
+      usage.max_rss = memory.PeakWorkingSetSize;
+      usage.major_faults = static_cast<long> (memory.PageFaultCount);
+      usage_ = usage;
+    }
+    CloseHandle (id ());
+    status_ = static_cast<int> (code);
+    timings_.exit = std::chrono::steady_clock::now ();
+  }
+#else
+  void reaped (int status, const std::optional<Resource_Usage> &usage) {
+    exit_.taken ();
+    status_ = status;
+    usage_ = usage;
+    timings_.exit = std::chrono::steady_clock::now ();
+  }
+#endif
+
+  // Blocks until the child has exited or the deadline passed, without
+  // reaping it unless the Reaper did. Returns whether it has exited.
+  bool wait_exited (detail::Deadline deadline) {
+  #ifdef _WIN32
+    for (;;) {
+      const int ms = detail::remaining_ms (deadline);
+      if (WaitForSingleObject (id (), ms) == WAIT_OBJECT_0) {
+        return true;
+      }
+      if (ms == 0 || std::chrono::steady_clock::now () >= deadline) {
+        return false;
+      }
+    }
+  #else
+    if (status_ != -1) {
+      return true;
+    }
+    // A child that was already reaped elsewhere can neither be watched nor
+    // polled, it would only be waited for until the deadline.
+    if (exit_.server () == nullptr && !exit_.reaper ()) {
+      siginfo_t info;
+      if (waitid (P_PID, id (), &info, WEXITED | WNOHANG | WNOWAIT) < 0 && errno == ECHILD) {
+        return true;
+      }
+    }
+    if (exit_.reaper ()) {
+      if (auto exit = Reaper::instance ().wait_until (id (), deadline); exit.has_value ()) {
+        reaped (exit->status, exit->usage);
+        return true;
+      }
+      return false;
+    }
+  #ifdef __linux__
+    if (const Pipe_Handle fd = detail::pidfd_open (id ()); fd != INVALID_PIPE) {
+      pollfd pfd {fd, POLLIN, 0};
+      int n;
+      while ((n = poll (&pfd, 1, detail::remaining_ms (deadline))) < 0 && errno == EINTR) {}
+      ::close (fd);
+      return n > 0;
+    }
+  #elif defined (SPELL_HAS_REACTOR)
+    if (const int queue = kqueue (); queue >= 0) {
+      struct kevent ev;
+      EV_SET (&ev, id (), EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, nullptr);
+      int n = kevent (queue, &ev, 1, nullptr, 0, nullptr);
+      // The process is already gone if it cannot be watched.
+      bool exited = n < 0 && errno == ESRCH;
+      while (n == 0) {
+        const int ms = detail::remaining_ms (deadline);
+        const timespec timeout {ms / 1000, (ms % 1000) * 1000000L};
+        n = kevent (queue, nullptr, 0, &ev, 1, &timeout);
+        exited = n > 0;
+        if (n < 0 && errno == EINTR) {
+          n = 0;
+        }
+        else if (n == 0 && ms == 0) {
+          break;
+        }
+      }
+      ::close (queue);
+      if (n >= 0 || exited) {
+        return exited;
+      }
+    }
+  #endif
+    // Neither pidfds nor kqueue are available, so the child is polled with
+    // an increasing interval.
+    auto interval = std::chrono::milliseconds (1);
+    while (!try_wait ().has_value ()) {
+      const auto now = std::chrono::steady_clock::now ();
+      if (now >= deadline) {
+        return false;
+      }
+      std::this_thread::sleep_for (std::min<std::chrono::steady_clock::duration> (interval, deadline - now));
+      interval = std::min (interval * 2, std::chrono::milliseconds (50));
+    }
+    return true;
+  #endif
+  }
+
+  // Waits for the child; if it runs past the deadline of `timeout` it is
+  // terminated, and killed once the grace period passed as well.
+  Exit_Status wait (const std::optional<detail::Timeout> &timeout) {
+    if (!timeout.has_value ()) {
+      return wait ();
+    }
+    if (auto status = wait_until (timeout->deadline); status.has_value ()) {
+      return status.value ();
+    }
+    stop (*timeout);
+    return wait ();
+  }
+
+  // Asks the child to terminate for exceeding its timeout, killing it if it
+  // does not exit within the grace period.
+  void stop (const detail::Timeout &timeout) {
+    timed_out_ = true;
+    signal_stop (false);
+    if (!wait_exited (std::chrono::steady_clock::now () + timeout.grace)) {
+      signal_stop (true);
+    }
+  }
+
+  // Reads the targets like `detail::drain`, keeping the time of the first
+  // output.
+  bool drain (std::span<detail::Drain_Target> targets, std::optional<detail::Deadline> deadline = std::nullopt) {
+    const bool done = detail::drain (targets, deadline);
+    for (const auto &t : targets) {
+      if (t.first_output.has_value ()
+          && (!timings_.first_output.has_value () || *t.first_output < *timings_.first_output)) {
+        timings_.first_output = t.first_output;
+      }
+    }
+    return done;
+  }
+
+  // Reads the targets until they reach EOF and waits for the child, both
+  // limited by `timeout` as with @ref wait.
+  Exit_Status drain_and_wait (std::span<detail::Drain_Target> targets, const std::optional<detail::Timeout> &timeout) {
+    stdin_.drop ();
+    if (!timeout.has_value ()) {
+      drain (targets);
+      return wait ();
+    }
+  #ifdef _WIN32
+    if (!detail::drain_waits (targets)) {
+      // Anonymous pipes cannot be waited on with a timeout, instead a thread
+      // terminates the child at the deadline which closes its end of the
+      // pipes.
+      std::thread watchdog ([this, &timeout] () {
+        if (!wait_exited (timeout->deadline)) {
+          timed_out_ = true;
+          signal_stop (false);
+        }
+      });
+      drain (targets);
+      watchdog.join ();
+      return wait ();
+    }
+  #endif
+    if (drain (targets, timeout->deadline)) {
+      return wait (timeout);
+    }
+    timed_out_ = true;
+    signal_stop (false);
+    const auto kill_at = std::chrono::steady_clock::now () + timeout->grace;
+    if (!drain (targets, kill_at) || !wait_until (kill_at).has_value ()) {
+      signal_stop (true);
+    }
+    return wait ();
+  }
+
+  // Returns a buffer for reading output into.
+  std::vector<char> buffer () {
+    return pool_ != nullptr ? pool_->acquire () : std::vector<char> {};
+  }
+
+  Output wait_with_output (const std::optional<detail::Timeout> &timeout) {
+    auto out = buffer ();
+    auto err = buffer ();
+    detail::Drain_Target targets[] = {{stdout_, out}, {stderr_, err}};
+    Output o {drain_and_wait (targets, timeout)};
+    o.stdout_ = std::move (out);
+    o.stderr_ = std::move (err);
+    collect_mapped (o);
+    return o;
+  }
+
+  // Maps the files of streams captured with Stdio::Mapped into the output,
+  // or reads them if they cannot be mapped.
+  void collect_mapped (Output &o) {
+    auto collect = [] (Anonymous_Pipe &file, auto &mapping, std::vector<char> &out) {
+      if (file.handle () == INVALID_PIPE) {
+        return;
+      }
+      mapping = detail::Mapping::map (file.handle ());
+      if (!mapping) {
+      #ifdef _WIN32
+        SetFilePointerEx (file.handle (), LARGE_INTEGER {}, nullptr, FILE_BEGIN);
+      #else
+        lseek (file.handle (), 0, SEEK_SET);
+      #endif
+        std::vector<char> buf (detail::STREAM_CHUNK_SIZE);
+        while (const auto n = file.read (buf.data (), buf.size ()).value_or (0)) {
+          out.insert (out.end (), buf.data (), buf.data () + n);
+        }
+      }
+      file.drop ();
+    };
+    collect (stdout_file_, o.stdout_mapping_, o.stdout_);
+    collect (stderr_file_, o.stderr_mapping_, o.stderr_);
+  }
+
+  Exit_Status wait_streaming (
+    const Chunk_Callback &on_stdout, const Chunk_Callback &on_stderr, const std::optional<detail::Timeout> &timeout
+  ) {
+    auto out = buffer ();
+    auto err = buffer ();
+    detail::Drain_Target targets[] = {
+      {stdout_, out, &on_stdout},
+      {stderr_, err, &on_stderr},
+    };
+    auto status = drain_and_wait (targets, timeout);
+    if (pool_ != nullptr) {
+      pool_->release (std::move (out));
+      pool_->release (std::move (err));
+    }
+    return status;
+  }
+
+  Pid pid_;
+  int status_;
+  // Whether the child was stopped for exceeding its timeout.
+  bool timed_out_ = false;
+  std::optional<Resource_Usage> usage_;
+  Timings timings_;
+  // Whether the child leads its own process group.
+  bool group_ = false;
+#ifdef _WIN32
+  // The Job Object containing the child and its descendants.
+  std::shared_ptr<void> job_;
+#endif
+  Anonymous_Pipe stdin_;
+  Anonymous_Pipe stdout_;
+  Anonymous_Pipe stderr_;
+  // The files of streams captured with Stdio::Mapped.
+  Anonymous_Pipe stdout_file_;
+  Anonymous_Pipe stderr_file_;
+  // Where buffers for the output come from, if set.
+  Buffer_Pool *pool_ = nullptr;
+#ifndef _WIN32
+  // The server or the Reaper keeping the exit status of the child, if any.
+  detail::Exit_Claim exit_;
+#endif
+};
+
+#ifdef __linux__
+/**
+ * @brief Makes this process a subreaper, or stops it from being one.
+ *
+ * Orphaned descendants of a subreaper become its children instead of
+ * children of init, so they can be reaped by @ref Child::kill_tree. This
+ * affects the whole process, not only spells cast afterwards.
+ *
+ * Only available on Linux.
+ *
+ * @return Whether the setting was changed.
+ */
+inline bool set_child_subreaper (bool enable = true) {
+  return prctl (PR_SET_CHILD_SUBREAPER, enable ? 1 : 0, 0, 0, 0) == 0;
+}
+#endif
+
+template <class T = void>
+class Task;
+
+namespace detail {
+
+template <class T>
+struct Task_Promise_Base {
+  struct Final_Awaiter {
+    bool await_ready () const noexcept {
+      return false;
+    }
+
+    template <class Promise>
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<Promise> h) noexcept {
+      return h.promise ().continuation;
+    }
+
+    void await_resume () const noexcept {}
+  };
+
+  Task<T> get_return_object ();
+
+  std::suspend_always initial_suspend () const noexcept {
+    return {};
+  }
+
+  Final_Awaiter final_suspend () const noexcept {
+    return {};
+  }
+
+  void unhandled_exception () {
+    exception = std::current_exception ();
+  }
+
+  void rethrow () const {
+    if (exception) {
+      std::rethrow_exception (exception);
+    }
+  }
+
+  std::coroutine_handle<> continuation = std::noop_coroutine ();
+  std::exception_ptr exception;
+};
+
+template <class T>
+struct Task_Promise : Task_Promise_Base<T> {
+  void return_value (T v) {
+    value.emplace (std::move (v));
+  }
+
+  T result () {
+    this->rethrow ();
+    return std::move (value.value ());
+  }
+
+  std::optional<T> value;
+};
+
+template <>
+struct Task_Promise<void> : Task_Promise_Base<void> {
+  void return_void () const noexcept {}
+
+  void result () const {
+    rethrow ();
+  }
+};
+
+} // namespace detail
+
+/**
+ * @brief A lazily started coroutine producing a `T`.
+ *
+ * A task starts running when it is awaited with `co_await` from another
+ * coroutine or passed to @ref Reactor::block_on or @ref Reactor::spawn.
+ * Exceptions thrown inside the task are rethrown to the awaiter.
+ */
+template <class T>
+class Task {
+public:
+  using promise_type = detail::Task_Promise<T>;
+
+  Task (Task &&from)
+  : handle_ (std::exchange (from.handle_, nullptr))
+  {}
+
+  Task& operator= (Task &&from) {
+    if (this != &from) {
+      if (handle_) {
+        handle_.destroy ();
+      }
+      handle_ = std::exchange (from.handle_, nullptr);
+    }
+    return *this;
+  }
+
+  /**
+   * @brief Destroys the coroutine if it was not moved from.
+   */
+  ~Task () {
+    if (handle_) {
+      handle_.destroy ();
+    }
+  }
+
+  /**
+   * @brief Starts the task and suspends the caller until it has finished.
+   */
+  auto operator co_await () && noexcept {
+    struct Awaiter {
+      std::coroutine_handle<promise_type> handle;
+
+      bool await_ready () const noexcept {
+        return !handle || handle.done ();
+      }
+
+      std::coroutine_handle<> await_suspend (std::coroutine_handle<> awaiting) noexcept {
+        handle.promise ().continuation = awaiting;
+        return handle;
+      }
+
+      T await_resume () {
+        return handle.promise ().result ();
+      }
+    };
+    return Awaiter {handle_};
+  }
+
+private:
+  friend struct detail::Task_Promise_Base<T>;
+#ifdef SPELL_HAS_REACTOR
+  friend class Reactor;
+#endif
+
+  explicit Task (std::coroutine_handle<promise_type> h)
+  : handle_ (h)
+  {}
+
+  std::coroutine_handle<promise_type> handle_;
+};
+
+template <class T>
+inline Task<T> detail::Task_Promise_Base<T>::get_return_object () {
+  return Task<T> (std::coroutine_handle<Task_Promise<T>>::from_promise (
+    static_cast<Task_Promise<T> &> (*this)
+  ));
+}
+
+#ifdef SPELL_HAS_REACTOR
+
+namespace detail {
+
+/// Something the reactor waits for: a readable file descriptor or a process
+/// exit. Watches that cannot be registered on the event queue get polled.
+struct Watch {
+  Pipe_Handle fd = INVALID_PIPE;
+  Pid pid = 0;
+  bool active = false;
+  bool polled = false;
+  std::function<void ()> on_ready;
+};
+
+/// Coroutine type for tasks started with @ref Reactor::spawn.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object () { return {}; }
+    std::suspend_never initial_suspend () noexcept { return {}; }
+    std::suspend_never final_suspend () noexcept { return {}; }
+    void return_void () {}
+    void unhandled_exception () { std::terminate (); }
+  };
+};
+
+} // namespace detail
+
+/**
+ * @brief Event loop for driving many child processes from a single thread.
+ *
+ * Children are moved into the reactor together with callbacks for their
+ * output and their exit. The pipes and the process exits of all children are
+ * registered on one epoll (Linux, using pidfds for the exits) or kqueue
+ * instance, so each call to @ref run_once only costs as much as the number of
+ * ready events, not the number of children.
+ *
+ * Only piped output streams of the children are read, the output callback is
+ * called with every chunk as it arrives. The exit callback is called after
+ * the child exited and all of its piped output was delivered, after which
+ * the child is removed from the reactor. The stdin of a child is closed when
+ * it is registered, like it is by @ref Child::wait.
+ *
+ * The reactor also drives coroutines, see @ref Task, @ref spawn and
+ * @ref block_on.
+ *
+ * Not available on Windows.
+ */
+class Reactor {
+public:
+  /// @brief Identifies the output stream of a chunk of output.
+  enum class Stream {
+    Stdout,
+    Stderr
+  };
+
+  /// @brief Called for every chunk of output read from a child.
+  using Output_Callback = std::function<void (Child &, Stream, std::span<const char>)>;
+
+  /// @brief Called once a child exited and all of its output was delivered.
+  using Exit_Callback = std::function<void (Child &, Exit_Status)>;
+
+  /**
+   * @brief Creates a new reactor.
+   *
+   * Use @ref valid to check whether the underlying event queue could be
+   * created.
+   */
+  Reactor ()
+  : entries_ {},
+    tasks_ (0),
+    buffer_ (64 * 1024)
+  {
+  #ifdef __linux__
+    queue_ = epoll_create1 (EPOLL_CLOEXEC);
+  #else
+    queue_ = kqueue ();
+    if (queue_ != INVALID_PIPE) {
+      fcntl (queue_, F_SETFD, FD_CLOEXEC);
+    }
+  #endif
+  }
+
+  Reactor (const Reactor &) = delete;
+  Reactor& operator= (const Reactor &) = delete;
+
+  /**
+   * @brief Closes the event queue.
+   *
+   * Children that are still registered are dropped without waiting for them.
+   */
+  ~Reactor () {
+    entries_.clear ();
+    detail::close_pipe (queue_);
+  }
+
+  /**
+   * @brief Whether the event queue was created successfully.
+   */
+  bool valid () const {
+    return queue_ != INVALID_PIPE;
+  }
+
+  /**
+   * @brief Registers a child.
+   *
+   * @param child - the child to take over, see @ref Spell::cast.
+   * @param on_exit - called with the exit status once the child exited and
+   *                  all of its output was delivered.
+   * @param on_output - called with every chunk of output of the child, may
+   *                    be empty if the output is not needed.
+   * @return A pointer to the registered child, which stays valid until its
+   *         exit callback has returned, or `nullptr` if registering failed.
+   */
+  Child* add (Child &&child, Exit_Callback on_exit, Output_Callback on_output = nullptr) {
+    auto &e = entries_.emplace_back (std::move (child), std::move (on_exit), std::move (on_output));
+    e.self = std::prev (entries_.end ());
+    e.child.get_stdin ().drop ();
+    auto add_stream = [this, &e] (detail::Watch &w, Anonymous_Pipe &pipe, Stream stream) {
+      if (pipe.handle () == INVALID_PIPE) {
+        return true;
+      }
+      w.fd = pipe.handle ();
+      w.on_ready = [this, &e, &w, &pipe, stream] () {
+        const auto n = pipe.read (buffer_.data (), buffer_.size ());
+        if (n.value_or (0) == 0) {
+          if (!n.has_value () && errno == EINTR) {
+            return;
+          }
+          unwatch (w);
+          pipe.drop ();
+          check_done (e);
+        }
+        else if (e.on_output) {
+          e.on_output (e.child, stream, std::span<const char> (buffer_.data (), n.value ()));
+        }
+      };
+      return watch (w);
+    };
+    if (!add_stream (e.out, e.child.get_stdout (), Stream::Stdout)
+        || !add_stream (e.err, e.child.get_stderr (), Stream::Stderr)) {
+      unwatch (e.out);
+      unwatch (e.err);
+      entries_.pop_back ();
+      return nullptr;
+    }
+    e.exit.on_ready = [this, &e] () {
+      if (auto status = e.child.try_wait_watched (e.exit.polled); status.has_value ()) {
+        unwatch (e.exit);
+        e.status = status;
+        check_done (e);
+      }
+    };
+    watch_exit (e.exit, e.child.id ());
+    return &e.child;
+  }
+
+  /**
+   * @brief Returns the number of registered children.
+   */
+  std::size_t size () const {
+    return entries_.size ();
+  }
+
+  /**
+   * @brief Waits for events and dispatches them.
+   *
+   * Coroutines whose awaited event is ready are resumed after all events
+   * are dispatched.
+   *
+   * @param timeout_ms - maximum time to wait in milliseconds, or a negative
+   *                     value to wait indefinitely.
+   * @return the number of events that were dispatched.
+   */
+  std::size_t run_once (int timeout_ms = -1) {
+    constexpr int MAX_EVENTS = 256;
+    // Watches that could not be registered are checked in this interval.
+    constexpr int POLL_INTERVAL_MS = 10;
+    if (!polled_.empty () && (timeout_ms < 0 || timeout_ms > POLL_INTERVAL_MS)) {
+      timeout_ms = POLL_INTERVAL_MS;
+    }
+  #ifdef __linux__
+    epoll_event events[MAX_EVENTS];
+    int n = epoll_wait (queue_, events, MAX_EVENTS, timeout_ms);
+  #else
+    struct kevent events[MAX_EVENTS];
+    timespec timeout { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+    int n = kevent (queue_, nullptr, 0, events, MAX_EVENTS, timeout_ms < 0 ? nullptr : &timeout);
+  #endif
+    if (n < 0) {
+      n = 0;
+    }
+    for (int i = 0; i < n; ++i) {
+    #ifdef __linux__
+      auto *w = static_cast<detail::Watch *> (events[i].data.ptr);
+    #else
+      auto *w = static_cast<detail::Watch *> (events[i].udata);
+    #endif
+      if (w->active) {
+        w->on_ready ();
+      }
+    }
+    if (!polled_.empty ()) {
+      for (auto *w : std::vector<detail::Watch *> (polled_)) {
+        if (w->active) {
+          w->on_ready ();
+        }
+      }
+    }
+    resume_ready ();
+    release_finished ();
+    return static_cast<std::size_t> (n);
+  }
+
+  /**
+   * @brief Dispatches events until no children are registered and no
+   *        spawned tasks are running anymore.
+   */
+  void run () {
+    while (size () != 0 || tasks_ != 0) {
+      run_once ();
+    }
+  }
+
+  /**
+   * @brief Starts a task that runs on this reactor without being awaited.
+   *
+   * The task will be driven by @ref run, @ref run_once, and @ref block_on.
+   * An exception leaving the task terminates the program.
+   */
+  void spawn (Task<void> task) {
+    ++tasks_;
+    [] (Reactor &self, Task<void> t) -> detail::Detached {
+      co_await std::move (t);
+      --self.tasks_;
+    } (*this, std::move (task));
+  }
+
+  /**
+   * @brief Runs the reactor until the given task finished, returning its
+   *        result.
+   *
+   * Exceptions leaving the task are rethrown.
+   */
+  template <class T>
+  T block_on (Task<T> task) {
+    task.handle_.resume ();
+    while (!task.handle_.done ()) {
+      run_once ();
+    }
+    return task.handle_.promise ().result ();
+  }
+
+private:
+  friend class detail::Read_Awaiter;
+  friend class detail::Wait_Awaiter;
+  friend class detail::Output_Awaiter;
+
+  struct Entry {
+    Entry (Child &&c, Exit_Callback &&x, Output_Callback &&o)
+    : child (std::move (c)),
+      on_exit (std::move (x)),
+      on_output (std::move (o))
+    {}
+
+    Entry (const Entry &) = delete;
+
+    ~Entry () {
+      if (exit.fd != INVALID_PIPE) {
+        detail::close_pipe (exit.fd);
+      }
+    }
+
+    Child child;
+    Exit_Callback on_exit;
+    Output_Callback on_output;
+    detail::Watch out;
+    detail::Watch err;
+    detail::Watch exit;
+    std::optional<Exit_Status> status;
+    bool finished = false;
+    std::list<Entry>::iterator self;
+  };
+
+  bool watch (detail::Watch &w) {
+  #ifdef __linux__
+    epoll_event ev {};
+    ev.events = EPOLLIN;
+    ev.data.ptr = &w;
+    w.active = epoll_ctl (queue_, EPOLL_CTL_ADD, w.fd, &ev) == 0;
+  #else
+    struct kevent ev;
+    if (w.pid != 0) {
+      EV_SET (&ev, w.pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0, &w);
+    }
+    else {
+      EV_SET (&ev, w.fd, EVFILT_READ, EV_ADD, 0, 0, &w);
+    }
+    w.active = kevent (queue_, &ev, 1, nullptr, 0, nullptr) == 0;
+  #endif
+    return w.active;
+  }
+
+  void unwatch (detail::Watch &w) {
+    if (!w.active) {
+      return;
+    }
+    w.active = false;
+    if (w.polled) {
+      w.polled = false;
+      polled_.erase (std::find (polled_.begin (), polled_.end (), &w));
+      return;
+    }
+  #ifdef __linux__
+    epoll_ctl (queue_, EPOLL_CTL_DEL, w.fd, nullptr);
+  #else
+    struct kevent ev;
+    if (w.pid != 0) {
+      EV_SET (&ev, w.pid, EVFILT_PROC, EV_DELETE, 0, 0, nullptr);
+    }
+    else {
+      EV_SET (&ev, w.fd, EVFILT_READ, EV_DELETE, 0, 0, nullptr);
+    }
+    kevent (queue_, &ev, 1, nullptr, 0, nullptr);
+  #endif
+  }
+
+  // Watches for the exit of a process. The file descriptor of the watch must
+  // be closed by its owner.
+  void watch_exit (detail::Watch &w, Pid pid) {
+  #ifdef __linux__
+    w.fd = detail::pidfd_open (pid);
+    if (w.fd != INVALID_PIPE && watch (w)) {
+      return;
+    }
+  #else
+    w.pid = pid;
+    if (watch (w)) {
+      return;
+    }
+  #endif
+    // The process could not be watched, either because it is already gone
+    // or because the kernel does not support it, so it is polled instead.
+    w.active = true;
+    w.polled = true;
+    polled_.push_back (&w);
+  }
+
+  void check_done (Entry &e) {
+    if (e.status.has_value () && !e.out.active && !e.err.active && !e.finished) {
+      e.finished = true;
+      finished_.push_back (e.self);
+    }
+  }
+
+  void resume_ready () {
+    while (!ready_.empty ()) {
+      auto ready = std::move (ready_);
+      ready_.clear ();
+      for (auto h : ready) {
+        h.resume ();
+      }
+    }
+  }
+
+  // Entries are only destroyed after all events of a batch are dispatched
+  // since later events may still refer to their watches.
+  void release_finished () {
+    // Exit callbacks may register new children which may finish right away,
+    // so this processes the list until it stays empty.
+    while (!finished_.empty ()) {
+      auto finished = std::move (finished_);
+      finished_.clear ();
+      for (auto it : finished) {
+        if (it->on_exit) {
+          it->on_exit (it->child, it->status.value ());
+        }
+        entries_.erase (it);
+      }
+    }
+  }
+
+  Pipe_Handle queue_;
+  std::list<Entry> entries_;
+  std::vector<std::list<Entry>::iterator> finished_;
+  std::vector<detail::Watch *> polled_;
+  std::vector<std::coroutine_handle<>> ready_;
+  std::size_t tasks_;
+  std::vector<char> buffer_;
+};
+
+namespace detail {
+
+/// Awaiter of @ref Anonymous_Pipe::async_read.
+class Read_Awaiter {
+public:
+  Read_Awaiter (Reactor &reactor, Anonymous_Pipe &pipe, void *buf, std::size_t count)
+  : reactor_ (reactor),
+    pipe_ (pipe),
+    buf_ (buf),
+    count_ (count)
+  {}
+
+  Read_Awaiter (const Read_Awaiter &) = delete;
+
+  // The coroutine may be destroyed while it is suspended, its watch must not
+  // stay registered then.
+  ~Read_Awaiter () {
+    reactor_.unwatch (watch_);
+  }
+
+  bool await_ready () const noexcept {
+    return false;
+  }
+
+  bool await_suspend (std::coroutine_handle<> h) {
+    watch_.fd = pipe_.handle ();
+    watch_.on_ready = [this, h] () {
+      reactor_.unwatch (watch_);
+      reactor_.ready_.push_back (h);
+    };
+    // If the pipe cannot be watched reading it right away reports the error.
+    return reactor_.watch (watch_);
+  }
+
+  std::optional<std::size_t> await_resume () {
+    return pipe_.read (buf_, count_);
+  }
+
+private:
+  Reactor &reactor_;
+  Anonymous_Pipe &pipe_;
+  void *buf_;
+  std::size_t count_;
+  Watch watch_;
+};
+
+/// Awaiter of @ref Child::async_wait.
+class Wait_Awaiter {
+public:
+  Wait_Awaiter (Reactor &reactor, Child &child)
+  : reactor_ (reactor),
+    child_ (child)
+  {}
+
+  Wait_Awaiter (const Wait_Awaiter &) = delete;
+
+  ~Wait_Awaiter () {
+    reactor_.unwatch (watch_);
+    if (watch_.fd != INVALID_PIPE) {
+      close_pipe (watch_.fd);
+    }
+  }
+
+  bool await_ready () {
+    child_.get_stdin ().drop ();
+    status_ = child_.try_wait ();
+    return status_.has_value ();
+  }
+
+  void await_suspend (std::coroutine_handle<> h) {
+    watch_.on_ready = [this, h] () {
+      if ((status_ = child_.try_wait_watched (watch_.polled)).has_value ()) {
+        reactor_.unwatch (watch_);
+        reactor_.ready_.push_back (h);
+      }
+    };
+    reactor_.watch_exit (watch_, child_.id ());
+  }
+
+  Exit_Status await_resume () {
+    return status_.value ();
+  }
+
+private:
+  Reactor &reactor_;
+  Child &child_;
+  std::optional<Exit_Status> status_;
+  Watch watch_;
+};
+
+/// Awaiter of @ref Child::async_wait_with_output.
+class Output_Awaiter {
+public:
+  Output_Awaiter (Reactor &reactor, Child &child)
+  : reactor_ (reactor),
+    child_ (child),
+    out_ (child.buffer ()),
+    err_ (child.buffer ()),
+    targets_ {{child.get_stdout (), out_}, {child.get_stderr (), err_}},
+    remaining_ (0)
+  {}
+
+  Output_Awaiter (const Output_Awaiter &) = delete;
+
+  ~Output_Awaiter () {
+    for (auto &w : streams_) {
+      reactor_.unwatch (w);
+    }
+    reactor_.unwatch (exit_);
+    if (exit_.fd != INVALID_PIPE) {
+      close_pipe (exit_.fd);
+    }
+  }
+
+  bool await_ready () const noexcept {
+    return false;
+  }
+
+  bool await_suspend (std::coroutine_handle<> h) {
+    child_.get_stdin ().drop ();
+    handle_ = h;
+    for (int i = 0; i < 2; ++i) {
+      auto &t = targets_[i];
+      auto &w = streams_[i];
+      if (t.pipe.handle () == INVALID_PIPE) {
+        continue;
+      }
+      w.fd = t.pipe.handle ();
+      w.on_ready = [this, &t, &w] () {
+        if (!drain_some (t)) {
+          reactor_.unwatch (w);
+          finish_one ();
+        }
+      };
+      if (reactor_.watch (w)) {
+        ++remaining_;
+      }
+      else {
+        // Cannot be waited on, read it to EOF now instead.
+        while (drain_some (t)) {}
+      }
+    }
+    exit_.on_ready = [this] () {
+      if ((status_ = child_.try_wait_watched (exit_.polled)).has_value ()) {
+        reactor_.unwatch (exit_);
+        finish_one ();
+      }
+    };
+    ++remaining_;
+    reactor_.watch_exit (exit_, child_.id ());
+    return true;
+  }
+
+  Output await_resume () {
+    Output o {std::move (status_.value ())};
+    o.stdout_ = std::move (out_);
+    o.stderr_ = std::move (err_);
+    child_.collect_mapped (o);
+    return o;
+  }
+
+private:
+  void finish_one () {
+    if (--remaining_ == 0) {
+      reactor_.ready_.push_back (handle_);
+    }
+  }
+
+  Reactor &reactor_;
+  Child &child_;
+  std::vector<char> out_;
+  std::vector<char> err_;
+  Drain_Target targets_[2];
+  Watch streams_[2];
+  Watch exit_;
+  int remaining_;
+  std::optional<Exit_Status> status_;
+  std::coroutine_handle<> handle_;
+};
+
+} // namespace detail
+
+inline detail::Read_Awaiter Anonymous_Pipe::async_read (Reactor &reactor, void *buf, std::size_t count) {
+  return detail::Read_Awaiter (reactor, *this, buf, count);
+}
+
+inline detail::Wait_Awaiter Child::async_wait (Reactor &reactor) {
+  return detail::Wait_Awaiter (reactor, *this);
+}
+
+inline detail::Output_Awaiter Child::async_wait_with_output (Reactor &reactor) {
+  return detail::Output_Awaiter (reactor, *this);
+}
+
+/**
+ * @brief Called by @ref run_parallel with the position of a spell in the
+ *        batch and its output, or `std::nullopt` if it could not be cast.
+ */
+using Batch_Callback = std::function<void (std::size_t, std::optional<Output> &&)>;
+
+#endif // SPELL_HAS_REACTOR
+
+
+#ifndef _WIN32
+namespace detail {
+
+// Searched if PATH is not set, like execvp does.
+inline constexpr std::string_view DEFAULT_PATH = "/bin:/usr/bin";
+
+struct Resolved_Program {
+  std::string path;
+  dev_t dev = 0;
+  ino_t ino = 0;
+
+  // Whether the file is still the one the program was resolved to.
+  bool is_current () const {
+    struct stat st;
+    return stat (path.c_str (), &st) == 0 && st.st_dev == dev && st.st_ino == ino;
+  }
+};
+
+/**
+ * Process-wide cache of program names to the files they resolve to through
+ * PATH. All entries are dropped when PATH changes, and an entry is looked up
+ * again if its file was replaced or removed.
+ */
+class Path_Cache {
+public:
+  static Path_Cache& global () {
+    static Path_Cache cache;
+    return cache;
+  }
+
+  std::optional<Resolved_Program> resolve (const std::string &name, const std::string &search) {
+    {
+      std::unique_lock lock {mutex_};
+      if (search != search_) {
+        entries_.clear ();
+        search_ = search;
+      }
+      else if (auto it = entries_.find (name); it != entries_.end ()) {
+        auto entry = it->second;
+        lock.unlock ();
+        if (entry.is_current ()) {
+          return entry;
+        }
+      }
+    }
+    auto found = search_path (name, search);
+    std::lock_guard lock {mutex_};
+    if (search == search_) {
+      if (found.has_value ()) {
+        entries_.insert_or_assign (name, found.value ());
+      }
+      else {
+        entries_.erase (name);
+      }
+    }
+    return found;
+  }
+
+private:
+  // Returns the first executable regular file in the search path. Files
+  // found through relative directories are not returned as they depend on
+  // the working directory of the child.
+  static std::optional<Resolved_Program> search_path (std::string_view name, std::string_view search) {
+    Resolved_Program found;
+    while (true) {
+      const auto end = std::min (search.find (':'), search.size ());
+      const auto dir = search.substr (0, end);
+      if (!dir.empty () && dir.front () == '/') {
+        found.path.assign (dir);
+        if (found.path.back () != '/') {
+          found.path.push_back ('/');
+        }
+        found.path.append (name);
+        struct stat st;
+        if (stat (found.path.c_str (), &st) == 0 && S_ISREG (st.st_mode)
+            && access (found.path.c_str (), X_OK) == 0) {
+          found.dev = st.st_dev;
+          found.ino = st.st_ino;
+          return found;
+        }
+      }
+      else if (stat_relative (dir, name)) {
+        return std::nullopt;
+      }
+      if (end == search.size ()) {
+        return std::nullopt;
+      }
+      search.remove_prefix (end + 1);
+    }
+  }
+
+  // Whether a relative search directory contains the program, in which case
+  // the search is left to the exec functions.
+  static bool stat_relative (std::string_view dir, std::string_view name) {
+    std::string path {dir.empty () ? "." : dir};
+    path.push_back ('/');
+    path.append (name);
+    struct stat st;
+    return stat (path.c_str (), &st) == 0 && S_ISREG (st.st_mode);
+  }
+
+  std::mutex mutex_;
+  std::string search_;
+  std::unordered_map<std::string, Resolved_Program> entries_;
+};
+
+} // namespace detail
+#endif
+
+/**
+ * Command builder.
+ *
+ * `Spell(program)` generates a spell in the default configuration.
+ * Additional builder methods allow the configuration to be changed prior to launch.
+ * All of these builder methods return a reference to the spell, unless stated otherwise.
+ *
+ * Different spells can be cast from different threads at the same time. No
+ * lock is taken while launching and handles created for a child are never
+ * inherited by children of other threads. A single spell must not be used
+ * by multiple threads at once.
+ */
+class Spell {
+public:
+  /**
+   * @brief Constructs a new `Spell` for launching the program at path `program`.
+   *
+   * It has the following configuration:
+   *  - No arguments to the program
+   *  - Inherit the environment of the current process
+   *  - Inherit the current working directory
+   *  - stdin/stdout/stderr are set to @ref Stdio::Default
+   *
+   *  If `program` is not an absolute path it is resolved by respective process
+   *  execution function on Windows (CreateProcess). On other platforms names
+   *  without a slash are looked up in `PATH` once and the result is cached,
+   *  see @ref resolve.
+   *
+   *  @param program - path or name of the program
+   */
+  Spell (std::string_view program)
+  : program_ (program),
+    args_ {},
+    env_ (std::nullopt),
+    working_dir_ {},
+    change_dir_ (false),
+    stdout_ (Stdio::Default),
+    stderr_ (Stdio::Default),
+    stdin_ (Stdio::Default)
+  {}
+
+  /**
+   * @brief Constructs a spell from the given command line string.
+   *
+   * Takes a string containing a program and it's argument (for example 'echo Hello World')
+   * and turns it into a spell for that program with the given arguments.
+   *
+   * @param command_line - Space-delimited string of the program and it's arguments.
+   *                       Spaces can be escaped with a blackslash and are ignored
+   *                       inside a string. Strings use either single or double quotes,
+   *                       the quotes will not be included in the argument added to the
+   *                       spell.
+   * @return A @ref Spell object with arguments from the given command line string.
+   *
+   * Command lines that are known at compile time can be parsed during
+   * compilation with @ref Command instead.
+   */
+  static Spell from_string (std::string_view command_line) {
+    std::string chomped;
+    auto chomp = [&] () -> const std::string& {
+      auto it = command_line.begin ();
+      const auto end = command_line.end ();
+      auto in_string = '\0';
+      chomped.clear ();
+      for (; it != end; ++it) {
+        switch (*it) {
+          case '\\':
+            ++it;
+            if (it == end) {
+              break;
+            }
+            chomped.push_back (*it);
+            break;
+          case '\'':
+          case '"':
+            if (in_string == '\0') {
+              in_string = *it;
+            }
+            else if (*it == in_string) {
+              in_string = '\0';
+            }
+            else {
+              chomped.push_back (*it);
+            }
+            break;
+          case ' ':
+            if (in_string == '\0') {
+              goto break_;
+            }
+            else {
+              chomped.push_back (' ');
+            }
+            break;
+          default:
+            chomped.push_back (*it);
+            break;
+        }
+      }
+    break_:
+      command_line.remove_prefix (std::distance (command_line.begin (), it));
+      while (command_line.front () == ' ') {
+        command_line.remove_prefix (1);
+      }
+      return chomped;
+    };
+    auto spell = Spell (chomp ());
+    std::string_view arg;
+    while (!(arg = chomp ()).empty ()) {
+      spell.arg (arg);
+    }
+    return spell;
+  }
+
+  /**
+   * @brief Returns the path to the program that was given to the constructor.
+   */
+  std::string_view get_program () const {
+    return program_;
+  }
+
+  ////////////////////////////////////////////////////////////////////////
+  // Arguments
+
+  /**
+   * @brief Adds an argument to pass to the program.
+   *
+   * These are equivalent to the individual `argv` elements so only one arguments can be passed per use.
+   * Use @ref args to pass multiple arguments.
+   *
+   * @param arg - the argument to add.
+   */
+  Spell& arg (std::string_view arg) {
+    args_.push_back (arg);
+    return *this;
+  }
+
+  /**
+   * @brief Adds an argument without copying it.
+   *
+   * The memory of `arg` has to stay valid and unchanged as long as the
+   * argument is part of the spell, for example a string literal.
+   *
+   * @param arg - the argument to add.
+   */
+  Spell& borrow_arg (std::string_view arg) {
+    args_.borrow (arg);
+    return *this;
+  }
+
+  /**
+   * @brief Adds multiple arguments to add to the program.
+   *
+   * Use @ref arg to pass a single argument.
+   *
+   * @param args - the arguments to add.
+   */
+  Spell& args (const std::vector<std::string_view> &args) {
+    args_.reserve (args_.size () + args.size ());
+    for (const auto &a : args) {
+      args_.push_back (a);
+    }
+    return *this;
+  }
+
+  /// @copydoc args
+  template <class... Args>
+  Spell& args (const Args&... args) {
+    args_.reserve (args_.size () + sizeof... (Args));
+    (args_.push_back (args), ...);
+    return *this;
+  }
+
+  /**
+   * @brief Returns a mutable reference to the arguments.
+   */
+  Args& get_args () {
+    return args_;
+  }
+
+  /**
+   * @brief Returns a constant reference to the arguments.
+   */
+  const Args& get_args () const {
+    return args_;
+  }
+
+  ////////////////////////////////////////////////////////////////////////
+  // Environment
+
+  /**
+   * @brief Inserts or updates an environment variable.
+   * @param key - name of the variable
+   * @param val - value of the variable
+   */
+  Spell& env (std::string_view key, std::string_view val) {
+    if (!env_.has_value ()) {
+      env_.emplace ();
+    }
+    env_->set (key, val);
+    return *this;
+  }
+
+  /**
+   * @brief Adds of updates multiple environment variables.
+   * @param vars - Span of {key, value} pairs
+   */
+  Spell& envs (std::span<std::pair<std::string_view, std::string_view>> vars) {
+    if (!env_.has_value ()) {
+      env_.emplace ();
+    }
+    for (const auto &[key, val] : vars) {
+      env_->set (key, val);
+    }
+    return *this;
+  }
+
+  /**
+   * @brief Clears the entire environment for the child process.
+   */
+  Spell& env_clear () {
+    if (!env_.has_value ()) {
+      env_.emplace (false);
+    }
+    else {
+      env_->clear ();
+    }
+    return *this;
+  }
+
+  /**
+   * @brief Removes an environment variable.
+   * @param key - name of the variable.
+   */
+  Spell& env_remove (std::string_view key) {
+    if (!env_.has_value ()) {
+      env_.emplace ();
+    }
+    env_->remove (key);
+    return *this;
+  }
+
+  /**
+   * @brief Get a mutable reference to the environment for the child process.
+   *
+   * See @ref Env.
+   */
+  Env& get_envs () {
+    if (!env_.has_value ()) {
+      env_.emplace ();
+    }
+    return env_.value ();
+  }
+
+  /**
+   * @brief Get a constant reference to the environment for the child process.
+   *
+   * See @ref Env.
+   */
+  const Env& get_envs () const {
+    if (!env_.has_value ()) {
+      return Env::empty_env ();
+    }
+    return env_.value ();
+  }
+
+  ////////////////////////////////////////////////////////////////////////
+  // Directory
+
+  /**
+   * @brief Sets the working directory for the child process.
+   *
+   * The given path gets canonicalized, relative paths are relative to the
+   * previously set directory or the current directory of this process.
+   *
+   * On unix platforms the directory is opened once here and children change
+   * into it through that descriptor, so launches do not resolve the path
+   * again. If it cannot be opened the path is used, and launching fails if
+   * it still cannot be changed into.
+   *
+   * @param dir - absolute or relative path to working directory.
+   */
+  Spell& current_dir (const std::filesystem::path &dir) {
+    if (dir.is_absolute ())
+      working_dir_ = dir;
+    else
+      working_dir_ = std::filesystem::weakly_canonical (
+        (change_dir_ ? working_dir_ : std::filesystem::current_path ()) / dir
+      );
+    change_dir_ = true;
+  #ifndef _WIN32
+    const int fd = ::open (working_dir_.c_str (), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    dir_fd_ = fd < 0
+      ? nullptr
+      : std::shared_ptr<const int> (new int (fd), [] (const int *p) {
+          close (*p);
+          delete p;
+        });
+  #endif
+    return *this;
+  }
+
+  /**
+   * @brief Returns the working directory for the child process.
+   *
+   * Unless @ref current_dir was used this is the current directory of this
+   * process, which is only looked up here.
+   */
+  std::filesystem::path get_current_dir () const {
+    return change_dir_ ? working_dir_ : std::filesystem::current_path ();
+  }
+
+  ////////////////////////////////////////////////////////////////////////
+  // Streams
+
+  /**
+   * @brief Configuration for the child process's standard output handle.
+   *
+   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
+   * and defaults to @ref Stdio::Piped when used with @ref cast_output or
+   * @ref cast_streaming.
+   *
+   * See @ref Stdio.
+   *
+   * @param cfg - new configuration or @ref Stdio::Default.
+   */
+  Spell& set_stdout (Stdio cfg) {
+    stdout_ = cfg;
+    return *this;
+  }
+
+  /**
+   * @brief Configuration for the child process's standard error handle.
+   *
+   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
+   * and defaults to @ref Stdio::Piped when used with @ref cast_output or
+   * @ref cast_streaming.
+   *
+   * See @ref Stdio.
+   *
+   * @param cfg - new configuration or @ref Stdio::Default.
+   */
+  Spell& set_stderr (Stdio cfg) {
+    stderr_ = cfg;
+    return *this;
+  }
+
+  /**
+   * @brief Configuration for the child process's standard input handle.
+   *
+   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
+   * and defaults to @ref Stdio::Piped when used with @ref cast_output or
+   * @ref cast_streaming.
+   *
+   * See @ref Stdio.
+   *
+   * @param cfg - new configuration or @ref Stdio::Default.
+   */
+  Spell& set_stdin (Stdio cfg) {
+    stdin_ = cfg;
+    return *this;
+  }
+
+  /**
+   * @brief Capacity for the pipe of a piped stdin.
+   *
+   * A larger pipe lets the parent write more input before it has to wait
+   * for the child to read it. Only supported on Linux, see
+   * @ref Anonymous_Pipe::set_capacity.
+   *
+   * @param bytes - the requested capacity, or 0 for the system default.
+   */
+  Spell& stdin_capacity (std::size_t bytes) {
+    stdin_capacity_ = bytes;
+    return *this;
+  }
+
+  /**
+   * @brief Takes the buffers that output is read into from the given pool.
+   *
+   * See @ref Buffer_Pool.
+   *
+   * @param pool - the pool to use, or `nullptr` to allocate new buffers.
+   */
+  Spell& buffer_pool (Buffer_Pool *pool) {
+    pool_ = pool;
+    return *this;
+  }
+
+  ////////////////////////////////////////////////////////////////////////
+  // Limits
+
+  /**
+   * @brief Limits how long @ref cast_status, @ref cast_output, and
+   *        @ref cast_streaming wait for the child.
+   *
+   * Once the child has been running for longer than `timeout` it is asked to
+   * exit with @ref Child::terminate, if it is still running after `grace` it
+   * is killed. Its @ref Exit_Status reports that it @ref Exit_Status::timed_out.
+   * On Windows the child is killed right away.
+   *
+   * @param timeout - maximum run time of the child.
+   * @param grace - time the child gets to exit after being asked to.
+   */
+  Spell& timeout (std::chrono::milliseconds timeout, std::chrono::milliseconds grace = std::chrono::seconds (1)) {
+    timeout_ = timeout;
+    grace_ = grace;
+    return *this;
+  }
+
+  /**
+   * @brief Removes the limit set with @ref timeout.
+   */
+  Spell& no_timeout () {
+    timeout_.reset ();
+    return *this;
+  }
+
+#ifndef _WIN32
+  /**
+   * @brief Sets a resource limit of the child, see `setrlimit`.
+   *
+   * Setting a limit for the same resource again replaces it. Launching the
+   * child fails if the limit cannot be set, for example when raising the
+   * hard limit without permission.
+   *
+   * Only available on Unix platforms.
+   *
+   * @param resource - the resource, like `RLIMIT_AS` or `RLIMIT_CPU`.
+   * @param soft - the soft limit, may be `RLIM_INFINITY`.
+   * @param hard - the hard limit, may be `RLIM_INFINITY`.
+   */
+  Spell& rlimit (int resource, rlim_t soft, rlim_t hard) {
+    const auto limit = ::rlimit {soft, hard};
+    for (auto &[r, l] : rlimits_) {
+      if (r == resource) {
+        l = limit;
+        return *this;
+      }
+    }
+    rlimits_.emplace_back (resource, limit);
+    return *this;
+  }
+#endif
+
+  /**
+   * @brief Sets the niceness of the child.
+   *
+   * Higher values give the child a lower scheduling priority. Lowering the
+   * niceness below that of this process usually requires privileges,
+   * launching the child fails otherwise.
+   *
+   * On Windows this selects the priority class of the child: 15 and above
+   * is idle, 5 and above below normal, -5 and below above normal, and -15
+   * and below high.
+   *
+   * @param niceness - the niceness, from -20 to 19.
+   */
+  Spell& nice (int niceness) {
+    nice_ = niceness;
+    return *this;
+  }
+
+#ifdef SPELL_HAS_CPU_AFFINITY
+  /**
+   * @brief Restricts the child to the given CPUs.
+   *
+   * Bit `i` of `mask` allows the child to run on CPU `i`. Launching the
+   * child fails if none of the CPUs is available.
+   *
+   * Only available on Linux and Windows.
+   */
+  Spell& cpu_affinity (std::uint64_t mask) {
+    affinity_ = mask;
+    return *this;
+  }
+#endif
+
+  /**
+   * @brief Makes the child the leader of a new process group.
+   *
+   * Processes started by the child join its group unless they create their
+   * own, so @ref Child::kill_tree can stop all of them at once, and a
+   * timeout (see @ref timeout) stops all of them instead of only the child.
+   *
+   * On Windows the child is also placed into a new Job Object, which all
+   * its descendants belong to.
+   */
+  Spell& new_process_group () {
+    new_group_ = true;
+    return *this;
+  }
+
+#ifdef __linux__
+  /**
+   * @brief Places the child into the given cgroup before it executes
+   *        its program.
+   *
+   * With the memory or cpu controllers enabled for the cgroup, its limits
+   * apply to the child from its first instruction. Launching the child
+   * fails if it cannot be moved into the cgroup.
+   *
+   * Only available on Linux.
+   *
+   * @param path - the directory of the cgroup, like
+   *               `/sys/fs/cgroup/jobs`.
+   */
+  Spell& cgroup (std::filesystem::path path) {
+    cgroup_ = std::move (path);
+    return *this;
+  }
+#endif
+
+  ////////////////////////////////////////////////////////////////////////
+  // Running
+
+#ifndef _WIN32
+  /**
+   * @brief Launches the child through the given @ref Spawn_Server instead
+   *        of from this process.
+   *
+   * Falls back to launching from this process if the server is not
+   * @ref Spawn_Server::valid.
+   *
+   * @param server - the server to use, or `nullptr` to launch from this
+   *                 process again.
+   */
+  Spell& spawn_server (Spawn_Server *server) {
+    server_ = server != nullptr && server->valid () ? server : nullptr;
+    return *this;
+  }
+#endif
+
+  /**
+   * @brief Serializes the program, arguments, and environment for launching.
+   *
+   * This happens automatically when the spell is cast, and is only repeated
+   * if any of them changed since, so launching the same spell repeatedly does
+   * not allocate or hash anything for them. Calling this ahead of time
+   * removes the cost from the first launch.
+   */
+  Spell& prepare () {
+    exec_block ();
+    return *this;
+  }
+
+  /**
+   * @brief Looks up the file the program is executed from.
+   *
+   * On Unix platforms program names without a slash are searched in the
+   * `PATH` of this process, like `execvp` does, but only once: the result is
+   * cached for all spells and only looked up again if `PATH` changed or the
+   * file was replaced. Calling this ahead of time removes the search from the
+   * first launch.
+   *
+   * @return the path of the program, or `std::nullopt` if it was not found.
+   */
+  std::optional<std::filesystem::path> resolve () {
+  #ifdef _WIN32
+    char buf[MAX_PATH];
+    const DWORD n = SearchPathA (nullptr, program_.c_str (), ".exe", sizeof (buf), buf, nullptr);
+    if (n == 0 || n >= sizeof (buf)) {
+      return std::nullopt;
+    }
+    return std::filesystem::path (std::string_view (buf, n));
+  #else
+    if (const char *file = resolved_program ()) {
+      return file;
+    }
+    return std::nullopt;
+  #endif
+  }
+
+  /**
+   * @brief Executes the command as a child process, returning a handle to it.
+   *
+   * By default, stdin, stdout and stderr are inherited from the parent.
+   *
+   * @return a @ref Child for the child process or std::nullopt if execution failed.
+   */
+  std::optional<Child> cast () {
+    return do_cast (Stdio::Inherit);
+  }
+
+  /**
+   * @brief Executes the command as a child process, waiting for it to finish and collecting its status.
+   *
+   * By default, stdin, stdout and stderr are inherited from the parent.
+   *
+   * @return the @ref Exit_Status of the child process or std::nullopt if execution failed.
+   */
+  std::optional<Exit_Status> cast_status () {
+    auto child = do_cast (Stdio::Inherit);
+    if (child.has_value ())
+      return child->wait (make_timeout ());
+    return std::nullopt;
+  }
+
+  /**
+   * @brief Executes the command as a child process, waiting for it to finish and collecting all of its output.
+   *
+   * By default stdout and stderr are captured and used to provide the resulting output.
+   * Stdin is captured and immediately closed.
+   *
+   * @return the @ref Output of the child process or std::nullopt if execution failed.
+   */
+  std::optional<Output> cast_output () {
+    auto child = do_cast (Stdio::Piped);
+    if (child.has_value ()) {
+      return child->wait_with_output (make_timeout ());
+    }
+    return std::nullopt;
+  }
+
+  /**
+   * @brief Executes the command as a child process, passing its output to
+   *        the given callbacks as it arrives until it has finished.
+   *
+   * By default stdout and stderr are captured like with @ref cast_output,
+   * see @ref Child::wait_streaming.
+   *
+   * @param on_stdout - Called with each chunk read from stdout.
+   * @param on_stderr - Called with each chunk read from stderr.
+   * @return the @ref Exit_Status of the child process or std::nullopt if execution failed.
+   */
+  std::optional<Exit_Status> cast_streaming (
+    const Chunk_Callback &on_stdout, const Chunk_Callback &on_stderr = nullptr
+  ) {
+    auto child = do_cast (Stdio::Piped);
+    if (child.has_value ()) {
+      return child->wait_streaming (on_stdout, on_stderr, make_timeout ());
+    }
+    return std::nullopt;
+  }
+
+#ifdef SPELL_HAS_REACTOR
+  /**
+   * @brief Like @ref cast_output, but suspends the calling coroutine instead
+   *        of blocking the thread.
+   *
+   * The spell has to be alive until the returned task has finished.
+   *
+   * @return a @ref Task producing the @ref Output of the child process or
+   *         std::nullopt if execution failed.
+   */
+  Task<std::optional<Output>> async_cast_output (Reactor &reactor) {
+    auto child = do_cast (Stdio::Piped);
+    if (!child.has_value ()) {
+      co_return std::nullopt;
+    }
+    co_return co_await child->async_wait_with_output (reactor);
+  }
+#endif
+
+private:
+  friend class Pipeline;
+#ifdef SPELL_HAS_REACTOR
+  friend void run_parallel (std::span<Spell>, std::size_t, const Batch_Callback &);
+#endif
+
+  // `given_stdin` and `given_stdout` can be used to override the configured
+  // stream with a handle, which is consumed.
+  std::optional<Child> do_cast (
+    Stdio default_cfg,
+    Anonymous_Pipe *given_stdin = nullptr,
+    Anonymous_Pipe *given_stdout = nullptr
+  ) {
+    using namespace detail;
+    const auto spawn_start = std::chrono::steady_clock::now ();
+    // The parent's handles of the files of mapped streams.
+    Anonymous_Pipe out_file, err_file;
+    // Whether the child is reaped by the Reaper.
+    bool adopted = false;
+    // Called once the program of the child is running.
+    auto launched = [this, &spawn_start, &out_file, &err_file, &adopted] (Child &&child) {
+      child.group_ = new_group_;
+    #ifndef _WIN32
+      if (adopted) {
+        child.exit_ = detail::Exit_Claim (child.id (), nullptr, true);
+      }
+    #else
+      (void)adopted;
+    #endif
+      child.stdout_file_ = std::move (out_file);
+      child.stderr_file_ = std::move (err_file);
+      child.pool_ = pool_;
+      child.timings_.spawn_start = spawn_start;
+      child.timings_.exec = std::chrono::steady_clock::now ();
+      return std::optional<Child> {std::move (child)};
+    };
+    Anonymous_Pipe::Pipes out, err, in;
+
+    // Only piped streams get a parent end, for the others only the end used
+    // by the child is valid.
+    // Returns false if a file or handle given by the configuration could
+    // not be opened.
+    // `file` receives a handle of the file used for Stdio::Mapped, which is
+    // not allowed if it is not given.
+    auto set_pipe = [&default_cfg](
+      Anonymous_Pipe::Pipes &p,
+      const Stdio &cfg,
+      auto s,
+      bool child_reads,
+      Anonymous_Pipe *given = nullptr,
+      Anonymous_Pipe *file = nullptr
+    ) {
+      const Stdio &c = cfg == Stdio::Default ? default_cfg : cfg;
+      auto &child_end = child_reads ? p.read : p.write;
+      if (given != nullptr) {
+        child_end = std::move (*given);
+        return true;
+      }
+      switch (c.kind_) {
+      break; case Stdio::Kind::Inherit: {
+        child_end = Anonymous_Pipe::create_inherit (s);
+      }
+      break; case Stdio::Kind::Piped: {
+        p = child_reads ? Anonymous_Pipe::create () : Anonymous_Pipe::create_output ();
+      }
+      break; case Stdio::Kind::Null: {
+        child_end = Anonymous_Pipe::create_null ();
+      }
+      break; case Stdio::Kind::File: {
+        child_end = Anonymous_Pipe::create_file (c.path_, c.mode_);
+        return child_end.handle () != INVALID_PIPE;
+      }
+      break; case Stdio::Kind::Handle: {
+        child_end = Anonymous_Pipe::create_duplicate (c.handle_);
+        return child_end.handle () != INVALID_PIPE;
+      }
+      break; case Stdio::Kind::Mapped: {
+        if (file == nullptr) {
+          return false;
+        }
+        child_end = Anonymous_Pipe::create_memory ();
+        if (child_end.handle () == INVALID_PIPE) {
+          return false;
+        }
+        *file = Anonymous_Pipe::create_duplicate (child_end.handle ());
+        return file->handle () != INVALID_PIPE;
+      }
+      break; case Stdio::Kind::Default:;
+      }
+      return true;
+    };
+
+  #ifdef _WIN32
+    if (!(set_pipe (out, stdout_, STD_OUTPUT_HANDLE, false, given_stdout, &out_file)
+          && set_pipe (err, stderr_, STD_ERROR_HANDLE, false, nullptr, &err_file)
+          && set_pipe (in, stdin_, STD_INPUT_HANDLE, true, given_stdin))) {
+      return std::nullopt;
+    }
+
+    PROCESS_INFORMATION process_info {};
+    ZeroMemory (&process_info, sizeof (PROCESS_INFORMATION));
+
+    // Only the child's ends are inherited, otherwise a child spawned by
+    // another thread at the same time would inherit every inheritable handle
+    // of the process, including the ends of our pipes.
+    HANDLE inherit[3];
+    std::size_t inherit_count = 0;
+    for (HANDLE h : {out.write.handle (), err.write.handle (), in.read.handle ()}) {
+      if (h != INVALID_HANDLE_VALUE && h != nullptr) {
+        inherit[inherit_count++] = h;
+      }
+    }
+    SIZE_T attr_size = 0;
+    InitializeProcThreadAttributeList (nullptr, 1, 0, &attr_size);
+    std::vector<char> attr_buf (attr_size);
+    auto attrs = reinterpret_cast<LPPROC_THREAD_ATTRIBUTE_LIST> (attr_buf.data ());
+    if (!InitializeProcThreadAttributeList (attrs, 1, 0, &attr_size)) {
+      return std::nullopt;
+    }
+    if (inherit_count != 0) {
+      UpdateProcThreadAttribute (
+        attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST,
+        inherit, inherit_count * sizeof (HANDLE), nullptr, nullptr
+      );
+    }
+
+    STARTUPINFOEXA startup_info = {};
+    ZeroMemory (&startup_info, sizeof (STARTUPINFOEXA));
+    startup_info.StartupInfo.cb = sizeof (STARTUPINFOEXA);
+    startup_info.StartupInfo.hStdOutput = out.write.handle ();
+    startup_info.StartupInfo.hStdError = err.write.handle ();
+    startup_info.StartupInfo.hStdInput = in.read.handle ();
+    startup_info.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+    startup_info.lpAttributeList = attrs;
+
+    auto &exec = exec_block ();
+
+    // Don't inherit parent ends of pipes in processes spawned by others.
+    SetHandleInformation (in.write.handle (), HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation (out.read.handle (), HANDLE_FLAG_INHERIT, 0);
+    SetHandleInformation (err.read.handle (), HANDLE_FLAG_INHERIT, 0);
+
+    DWORD flags = EXTENDED_STARTUPINFO_PRESENT;
+    if (nice_.has_value ()) {
+      const int n = nice_.value ();
+      flags |= n >= 15 ? IDLE_PRIORITY_CLASS
+        : n >= 5 ? BELOW_NORMAL_PRIORITY_CLASS
+        : n > -5 ? NORMAL_PRIORITY_CLASS
+        : n > -15 ? ABOVE_NORMAL_PRIORITY_CLASS
+        : HIGH_PRIORITY_CLASS;
+    }
+    if (new_group_) {
+      flags |= CREATE_NEW_PROCESS_GROUP;
+    }
+    // The affinity and job can only be set once the process exists, so it
+    // must not run before that.
+    const bool suspended = affinity_.has_value () || new_group_;
+    if (suspended) {
+      flags |= CREATE_SUSPENDED;
+    }
+
+    const bool created = CreateProcessA (
+      nullptr,
+      exec.command_line (),
+      nullptr,
+      nullptr,
+      inherit_count != 0,
+      flags,
+      exec.environment (),
+      change_dir_ ? working_dir_.string ().c_str () : nullptr,
+      &startup_info.StartupInfo,
+      &process_info
+    );
+    DeleteProcThreadAttributeList (attrs);
+    if (!created) {
+      return std::nullopt;
+    }
+
+    std::shared_ptr<void> job;
+    if (new_group_) {
+      if (HANDLE h = CreateJobObjectA (nullptr, nullptr); h != nullptr) {
+        job.reset (h, CloseHandle);
+      }
+    }
+    const bool placed = (!affinity_.has_value ()
+                         || SetProcessAffinityMask (process_info.hProcess, static_cast<DWORD_PTR> (affinity_.value ())))
+                        && (!new_group_ || (job && AssignProcessToJobObject (job.get (), process_info.hProcess)));
+    if (!placed) {
+      TerminateProcess (process_info.hProcess, 1);
+      WaitForSingleObject (process_info.hProcess, INFINITE);
+      CloseHandle (process_info.hThread);
+      CloseHandle (process_info.hProcess);
+      return std::nullopt;
+    }
+    if (suspended) {
+      ResumeThread (process_info.hThread);
+    }
+    CloseHandle (process_info.hThread);
+
+    in.read.drop ();
+    out.write.drop ();
+    err.write.drop ();
+
+    auto child = launched (Child (
+      process_info.hProcess,
+      std::move (in.write),
+      std::move (out.read),
+      std::move (err.read)
+    ));
+    child->job_ = std::move (job);
+    return child;
+
+  #else
+
+    if (!(set_pipe (out, stdout_, stdout, false, given_stdout, &out_file)
+          && set_pipe (err, stderr_, stderr, false, nullptr, &err_file)
+          && set_pipe (in, stdin_, stdin, true, given_stdin))) {
+      return std::nullopt;
+    }
+    if (stdin_capacity_ != 0 && in.write.handle () != INVALID_PIPE) {
+      // Best effort, the default size still works.
+      in.write.set_capacity (stdin_capacity_);
+    }
+
+    const auto &exec = exec_block ();
+    // The server cannot apply limits.
+    Spawn_Server *const server = has_placement () ? nullptr : server_;
+    // Children of this process are adopted by the reaper if it's enabled.
+    auto &reaper = Reaper::instance ();
+    auto launch_guard = server == nullptr ? reaper.launch_guard () : std::nullopt;
+    adopted = launch_guard.has_value ();
+
+    if (server != nullptr || can_spawn ()) {
+      const auto pid = server != nullptr
+        ? server->launch (
+            exec,
+            change_dir_ ? &working_dir_ : nullptr,
+            in.read.handle (),
+            out.write.handle (),
+            err.write.handle (),
+            new_group_
+          )
+        : spawn (exec, in, out, err);
+      if (pid.has_value () && adopted) {
+        reaper.adopt (pid.value ());
+      }
+      launch_guard.reset ();
+      in.read.drop ();
+      out.write.drop ();
+      err.write.drop ();
+      if (!pid.has_value ()) {
+        in.write.drop ();
+        out.read.drop ();
+        err.read.drop ();
+        return std::nullopt;
+      }
+      return launched (Child (
+        pid.value (),
+        std::move (in.write),
+        std::move (out.read),
+        std::move (err.read),
+        server
+      ));
+    }
+
+  #ifdef __linux__
+    // Writing 0 to `cgroup.procs` moves the writing process into the cgroup.
+    int cgroup_procs = -1;
+    if (!cgroup_.empty ()) {
+      cgroup_procs = open ((cgroup_ / "cgroup.procs").c_str (), O_WRONLY | O_CLOEXEC);
+      if (cgroup_procs < 0) {
+        return std::nullopt;
+      }
+    }
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    for (int cpu = 0; affinity_.has_value () && cpu < 64; ++cpu) {
+      if (affinity_.value () >> cpu & 1) {
+        CPU_SET (cpu, &cpus);
+      }
+    }
+  #endif
+
+    auto [input, output] = Anonymous_Pipe::create ();
+    const char *file = resolved_program ();
+
+    // Nothing is allocated in the child as another thread of the parent may
+    // have held the allocator lock while forking.
+    const pid_t pid = fork ();
+    if (pid > 0 && adopted) {
+      reaper.adopt (pid);
+    }
+    // The child never returns here, and must not touch the lock.
+    if (pid != 0) {
+      launch_guard.reset ();
+    }
+    if (pid < 0) {
+    #ifdef __linux__
+      if (cgroup_procs >= 0) {
+        ::close (cgroup_procs);
+      }
+    #endif
+      return std::nullopt;
+    }
+    if (pid == 0) {
+      input.drop ();
+      if (new_group_) {
+        setpgid (0, 0);
+      }
+      // Reports the error to the parent.
+      auto fail = [&output] () {
+        const std::int32_t error = errno;
+        output.write (&error, 4);
+        _exit (127);
+      };
+    #ifdef __linux__
+      if (cgroup_procs >= 0 && ::write (cgroup_procs, "0", 1) != 1) {
+        fail ();
+      }
+      if (affinity_.has_value () && sched_setaffinity (0, sizeof (cpus), &cpus) != 0) {
+        fail ();
+      }
+    #endif
+      for (const auto &[resource, limit] : rlimits_) {
+        if (setrlimit (resource, &limit) != 0) {
+          fail ();
+        }
+      }
+      if (nice_.has_value () && setpriority (PRIO_PROCESS, 0, nice_.value ()) != 0) {
+        fail ();
+      }
+      if (change_dir_
+          && (dir_fd_ ? fchdir (*dir_fd_) : chdir (working_dir_.c_str ())) != 0) {
+        fail ();
+      }
+      // Duplicate and close pipes
+      dup2 (out.write.handle (), STDOUT_FILENO);
+      out.drop ();
+      dup2 (err.write.handle (), STDERR_FILENO);
+      err.drop ();
+      dup2 (in.read.handle (), STDIN_FILENO);
+      in.drop ();
+      if (file != nullptr) {
+        execve (file, exec.argv (), exec.envp () != nullptr ? exec.envp () : environ);
+      }
+      else if (exec.envp () != nullptr) {
+        execvpe (exec.program (), exec.argv (), exec.envp ());
+      }
+      else {
+        execvp (exec.program (), exec.argv ());
+      }
+      fail ();
+    }
+
+    output.drop ();
+    if (new_group_) {
+      // Also done by the parent so the group exists once this returns.
+      setpgid (pid, pid);
+    }
+  #ifdef __linux__
+    if (cgroup_procs >= 0) {
+      ::close (cgroup_procs);
+    }
+  #endif
+
+    in.read.drop ();
+    out.write.drop ();
+    err.write.drop ();
+
+    if (std::int32_t error = 0; input.read (&error, 4).value_or (0) == 4) {
+      input.drop ();
+    #if 0
+      std::fprintf (stderr, "%s: %s\n", program_.c_str (), std::strerror (error));
+    #endif
+      in.write.drop ();
+      out.read.drop ();
+      err.read.drop ();
+      if (adopted) {
+        reaper.forget (pid);
+      }
+      return std::nullopt;
+    }
+    input.drop ();
+
+    return launched (Child (
+      pid,
+      std::move (in.write),
+      std::move (out.read),
+      std::move (err.read)
+    ));
+  #endif
+  }
+
+  // Lets pipelines and batch casts, which only see the child, collect its
+  // mapped output.
+  static void collect_mapped (Child &child, Output &o) {
+    child.collect_mapped (o);
+  }
+
+  // The limits for waiting on a child cast now.
+  std::optional<detail::Timeout> make_timeout () const {
+    if (!timeout_.has_value ()) {
+      return std::nullopt;
+    }
+    return detail::Timeout {std::chrono::steady_clock::now () + timeout_.value (), grace_};
+  }
+
+  // Returns the serialized program, arguments, and environment, only
+  // rebuilding them if they were changed since the last launch.
+  detail::Exec_Block& exec_block () {
+    const Env *env = env_.has_value () ? &env_.value () : nullptr;
+    if (!exec_.matches (args_, env)) {
+      exec_.build (program_, args_, env);
+    }
+    return exec_;
+  }
+
+#ifndef _WIN32
+  // Returns the file to execute, or `nullptr` if the program should be
+  // searched for by the exec functions because it was not found or is in a
+  // relative directory of PATH.
+  const char* resolved_program () {
+    if (program_.find ('/') != std::string::npos) {
+      return program_.c_str ();
+    }
+    if (program_.empty ()) {
+      return nullptr;
+    }
+    const char *path_var = std::getenv ("PATH");
+    const std::string_view search = path_var ? path_var : detail::DEFAULT_PATH;
+    if (resolved_.path.empty () || search != resolved_for_ || !resolved_.is_current ()) {
+      resolved_for_.assign (search);
+      resolved_ = detail::Path_Cache::global ()
+        .resolve (program_, resolved_for_)
+        .value_or (detail::Resolved_Program {});
+    }
+    return resolved_.path.empty () ? nullptr : resolved_.path.c_str ();
+  }
+
+  // Whether the current configuration can be launched with `posix_spawn`,
+  // which avoids copying the page tables of the parent like `fork` does.
+  bool can_spawn () const {
+    if (has_placement ()) {
+      return false;
+    }
+  #ifdef SPELL_HAS_SPAWN_CHDIR
+    return true;
+  #else
+    return !change_dir_;
+  #endif
+  }
+
+  // Whether limits have to be applied to the child between `fork` and
+  // `exec`.
+  bool has_placement () const {
+    bool placed = !rlimits_.empty () || nice_.has_value ();
+  #ifdef __linux__
+    placed = placed || affinity_.has_value () || !cgroup_.empty ();
+  #endif
+    return placed;
+  }
+
+  std::optional<pid_t> spawn (
+    const detail::Exec_Block &exec,
+    Anonymous_Pipe::Pipes &in,
+    Anonymous_Pipe::Pipes &out,
+    Anonymous_Pipe::Pipes &err
+  ) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init (&actions) != 0) {
+      return std::nullopt;
+    }
+    posix_spawn_file_actions_adddup2 (&actions, out.write.handle (), STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, err.write.handle (), STDERR_FILENO);
+    posix_spawn_file_actions_adddup2 (&actions, in.read.handle (), STDIN_FILENO);
+  #ifdef SPELL_HAS_SPAWN_CHDIR
+    if (dir_fd_) {
+      posix_spawn_file_actions_addfchdir_np (&actions, *dir_fd_);
+    }
+    else if (change_dir_) {
+      posix_spawn_file_actions_addchdir_np (&actions, working_dir_.c_str ());
+    }
+  #endif
+
+    posix_spawnattr_t attrs;
+    if (posix_spawnattr_init (&attrs) != 0) {
+      posix_spawn_file_actions_destroy (&actions);
+      return std::nullopt;
+    }
+    if (new_group_) {
+      posix_spawnattr_setflags (&attrs, POSIX_SPAWN_SETPGROUP);
+      posix_spawnattr_setpgroup (&attrs, 0);
+    }
+
+    pid_t pid;
+    const char *file = resolved_program ();
+    const int error = (file != nullptr ? posix_spawn : posix_spawnp) (
+      &pid,
+      file != nullptr ? file : exec.program (),
+      &actions,
+      &attrs,
+      exec.argv (),
+      exec.envp () != nullptr ? exec.envp () : environ
+    );
+    posix_spawnattr_destroy (&attrs);
+    posix_spawn_file_actions_destroy (&actions);
+    if (error != 0) {
+      return std::nullopt;
+    }
+    return pid;
+  }
+#endif
+
+private:
+  std::string program_;
+  Args args_;
+  std::optional<Env> env_;
+  std::filesystem::path working_dir_;
+  bool change_dir_;
+#ifndef _WIN32
+  // Descriptor of `working_dir_`, shared by copies.
+  std::shared_ptr<const int> dir_fd_;
+#endif
+  Stdio stdout_;
+  Stdio stderr_;
+  Stdio stdin_;
+  std::size_t stdin_capacity_ = 0;
+  Buffer_Pool *pool_ = nullptr;
+  std::optional<std::chrono::milliseconds> timeout_;
+  std::chrono::milliseconds grace_ {0};
+#ifndef _WIN32
+  std::vector<std::pair<int, ::rlimit>> rlimits_;
+#endif
+  std::optional<int> nice_;
+  bool new_group_ = false;
+#ifdef SPELL_HAS_CPU_AFFINITY
+  std::optional<std::uint64_t> affinity_;
+#endif
+#ifdef __linux__
+  std::filesystem::path cgroup_;
+#endif
+  detail::Exec_Block exec_;
+#ifndef _WIN32
+  Spawn_Server *server_ = nullptr;
+  detail::Resolved_Program resolved_;
+  // PATH when the program was resolved.
+  std::string resolved_for_;
+#endif
+};
+
+namespace detail {
+/// A string literal that can be used as a template argument.
+template <std::size_t N>
+struct Command_String {
+  char chars[N] {};
+
+  consteval Command_String (const char (&s)[N]) {
+    std::copy_n (s, N, chars);
+  }
+};
+
+// Deliberately not constexpr: calling it while parsing a command line at
+// compile time makes the program ill-formed, with the reason in the
+// diagnostic.
+inline void invalid_command_line (const char *) {}
+
+// A command line tokenized at compile time. The unescaped literal text of all
+// tokens is stored in `text`, each token is a sequence of pieces that are
+// either a range of `text` or a placeholder.
+template <std::size_t N>
+struct Command_Line {
+  struct Piece {
+    // Offset into `text`, or the index of the placeholder.
+    std::size_t begin = 0;
+    std::size_t size = 0;
+    bool placeholder = false;
+  };
+
+  char text[N] {};
+  std::size_t text_size = 0;
+  Piece pieces[N] {};
+  std::size_t piece_count = 0;
+  // The pieces of token `i` are `pieces[tokens[i]]` to `pieces[tokens[i + 1]]`.
+  std::size_t tokens[N + 1] {};
+  std::size_t token_count = 0;
+  std::size_t placeholders = 0;
+};
+
+// Tokenizes like Spell::from_string, except that unterminated quotes and
+// trailing backslashes are rejected and `{}` outside of a backslash escape is
+// a placeholder.
+template <std::size_t N>
+consteval Command_Line<N> parse_command_line (const Command_String<N> &s) {
+  Command_Line<N> line;
+  const std::size_t size = N - 1;
+  auto literal = [&line] (char c) {
+    if (line.piece_count == line.tokens[line.token_count]
+        || line.pieces[line.piece_count - 1].placeholder) {
+      line.pieces[line.piece_count++] = {line.text_size, 0, false};
+    }
+    line.text[line.text_size++] = c;
+    ++line.pieces[line.piece_count - 1].size;
+  };
+  std::size_t i = 0;
+  for (;;) {
+    while (i < size && s.chars[i] == ' ') {
+      ++i;
+    }
+    if (i == size) {
+      break;
+    }
+    line.tokens[line.token_count] = line.piece_count;
+    char in_string = '\0';
+    for (; i < size && (in_string != '\0' || s.chars[i] != ' '); ++i) {
+      const char c = s.chars[i];
+      if (c == '\\') {
+        if (++i == size) {
+          invalid_command_line ("trailing backslash");
+        }
+        literal (s.chars[i]);
+      }
+      else if (c == '\'' || c == '"') {
+        if (in_string == '\0') {
+          in_string = c;
+        }
+        else if (c == in_string) {
+          in_string = '\0';
+        }
+        else {
+          literal (c);
+        }
+      }
+      else if (c == '{' && i + 1 < size && s.chars[i + 1] == '}') {
+        line.pieces[line.piece_count++] = {line.placeholders++, 0, true};
+        ++i;
+      }
+      else {
+        literal (c);
+      }
+    }
+    if (in_string != '\0') {
+      invalid_command_line ("unterminated quote");
+    }
+    ++line.token_count;
+  }
+  line.tokens[line.token_count] = line.piece_count;
+  if (line.token_count == 0) {
+    invalid_command_line ("empty command line");
+  }
+  return line;
+}
+} // namespace detail
+
+/**
+ * @brief A command line that is parsed at compile time.
+ *
+ * `Command<"git rev-parse --verify {}">::spell ("HEAD")` is equivalent to
+ * `Spell::from_string ("git rev-parse --verify HEAD")`, but the command line
+ * is tokenized and validated during compilation and only the placeholders are
+ * substituted at run time. Quoting and escaping work like in
+ * @ref Spell::from_string, values substituted into placeholders are never
+ * split or unquoted. A placeholder can be part of a longer argument
+ * (`--file={}`) and `\{}` is a literal `{}`.
+ *
+ * Unterminated quotes, trailing backslashes and empty command lines fail to
+ * compile, as does passing the wrong number of values to @ref spell.
+ */
+template <detail::Command_String S>
+class Command {
+  static constexpr auto line_ = detail::parse_command_line (S);
+
+public:
+  /**
+   * @brief The number of `{}` placeholders in the command line.
+   */
+  static constexpr std::size_t placeholders = line_.placeholders;
+
+  /**
+   * @brief The number of arguments including the program.
+   */
+  static constexpr std::size_t size = line_.token_count;
+
+  /**
+   * @brief Creates a spell for the command with the placeholders replaced by
+   *        the given values, in order.
+   */
+  template <class... Values>
+    requires (sizeof... (Values) == placeholders
+              && (std::convertible_to<const Values&, std::string_view> && ...))
+  static Spell spell (const Values&... values) {
+    // The empty element keeps the array valid without placeholders.
+    const std::string_view substitutes[] = {std::string_view (values)..., {}};
+    auto spell = Spell (token (0, substitutes));
+    auto &args = spell.get_args ();
+    args.reserve (size - 1);
+    for (std::size_t i = 1; i < size; ++i) {
+      const auto begin = line_.tokens[i];
+      const auto &p = line_.pieces[begin];
+      if (line_.tokens[i + 1] - begin == 1 && !p.placeholder) {
+        // The text has static storage duration.
+        args.borrow (std::string_view (line_.text + p.begin, p.size));
+      }
+      else {
+        args.push_back (token (i, substitutes));
+      }
+    }
+    return spell;
+  }
+
+private:
+  static std::string token (std::size_t i, std::span<const std::string_view> substitutes) {
+    auto piece = [&] (const auto &p) {
+      return p.placeholder
+        ? substitutes[p.begin]
+        : std::string_view (line_.text + p.begin, p.size);
+    };
+    const auto begin = line_.tokens[i];
+    const auto end = line_.tokens[i + 1];
+    if (end - begin == 1) {
+      return std::string (piece (line_.pieces[begin]));
+    }
+    std::size_t length = 0;
+    for (auto p = begin; p != end; ++p) {
+      length += piece (line_.pieces[p]).size ();
+    }
+    std::string result;
+    result.reserve (length);
+    for (auto p = begin; p != end; ++p) {
+      result += piece (line_.pieces[p]);
+    }
+    return result;
+  }
+};
+
+/**
+ * @brief A chain of spells where the stdout of each stage is connected to the
+ *        stdin of the next one.
+ *
+ * Create one with `spell::Spell ("a") | spell::Spell ("b")`, more stages can
+ * be added with `|` or @ref pipe.
+ *
+ * The stages are connected with pipes that are handed directly to the child
+ * processes, data passing from one stage to the next never goes through the
+ * calling process. The stdin configuration of all but the first stage and the
+ * stdout configuration of all but the last stage are ignored.
+ */
+class Pipeline {
+public:
+  /**
+   * @brief Creates a pipeline with a single stage.
+   */
+  explicit Pipeline (Spell first)
+  : stages_ {}
+  {
+    stages_.push_back (std::move (first));
+  }
+
+  /**
+   * @brief Appends a stage to the pipeline.
    */
-  Spell& set_stderr (Stdio cfg) {
-    stderr_ = cfg;
+  Pipeline& pipe (Spell next) {
+    stages_.push_back (std::move (next));
     return *this;
   }
 
   /**
-   * @brief Configuration for the child process's standard input handle.
-   *
-   * Defaults to @ref Stdio::Inherit when used with @ref cast or @ref cast_status,
-   * and defaults to @ref Stdio::Piped when used with @ref cast_output.
-   *
-   * See @ref Stdio.
-   *
-   * @param cfg - new configuration or @ref Stdio::Default.
+   * @brief Returns a mutable reference to the stages.
    */
-  Spell& set_stdin (Stdio cfg) {
-    stdin_ = cfg;
-    return *this;
+  std::vector<Spell>& get_stages () {
+    return stages_;
   }
 
-  ////////////////////////////////////////////////////////////////////////
-  // Running
+  /**
+   * @brief Returns a constant reference to the stages.
+   */
+  const std::vector<Spell>& get_stages () const {
+    return stages_;
+  }
 
   /**
-   * @brief Executes the command as a child process, returning a handle to it.
+   * @brief Executes all stages, returning a handle to each of them.
    *
-   * By default, stdin, stdout and stderr are inherited from the parent.
+   * By default, the stdin of the first stage, the stdout of the last stage
+   * and stderr of all stages are inherited from the parent.
    *
-   * @return a @ref Child for the child process or std::nullopt if execution failed.
+   * @return a @ref Child for each stage or std::nullopt if execution of any
+   *         stage failed, in which case the already started stages are killed.
    */
-  std::optional<Child> cast () {
+  std::optional<std::vector<Child>> cast () {
     return do_cast (Stdio::Inherit);
   }
 
   /**
-   * @brief Executes the command as a child process, waiting for it to finish and collecting its status.
+   * @brief Executes all stages, waiting for them to finish and collecting
+   *        their statuses.
    *
-   * By default, stdin, stdout and stderr are inherited from the parent.
+   * By default, the stdin of the first stage, the stdout of the last stage
+   * and stderr of all stages are inherited from the parent.
    *
-   * @return the @ref Exit_Status of the child process or std::nullopt if execution failed.
+   * @return the @ref Exit_Status of each stage or std::nullopt if execution
+   *         failed.
    */
-  std::optional<Exit_Status> cast_status () {
-    auto child = do_cast (Stdio::Inherit);
-    if (child.has_value ())
-      return child->wait ();
-    return std::nullopt;
+  std::optional<std::vector<Exit_Status>> cast_status () {
+    auto children = do_cast (Stdio::Inherit);
+    if (!children.has_value ()) {
+      return std::nullopt;
+    }
+    std::vector<Exit_Status> statuses;
+    statuses.reserve (children->size ());
+    for (auto &c : *children) {
+      statuses.push_back (c.wait ());
+    }
+    return statuses;
   }
 
   /**
-   * @brief Executes the command as a child process, waiting for it to finish and collecting all of its output.
+   * @brief Executes all stages, waiting for them to finish and collecting
+   *        their output.
    *
-   * By default stdout and stderr are captured and used to provide the resulting output.
-   * Stdin is captured and immediately closed.
+   * By default, the stdout of the last stage and the stderr of all stages are
+   * captured, the stdin of the first stage is captured and immediately closed.
+   * All pipes are read concurrently.
    *
-   * @return the @ref Output of the child process or std::nullopt if execution failed.
+   * @return the @ref Output of each stage or std::nullopt if execution failed.
+   *         Only the output of last stage contains stdout data.
    */
-  std::optional<Output> cast_output () {
-    auto child = do_cast (Stdio::Piped);
-    if (child.has_value ()) {
-      return child->wait_with_output ();
+  std::optional<std::vector<Output>> cast_output () {
+    auto children = do_cast (Stdio::Piped);
+    if (!children.has_value ()) {
+      return std::nullopt;
     }
-    return std::nullopt;
+    const auto n = children->size ();
+    std::vector<std::vector<char>> errs (n);
+    std::vector<char> out;
+    std::vector<detail::Drain_Target> targets;
+    targets.reserve (n + 1);
+    for (std::size_t i = 0; i < n; ++i) {
+      auto &c = (*children)[i];
+      c.get_stdin ().drop ();
+      targets.push_back ({c.get_stderr (), errs[i]});
+    }
+    targets.push_back ({children->back ().get_stdout (), out});
+    detail::drain (targets);
+    std::vector<Output> outputs;
+    outputs.reserve (n);
+    for (std::size_t i = 0; i < n; ++i) {
+      auto &o = outputs.emplace_back ((*children)[i].wait ());
+      o.stderr_ = std::move (errs[i]);
+    }
+    outputs.back ().stdout_ = std::move (out);
+    for (std::size_t i = 0; i < n; ++i) {
+      Spell::collect_mapped ((*children)[i], outputs[i]);
+    }
+    return outputs;
   }
 
 private:
-  std::optional<Child> do_cast (Stdio default_cfg) {
-    using namespace detail;
-    Anonymous_Pipe::Pipes out, err, in;
-
-    auto set_pipe = [default_cfg](Anonymous_Pipe::Pipes &p, Stdio &cfg, auto s) {
-      if (cfg == Stdio::Default) {
-        cfg = default_cfg;
+  std::optional<std::vector<Child>> do_cast (Stdio default_cfg) {
+    std::vector<Child> children;
+    children.reserve (stages_.size ());
+    Anonymous_Pipe next_stdin;
+    for (std::size_t i = 0; i < stages_.size (); ++i) {
+      const bool first = i == 0;
+      const bool last = i + 1 == stages_.size ();
+      Anonymous_Pipe this_stdin = std::move (next_stdin);
+      Anonymous_Pipe this_stdout;
+      if (!last) {
+        auto p = Anonymous_Pipe::create ();
+        if (p.read.handle () == INVALID_PIPE) {
+          kill_all (children);
+          return std::nullopt;
+        }
+      #ifdef _WIN32
+        // The next stage's end must not be inherited by this stage.
+        SetHandleInformation (p.read.handle (), HANDLE_FLAG_INHERIT, 0);
+      #endif
+        next_stdin = std::move (p.read);
+        this_stdout = std::move (p.write);
+      }
+    #ifdef _WIN32
+      if (!first) {
+        SetHandleInformation (this_stdin.handle (), HANDLE_FLAG_INHERIT, HANDLE_FLAG_INHERIT);
       }
-      switch (cfg) {
-      break; case Stdio::Inherit: {
-        p = Anonymous_Pipe::create_inherit (s);
+    #endif
+      auto child = stages_[i].do_cast (
+        default_cfg,
+        first ? nullptr : &this_stdin,
+        last ? nullptr : &this_stdout
+      );
+      if (!child.has_value ()) {
+        kill_all (children);
+        return std::nullopt;
       }
-      break; case Stdio::Piped: {
-        p = Anonymous_Pipe::create ();
+      children.push_back (std::move (child.value ()));
+    }
+    return children;
+  }
+
+  static void kill_all (std::vector<Child> &children) {
+    for (auto &c : children) {
+      c.kill ();
+      c.wait ();
+    }
+  }
+
+  std::vector<Spell> stages_;
+};
+
+/**
+ * @brief Creates a pipeline connecting the stdout of `lhs` to the stdin of `rhs`.
+ */
+inline Pipeline operator| (Spell lhs, Spell rhs) {
+  Pipeline p {std::move (lhs)};
+  p.pipe (std::move (rhs));
+  return p;
+}
+
+/**
+ * @brief Appends `rhs` to the pipeline.
+ */
+inline Pipeline operator| (Pipeline lhs, Spell rhs) {
+  lhs.pipe (std::move (rhs));
+  return lhs;
+}
+
+#ifdef SPELL_HAS_REACTOR
+/**
+ * @brief Casts all spells with at most `max_jobs` of them running at once,
+ *        collecting their output like @ref Spell::cast_output.
+ *
+ * A new spell is cast as soon as a running one has exited, which is noticed
+ * through the event queue of a @ref Reactor rather than by polling. All
+ * children are handled by the calling thread so a slow child only occupies
+ * its own slot.
+ *
+ * @param spells - the spells to cast, in the order they are started.
+ * @param max_jobs - the maximum number of running children, or 0 for no
+ *                   limit.
+ * @param on_done - called in order of completion with the position of a
+ *                  spell and its output.
+ */
+inline void run_parallel (
+  std::span<Spell> spells, std::size_t max_jobs, const Batch_Callback &on_done
+) {
+  if (max_jobs == 0) {
+    max_jobs = spells.size ();
+  }
+  Reactor reactor;
+  if (!reactor.valid ()) {
+    for (std::size_t i = 0; i < spells.size (); ++i) {
+      on_done (i, spells[i].cast_output ());
+    }
+    return;
+  }
+  struct Job {
+    std::vector<char> out;
+    std::vector<char> err;
+  };
+  std::vector<Job> jobs (spells.size ());
+  std::size_t next = 0;
+  std::size_t running = 0;
+  // Casts spells until `max_jobs` children are running, exit callbacks call
+  // this again to refill their slot.
+  std::function<void ()> fill = [&] () {
+    while (next < spells.size () && running < max_jobs) {
+      const auto index = next++;
+      auto child = spells[index].do_cast (Stdio::Piped);
+      if (!child.has_value ()) {
+        on_done (index, std::nullopt);
+        continue;
       }
-      break; case Stdio::Null: {
-        p = Anonymous_Pipe::create_null ();
+      if (auto *pool = spells[index].pool_) {
+        jobs[index].out = pool->acquire ();
+        jobs[index].err = pool->acquire ();
       }
-      break; case Stdio::Default:;
+      auto on_output = [&jobs, index] (Child &, Reactor::Stream stream, std::span<const char> data) {
+        auto &buf = stream == Reactor::Stream::Stdout ? jobs[index].out : jobs[index].err;
+        buf.insert (buf.end (), data.begin (), data.end ());
+      };
+      auto on_exit = [&, index] (Child &child, Exit_Status status) {
+        Output o {std::move (status)};
+        o.stdout_ = std::move (jobs[index].out);
+        o.stderr_ = std::move (jobs[index].err);
+        Spell::collect_mapped (child, o);
+        --running;
+        on_done (index, std::move (o));
+        fill ();
+      };
+      if (reactor.add (std::move (*child), std::move (on_exit), std::move (on_output)) == nullptr) {
+        on_done (index, std::nullopt);
+        continue;
       }
-    };
+      ++running;
+    }
+  };
+  fill ();
+  reactor.run ();
+}
 
-  #ifdef _WIN32
-    set_pipe (out, stdout_, STD_OUTPUT_HANDLE);
-    set_pipe (err, stderr_, STD_ERROR_HANDLE);
-    set_pipe (in, stdin_, STD_INPUT_HANDLE);
+/**
+ * @brief Casts all spells with at most `max_jobs` of them running at once,
+ *        collecting their output like @ref Spell::cast_output.
+ *
+ * See @ref run_parallel(std::span<Spell>, std::size_t, const Batch_Callback &).
+ *
+ * @return the outputs in the order of the spells, `std::nullopt` for spells
+ *         that could not be cast.
+ */
+inline std::vector<std::optional<Output>> run_parallel (
+  std::span<Spell> spells, std::size_t max_jobs
+) {
+  std::vector<std::optional<Output>> outputs (spells.size ());
+  run_parallel (spells, max_jobs, [&outputs] (std::size_t i, std::optional<Output> &&o) {
+    outputs[i] = std::move (o);
+  });
+  return outputs;
+}
+#endif
 
-    PROCESS_INFORMATION process_info {};
-    ZeroMemory (&process_info, sizeof (PROCESS_INFORMATION));
+/**
+ * @brief How messages are delimited on the streams of a @ref Worker_Pool.
+ */
+enum class Framing {
+  /// Each message is terminated by a newline, which is not part of it.
+  Line,
+  /// Each message is preceded by its length as a 32-bit big-endian integer.
+  Length_Prefixed,
+};
+
+#ifndef _WIN32
+namespace detail {
 
-    STARTUPINFO startup_info = {};
-    ZeroMemory (&startup_info, sizeof (STARTUPINFO));
-    startup_info.cb = sizeof (STARTUPINFO);
-    startup_info.hStdOutput = out.write.handle ();
-    startup_info.hStdError = err.write.handle ();
-    startup_info.hStdInput = in.read.handle ();
-    startup_info.dwFlags |= STARTF_USESTDHANDLES;
+// Blocks SIGPIPE for the calling thread while it exists, so writing to a
+// pipe whose reader has exited fails with EPIPE instead of terminating the
+// process. A SIGPIPE raised in the meantime is discarded.
+class Sigpipe_Guard {
+public:
+  Sigpipe_Guard () {
+    sigemptyset (&pipe_);
+    sigaddset (&pipe_, SIGPIPE);
+    sigset_t pending;
+    sigpending (&pending);
+    was_pending_ = sigismember (&pending, SIGPIPE);
+    pthread_sigmask (SIG_BLOCK, &pipe_, &old_);
+  }
 
-    // Arguments
-    std::string command_line {program_};
-    for (auto &arg : args_) {
-      command_line.push_back (' ');
-      command_line.append (arg);
+  Sigpipe_Guard (const Sigpipe_Guard &) = delete;
+  Sigpipe_Guard& operator= (const Sigpipe_Guard &) = delete;
+
+  ~Sigpipe_Guard () {
+    const int saved_errno = errno;
+    sigset_t pending;
+    sigpending (&pending);
+    if (!was_pending_ && sigismember (&pending, SIGPIPE)) {
+      // Does not block as the signal is pending.
+      int signal;
+      sigwait (&pipe_, &signal);
     }
+    pthread_sigmask (SIG_SETMASK, &old_, nullptr);
+    errno = saved_errno;
+  }
 
-    // Environment
-    std::string environment {};
-    if (env_.has_value ()) {
-      // Could iterate over the environment to determine the size here
-      // but instead we just reserve the amount if each key and value
-      // were 1 byte long.
-      environment.reserve(env_->data_.size() * 4);
-      for (const auto &env : *env_) {
-        environment.append (env.unwrap ());
-        environment.push_back ('\0');
-      }
+private:
+  sigset_t pipe_;
+  sigset_t old_;
+  bool was_pending_;
+};
+
+} // namespace detail
+#endif
+
+/**
+ * @brief A pool of long-lived children that answer requests sent to their
+ *        stdin on their stdout.
+ *
+ * Each worker is launched from a copy of the given spell with piped stdin
+ * and stdout, and handles one request at a time: the pool writes a
+ * message and reads one message back, delimited as given by @ref Framing.
+ * For programs that are expensive to start this turns each request into a
+ * round trip through a pipe instead of launching a process.
+ *
+ * Workers that exited or failed to answer are relaunched for the next
+ * request, as are workers that answered the configured number of
+ * requests. Writing to an exited worker does not raise SIGPIPE.
+ *
+ * @ref request may be called from multiple threads, it waits for a worker
+ * to become idle if all of them are busy.
+ */
+class Worker_Pool {
+public:
+  /**
+   * @brief Launches the workers.
+   *
+   * Use @ref valid to check whether all of them could be launched.
+   *
+   * @param spell - the spell to launch workers from, its stdin and stdout
+   *                are replaced with pipes.
+   * @param workers - the number of workers.
+   * @param framing - how requests and responses are delimited.
+   * @param max_requests - the number of requests after which a worker is
+   *                       relaunched, or 0 to keep it for as long as it
+   *                       runs.
+   */
+  Worker_Pool (Spell spell, std::size_t workers, Framing framing = Framing::Line, std::size_t max_requests = 0)
+  : spell_ (std::move (spell)),
+    framing_ (framing),
+    max_requests_ (max_requests),
+    workers_ (workers),
+    valid_ (workers != 0)
+  {
+    spell_.set_stdin (Stdio::Piped).set_stdout (Stdio::Piped);
+    idle_.reserve (workers);
+    for (std::size_t i = workers; i-- > 0;) {
+      valid_ = start (workers_[i]) && valid_;
+      idle_.push_back (i);
     }
+  }
 
-    // Don't inherit parent ends of pipes
-    SetHandleInformation (in.write.handle (), HANDLE_FLAG_INHERIT, 0);
-    SetHandleInformation (out.read.handle (), HANDLE_FLAG_INHERIT, 0);
-    SetHandleInformation (err.read.handle (), HANDLE_FLAG_INHERIT, 0);
+  Worker_Pool (const Worker_Pool &) = delete;
+  Worker_Pool& operator= (const Worker_Pool &) = delete;
 
-    if (!CreateProcessA (
-      nullptr,
-      command_line.data (),
-      nullptr,
-      nullptr,
-      true,
-      0,
-      env_.has_value () ? reinterpret_cast<void *> (environment.data ()) : nullptr,
-      nullptr,
-      &startup_info,
-      &process_info
-    )) {
-      return std::nullopt;
+  /**
+   * @brief Closes the stdin of all workers and waits for them to exit.
+   *
+   * Workers that do not exit within a second of their stdin being closed
+   * are killed. There must be no requests in progress.
+   */
+  ~Worker_Pool () {
+    for (auto &w : workers_) {
+      stop (w, true);
     }
+  }
 
-    CloseHandle (process_info.hThread);
+  /**
+   * @brief Whether all workers were launched successfully.
+   */
+  bool valid () const {
+    return valid_;
+  }
 
-    in.read.drop ();
-    out.write.drop ();
-    err.write.drop ();
+  /**
+   * @brief Returns the number of workers.
+   */
+  std::size_t size () const {
+    return workers_.size ();
+  }
 
-    return Child (
-      process_info.hProcess,
-      std::move (in.write),
-      std::move (out.read),
-      std::move (err.read)
-    );
+  /**
+   * @brief Sends a request to an idle worker and returns its response.
+   *
+   * With @ref Framing::Line the message must not contain a newline.
+   *
+   * @param message - the request.
+   * @return the response or `std::nullopt` if no worker could be launched
+   *         or the worker exited before it answered.
+   */
+  std::optional<std::string> request (std::string_view message) {
+    std::size_t index;
+    {
+      std::unique_lock lock {mutex_};
+      idle_changed_.wait (lock, [this] () { return !idle_.empty (); });
+      index = idle_.back ();
+      idle_.pop_back ();
+    }
+    auto &w = workers_[index];
+    auto response = exchange (w, message);
+    if (!response.has_value ()) {
+      stop (w, false);
+    }
+    else if (max_requests_ != 0 && ++w.served >= max_requests_) {
+      stop (w, true);
+    }
+    {
+      std::lock_guard lock {mutex_};
+      idle_.push_back (index);
+    }
+    idle_changed_.notify_one ();
+    return response;
+  }
 
-  #else
+private:
+  struct Worker {
+    std::optional<Child> child;
+    // Data read after the last response.
+    std::string pending;
+    std::size_t served = 0;
+  };
 
-    set_pipe (out, stdout_, stdout);
-    set_pipe (err, stderr_, stderr);
-    set_pipe (in, stdin_, stdin);
+  bool start (Worker &w) {
+    std::lock_guard lock {spell_mutex_};
+    w.child = spell_.cast ();
+    w.pending.clear ();
+    w.served = 0;
+    return w.child.has_value ();
+  }
 
-    auto [input, output] = Anonymous_Pipe::create ();
+  // Lets the worker exit by closing its stdin if `graceful`, otherwise
+  // kills it, and reaps it.
+  void stop (Worker &w, bool graceful) {
+    if (!w.child.has_value ()) {
+      return;
+    }
+    w.child->get_stdin ().drop ();
+    if (!graceful || !w.child->wait_for (std::chrono::seconds (1)).has_value ()) {
+      w.child->kill ();
+    }
+    w.child->wait ();
+    w.child.reset ();
+  }
 
-    const pid_t pid = fork ();
-    if (pid == 0) {
-      input.drop ();
-      // Duplicate and close pipes
-      dup2 (out.write.handle (), STDOUT_FILENO);
-      out.drop ();
-      dup2 (err.write.handle (), STDERR_FILENO);
-      err.drop ();
-      dup2 (in.read.handle (), STDIN_FILENO);
-      in.drop ();
-      // Arguments
-      std::vector<char *> p_args;
-      p_args.reserve(args_.size() + 1);
-      p_args.push_back (program_.data ());
-      std::transform (args_.begin (), args_.end (), std::back_inserter (p_args),
-        [] (std::string &a) -> char * {
-          return a.data ();
-        }
-      );
-      p_args.push_back (NULL);
-      // Environment
-      if (env_.has_value ()) {
-        std::vector<char *> p_envs;
-        p_envs.reserve(env_->data_.size());
-        std::transform (env_->begin (), env_->end (), std::back_inserter (p_envs),
-          [] (const Env_Var &v) -> char * {
-            return const_cast<char *> (v.unwrap ().data ());
-          }
-        );
-        p_envs.push_back (NULL);
-        execvpe (program_.c_str (), p_args.data (), p_envs.data ());
+  std::optional<std::string> exchange (Worker &w, std::string_view message) {
+    if (!w.child.has_value () || w.child->try_wait ().has_value ()) {
+      stop (w, false);
+      if (!start (w)) {
+        return std::nullopt;
+      }
+    }
+    {
+    #ifndef _WIN32
+      const detail::Sigpipe_Guard guard;
+    #endif
+      bool written;
+      if (framing_ == Framing::Line) {
+        const std::string_view parts[] = {message, "\n"};
+        written = w.child->get_stdin ().write_all (parts);
       }
       else {
-        execvp (program_.c_str (), p_args.data ());
+        const auto size = static_cast<std::uint32_t> (message.size ());
+        const char header[4] = {
+          static_cast<char> (size >> 24), static_cast<char> (size >> 16),
+          static_cast<char> (size >> 8), static_cast<char> (size)
+        };
+        const std::string_view parts[] = {{header, 4}, message};
+        written = w.child->get_stdin ().write_all (parts);
+      }
+      if (!written) {
+        return std::nullopt;
       }
-      const std::int32_t error = errno;
-      assert (output.write (&error, 4));
-      output.drop();
-      // Need to manually run the destructors we want.
-      p_args.~vector();
-      this->~Spell();
-      _exit (127);
     }
+    return framing_ == Framing::Line ? read_line (w) : read_prefixed (w);
+  }
 
-    output.drop ();
-
-    in.read.drop ();
-    out.write.drop ();
-    err.write.drop ();
-
-    if (std::int32_t error = 0; input.read (&error, 4).value () == 4) {
-      input.drop ();
-    #if 0
-      std::fprintf (stderr, "%s: %s\n", program_.c_str (), std::strerror (error));
+  // Reads more of the stdout of the worker into its pending data. Returns
+  // false at EOF.
+  bool fill (Worker &w) {
+    constexpr std::size_t CHUNK = 4096;
+    const auto size = w.pending.size ();
+    w.pending.resize (size + CHUNK);
+    for (;;) {
+      const auto r = w.child->get_stdout ().read (w.pending.data () + size, CHUNK);
+    #ifndef _WIN32
+      if (!r.has_value () && errno == EINTR) {
+        continue;
+      }
     #endif
-      in.write.drop ();
-      out.read.drop ();
-      err.read.drop ();
-      return std::nullopt;
+      w.pending.resize (size + r.value_or (0));
+      return r.value_or (0) != 0;
     }
-    input.drop ();
+  }
 
-    return Child (
-      pid,
-      std::move (in.write),
-      std::move (out.read),
-      std::move (err.read)
-    );
-  #endif
+  std::optional<std::string> read_line (Worker &w) {
+    std::size_t searched = 0;
+    for (;;) {
+      if (const auto end = w.pending.find ('\n', searched); end != std::string::npos) {
+        std::string response = w.pending.substr (0, end);
+        w.pending.erase (0, end + 1);
+        return response;
+      }
+      searched = w.pending.size ();
+      if (!fill (w)) {
+        return std::nullopt;
+      }
+    }
   }
 
-private:
-  std::string program_;
-  Args args_;
-  std::optional<Env> env_;
-  std::filesystem::path working_dir_;
-  Stdio stdout_;
-  Stdio stderr_;
-  Stdio stdin_;
+  std::optional<std::string> read_prefixed (Worker &w) {
+    while (w.pending.size () < 4) {
+      if (!fill (w)) {
+        return std::nullopt;
+      }
+    }
+    const auto *header = reinterpret_cast<const unsigned char *> (w.pending.data ());
+    const std::size_t size = std::size_t (header[0]) << 24 | std::size_t (header[1]) << 16
+                           | std::size_t (header[2]) << 8 | std::size_t (header[3]);
+    while (w.pending.size () < 4 + size) {
+      if (!fill (w)) {
+        return std::nullopt;
+      }
+    }
+    std::string response = w.pending.substr (4, size);
+    w.pending.erase (0, 4 + size);
+    return response;
+  }
+
+  Spell spell_;
+  std::mutex spell_mutex_;
+  Framing framing_;
+  std::size_t max_requests_;
+  std::vector<Worker> workers_;
+  bool valid_;
+  std::mutex mutex_;
+  std::condition_variable idle_changed_;
+  std::vector<std::size_t> idle_;
 };
 
 /**
@@ -1410,6 +7255,9 @@ inline void ignore_sigchld () {
  * the child and therefor this function will set all the streams to
  * `Stdio::Null` before spawning the process.
  *
+ * The process is always launched by a forked copy of the calling process, a
+ * spawn server set with `Spell::spawn_server` is not used.
+ *
  * Only the `id` and `kill` functions on the returned child will work.
  * Note that the `try_wait`, `wait`, and `wait_with_output` functions do not
  * check for errors and will pretend to return successfully with a bogus value.
@@ -1436,6 +7284,14 @@ std::optional<Child> orphan(Spell &spell) {
     if (pid == 0) {
         close(rx);
         setsid();
+        // The connection to the server is shared with the parent, and the
+        // child would belong to the server instead of being orphaned.
+        spell.spawn_server(nullptr);
+        // The reaper thread was not forked, and its launch lock may have
+        // been held when it was copied. Neither the spawn server nor the
+        // reaper keep the exit then, so the child copied to the parent has
+        // no claim on it.
+        Reaper::instance().enabled_ = false;
         const auto result = spell.cast();
         write(tx, reinterpret_cast<const void *>(&result), RESULT_SIZE);
         close(tx);
@@ -1452,6 +7308,127 @@ std::optional<Child> orphan(Spell &spell) {
 #endif
 }
 
+#ifndef _WIN32
+namespace detail {
+// Write end of the pipe the SIGCHLD handler of the spawn server wakes it
+// through.
+inline int spawn_server_wake = -1;
+} // namespace detail
+
+inline void Spawn_Server::serve (int socket) {
+  // The reaper thread was not forked, this process reaps its children itself.
+  Reaper::instance ().enabled_ = false;
+  // SIGPIPE is only blocked while replying, the children inherit the same
+  // disposition and mask as if they were launched by the client.
+  auto send = [socket] (const detail::Spawn_Reply &reply) {
+    const detail::Sigpipe_Guard guard;
+    detail::write_exact (socket, &reply, sizeof (reply));
+  };
+  int wake[2];
+  if (pipe2 (wake, O_CLOEXEC | O_NONBLOCK) < 0) {
+    _exit (1);
+  }
+  detail::spawn_server_wake = wake[1];
+  struct sigaction action {};
+  action.sa_handler = [] (int) {
+    const int saved = errno;
+    (void)!::write (detail::spawn_server_wake, "", 1);
+    errno = saved;
+  };
+  action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+  sigemptyset (&action.sa_mask);
+  sigaction (SIGCHLD, &action, nullptr);
+
+  std::vector<char> payload;
+  pollfd fds[] = {{socket, POLLIN, 0}, {wake[0], POLLIN, 0}};
+  for (;;) {
+    if (poll (fds, 2, -1) < 0) {
+      continue;
+    }
+    if (fds[1].revents) {
+      char buf[64];
+      while (::read (wake[0], buf, sizeof (buf)) > 0) {}
+      int status;
+      pid_t pid;
+      rusage usage;
+      while ((pid = wait4 (-1, &status, WNOHANG, &usage)) > 0) {
+        send ({pid, status, 1, 0, detail::to_resource_usage (usage)});
+      }
+    }
+    if (!fds[0].revents) {
+      continue;
+    }
+
+    detail::Spawn_Request request;
+    iovec iov {&request, sizeof (request)};
+    alignas (cmsghdr) char control[CMSG_SPACE (3 * sizeof (int))];
+    msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof (control);
+    ssize_t n;
+    while ((n = recvmsg (socket, &msg, MSG_WAITALL)) < 0 && errno == EINTR) {}
+    if (n != sizeof (request)) {
+      // The other end was closed.
+      _exit (0);
+    }
+    int handles[3] = {-1, -1, -1};
+    if (cmsghdr *cmsg = CMSG_FIRSTHDR (&msg);
+        cmsg != nullptr && cmsg->cmsg_type == SCM_RIGHTS
+        && cmsg->cmsg_len == CMSG_LEN (sizeof (handles))) {
+      std::memcpy (handles, CMSG_DATA (cmsg), sizeof (handles));
+    }
+    for (const int fd : handles) {
+      fcntl (fd, F_SETFD, FD_CLOEXEC);
+    }
+    payload.resize (request.size);
+    if (!detail::read_exact (socket, payload.data (), payload.size ())) {
+      _exit (0);
+    }
+
+    const char *str = payload.data ();
+    auto next = [&str] () {
+      const std::string_view s {str};
+      str += s.size () + 1;
+      return s;
+    };
+    Spell spell {next ()};
+    for (std::uint32_t i = 1; i < request.argc; ++i) {
+      spell.arg (next ());
+    }
+    if (request.envc >= 0) {
+      spell.env_clear ();
+      auto &env = spell.get_envs ();
+      for (std::int32_t i = 0; i < request.envc; ++i) {
+        const auto var = next ();
+        const auto eq = var.find ('=');
+        env.set (var.substr (0, eq), eq == var.npos ? std::string_view () : var.substr (eq + 1));
+      }
+    }
+    if (request.change_dir) {
+      spell.current_dir (next ());
+    }
+    if (request.new_group) {
+      spell.new_process_group ();
+    }
+    spell
+      .set_stdin (Stdio::from_handle (handles[0]))
+      .set_stdout (Stdio::from_handle (handles[1]))
+      .set_stderr (Stdio::from_handle (handles[2]));
+    const bool received = std::find (std::begin (handles), std::end (handles), -1)
+                          == std::end (handles);
+    const auto child = received ? spell.cast () : std::nullopt;
+    for (const int fd : handles) {
+      if (fd != -1) {
+        ::close (fd);
+      }
+    }
+    send ({child.has_value () ? child->id () : -1, 0, 0, request.sequence, {}});
+  }
+}
+#endif
+
 } // namespace spell
 
 /**
@@ -41,4 +41,43 @@ int main () {
       .value ()
       .wait ();
   }
+
+  std::cout << number++ << std::endl;
+  {
+    auto s = spell::Spell ("programs/print_args.exe")
+      .arg ("one");
+    s.prepare ();
+    s.cast ()->wait ();
+    s.get_args ()[0] = "two";
+    s.cast ()->wait ();
+    s.arg ("three");
+    s.cast ()->wait ();
+  }
+
+  std::cout << number++ << std::endl;
+  {
+    std::string borrowed = "borrowed";
+    auto s = spell::Spell ("programs/print_args.exe")
+      .borrow_arg (borrowed)
+      .arg ("copied");
+    auto &args = s.get_args ();
+    std::cout << (args[0].borrowed () ? "yes" : "no") << ' '
+              << (args[1].borrowed () ? "yes" : "no") << std::endl;
+    s.cast ()->wait ();
+    args[0][0] = 'B';
+    std::cout << borrowed << ' ' << (args[0].borrowed () ? "yes" : "no") << std::endl;
+    args[1] = "a longer replacement";
+    s.cast ()->wait ();
+  }
+
+  std::cout << number++ << std::endl;
+  {
+    auto s = spell::Spell ("programs/print_args.exe");
+    for (int i = 0; i < 40; ++i) {
+      s.arg (std::string (i % 7 + 1, static_cast<char> ('a' + i % 26)));
+    }
+    auto copy = s;
+    std::cout << s.get_args ().size () << ' ' << (copy.get_args () == s.get_args () ? "yes" : "no") << std::endl;
+    copy.cast ()->wait ();
+  }
 }
@@ -0,0 +1,48 @@
+#include <iostream>
+#include <string>
+#include "spell.hh"
+
+int main () {
+  std::cout << 1 << std::endl;
+  {
+    std::vector<spell::Spell> spells;
+    for (int i = 0; i < 10; ++i) {
+      spells.push_back (spell::Spell ("programs/echo.exe").arg (std::to_string (i)));
+    }
+    spells.push_back (spell::Spell ("programs/does_not_exist.exe"));
+    for (const auto &o : spell::run_parallel (spells, 3)) {
+      if (o.has_value ()) {
+        std::cout << o->collect_stdout<std::string> ();
+      }
+      else {
+        std::cout << "failed" << std::endl;
+      }
+    }
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    std::vector<spell::Spell> spells;
+    for (int i = 0; i < 20; ++i) {
+      spells.push_back (spell::Spell ("programs/print_bytes.exe").arg (std::to_string (i * 10000)));
+    }
+    std::size_t calls = 0, bytes = 0;
+    bool ok = true;
+    spell::run_parallel (spells, 4, [&] (std::size_t i, std::optional<spell::Output> &&o) {
+      ++calls;
+      bytes += o->stdout_.size () + o->stderr_.size ();
+      ok &= o->stdout_.size () == i * 10000 && o->status.success ();
+    });
+    std::cout << calls << ' ' << bytes << ' ' << (ok ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    std::vector<spell::Spell> spells (5, spell::Spell ("programs/return_number_of_args.exe").arg ("a"));
+    int sum = 0;
+    for (const auto &o : spell::run_parallel (spells, 0)) {
+      sum += o->status.code ();
+    }
+    std::cout << sum << std::endl;
+  }
+}
@@ -0,0 +1,37 @@
+#include <iostream>
+#include <string>
+#include "spell.hh"
+
+using Print_Args = spell::Command<"programs/print_args.exe plain 'single quoted' \"double quoted\" escaped\\ space">;
+using Placeholders = spell::Command<"programs/print_args.exe {} --file={}.txt '{} {}' \\{}">;
+using Program = spell::Command<"{} first">;
+
+static_assert (Print_Args::placeholders == 0 && Print_Args::size == 5);
+static_assert (Placeholders::placeholders == 4 && Placeholders::size == 5);
+
+int main () {
+  std::cout << 1 << std::endl;
+  std::cout << Print_Args::spell ().cast_output ().value ().collect_stdout<std::string> ();
+
+  std::cout << 2 << std::endl;
+  {
+    const std::string name = "name with spaces";
+    std::cout << Placeholders::spell ("'quoted'", name, "a", "b")
+      .cast_output ()
+        .value ()
+      .collect_stdout<std::string> ();
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    const auto spell = Program::spell ("programs/print_args.exe");
+    std::cout << spell.get_program () << ' ' << spell.get_args ().size () << std::endl;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    const auto a = Print_Args::spell ();
+    const auto b = spell::Spell::from_string ("programs/print_args.exe plain 'single quoted' \"double quoted\" escaped\\ space");
+    std::cout << (a.get_program () == b.get_program () && a.get_args () == b.get_args () ? "yes" : "no") << std::endl;
+  }
+}
@@ -0,0 +1,79 @@
+#include <iostream>
+#include "spell.hh"
+
+#ifdef SPELL_HAS_REACTOR
+spell::Task<std::string> hello (spell::Reactor &reactor) {
+  auto output = co_await spell::Spell ("programs/hello_world.exe")
+    .async_cast_output (reactor);
+  co_return output->collect_stdout<std::string> ();
+}
+
+spell::Task<int> status (spell::Reactor &reactor, int args) {
+  auto spell = spell::Spell ("programs/return_number_of_args.exe");
+  for (int i = 0; i < args; ++i) {
+    spell.arg ("x");
+  }
+  auto child = spell.cast ().value ();
+  const auto s = co_await child.async_wait (reactor);
+  co_return s.code ();
+}
+
+spell::Task<> sum (spell::Reactor &reactor, int &out) {
+  out = co_await status (reactor, 2) + co_await status (reactor, 3);
+}
+
+spell::Task<std::string> echo (spell::Reactor &reactor) {
+  auto child = spell::Spell ("programs/echo_stdin_char.exe")
+    .set_stdin (spell::Stdio::Piped)
+    .set_stdout (spell::Stdio::Piped)
+    .cast ()
+      .value ();
+  child.get_stdin ().write ("B", 1);
+  char buf[16];
+  const auto n = co_await child.get_stdout ().async_read (reactor, buf, sizeof (buf));
+  child.wait ();
+  co_return std::string (buf, n.value_or (0));
+}
+#endif
+
+int main () {
+#ifdef SPELL_HAS_REACTOR
+  spell::Reactor reactor;
+
+  std::cout << 1 << std::endl;
+  std::cout << reactor.block_on (hello (reactor));
+
+  std::cout << 2 << std::endl;
+  {
+    int a = -1, b = -1;
+    reactor.spawn (sum (reactor, a));
+    reactor.spawn (sum (reactor, b));
+    reactor.run ();
+    std::cout << a << ' ' << b << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  std::cout << reactor.block_on (echo (reactor));
+
+  std::cout << 4 << std::endl;
+  {
+    // An awaiter destroyed while suspended, as in a destroyed coroutine,
+    // leaves nothing registered.
+    auto child = spell::Spell ("programs/echo_stdin_char.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::Piped)
+      .cast ()
+        .value ();
+    char buf[16];
+    {
+      auto read = child.get_stdout ().async_read (reactor, buf, sizeof (buf));
+      read.await_suspend (std::noop_coroutine ());
+    }
+    child.get_stdin ().write ("D", 1);
+    std::cout << reactor.run_once (100) << ' ';
+    const auto n = child.get_stdout ().read (buf, sizeof (buf));
+    child.wait ();
+    std::cout << std::string (buf, n.value_or (0));
+  }
+#endif
+}
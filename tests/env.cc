@@ -70,4 +70,40 @@ int main () {
     const auto const_exists = (const_env.get(path).empty() ? "no" : "yes");
     std::cout << mut_exists << ' ' << const_exists << std::endl;
   }
+
+  std::cout << 7 << std::endl;
+  {
+    auto s = spell::Spell ("programs/print_env.exe")
+      .arg ("foo")
+      .env ("foo", "one");
+    s.cast ()->wait ();
+    auto &env = s.get_envs ();
+    s.cast ()->wait ();
+    env.set ("foo", "two");
+    s.cast ()->wait ();
+    s.env_remove ("foo");
+    s.cast ()->wait ();
+  }
+
+  std::cout << 8 << std::endl;
+  {
+  #ifdef _WIN32
+    const char *path = "Path";
+  #else
+    const char *path = "PATH";
+  #endif
+    // `foo` is still set in our own environment from part 3.
+    auto s = spell::Spell ("programs/print_env.exe")
+      .args ({"foo", "baz", "qux"})
+      .env_remove ("foo")
+      .env ("baz", "1");
+    s.get_envs ().rename ("baz", "qux");
+    s.cast ()->wait ();
+    std::cout << spell::Spell ("").get_envs ()["foo"] << std::endl;
+    bool has_path = false;
+    for (const auto &var : s.get_envs ()) {
+      has_path |= var.key () == path;
+    }
+    std::cout << (has_path ? "yes" : "no") << std::endl;
+  }
 }
@@ -1,3 +1,4 @@
+#include <chrono>
 #include <iostream>
 #include "spell.hh"
 
@@ -24,4 +25,34 @@ int main () {
         .value ();
     std::cout << (s.success () ? "yes" : "no") << ' ' << s.code () << std::endl;
   }
+
+  {
+    const spell::Exit_Status s (0);
+    std::cout << (s.resource_usage ().has_value () ? "yes" : "no") << std::endl;
+  }
+
+  {
+    auto o = spell::Spell ("programs/print_bytes.exe")
+      .arg ("1000000")
+      .cast_output ()
+        .value ();
+    const auto &usage = o.status.resource_usage ();
+    const auto &t = o.status.timings ();
+    std::cout << (usage.has_value () && usage->max_rss > 0 ? "yes" : "no") << ' '
+              << (t.first_output.has_value ()
+                  && t.spawn_start <= t.exec && t.exec <= *t.first_output && *t.first_output <= t.exit
+                  ? "yes" : "no")
+              << std::endl;
+  }
+
+  {
+    spell::Spell spell ("programs/sleep.exe");
+    spell.arg ("50").set_stdout (spell::Stdio::Null);
+    auto s = spell.cast_status ().value ();
+    const auto &t = s.timings ();
+    std::cout << (s.resource_usage ().has_value () ? "yes" : "no") << ' '
+              << (t.wall_time () >= std::chrono::milliseconds (50) ? "yes" : "no") << ' '
+              << (t.first_output.has_value () ? "yes" : "no")
+              << std::endl;
+  }
 }
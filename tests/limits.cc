@@ -0,0 +1,66 @@
+#include <cstdio>
+#include <filesystem>
+#include <iostream>
+#include <string>
+#include "spell.hh"
+
+int main () {
+#ifndef _WIN32
+  std::cout << 1 << std::endl;
+  {
+    const auto path = std::filesystem::temp_directory_path () / "spell_limits_test";
+    // Writing past the file size limit raises SIGXFSZ.
+    auto s = spell::Spell ("programs/print_bytes.exe")
+      .arg ("1000")
+      .rlimit (RLIMIT_FSIZE, 100, RLIM_INFINITY)
+      .set_stdout (spell::Stdio::File (path))
+      .set_stderr (spell::Stdio::Null)
+      .cast_status ()
+        .value ();
+    std::cout << (s.signal () == SIGXFSZ ? "yes" : "no") << ' ' << std::filesystem::file_size (path) << std::endl;
+    std::filesystem::remove (path);
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    auto o = spell::Spell ("programs/print_sched.exe")
+      .nice (7)
+      .cast_output ()
+        .value ();
+    std::cout << o.collect_stdout<std::string> ().substr (0, 2) << std::endl;
+  }
+#endif
+
+#ifdef __linux__
+  std::cout << 3 << std::endl;
+  {
+    auto o = spell::Spell ("programs/print_sched.exe")
+      .cpu_affinity (1)
+      .cast_output ()
+        .value ();
+    std::cout << o.collect_stdout<std::string> ().substr (2);
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    auto s = spell::Spell ("programs/hello_world.exe")
+      .cgroup ("/nonexistent/cgroup")
+      .cast ();
+    std::cout << (s.has_value () ? "yes" : "no") << std::endl;
+  }
+
+  // Launching fails if the child may only run on a CPU that does not exist,
+  // which needs one that fits in the mask.
+  const long cpus = sysconf (_SC_NPROCESSORS_CONF);
+  if (cpus > 0 && cpus < 64) {
+    std::cout << 5 << std::endl;
+    auto none = spell::Spell ("programs/print_sched.exe")
+      .cpu_affinity (std::uint64_t (1) << cpus)
+      .cast ();
+    std::cout << (none.has_value () ? "yes" : "no") << std::endl;
+  }
+  else {
+    std::cout << "5 skipped" << std::endl;
+  }
+#endif
+}
@@ -0,0 +1,62 @@
+#include <iostream>
+#include <string>
+#include <thread>
+#include "spell.hh"
+
+int main () {
+  std::cout << 1 << std::endl;
+  {
+    auto o = spell::Spell ("programs/print_env.exe")
+      .args ("ONE", "TWO", "THREE")
+      .env_clear ()
+      .env ("TWO", "2")
+      .cast_output ()
+        .value ();
+    for (const auto line : spell::Line_Reader (o)) {
+      std::cout << '[' << line << ']';
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    const std::string data {"a\0bb\0\0c", 7};
+    spell::Line_Reader reader (data, '\0');
+    while (const auto record = reader.next ()) {
+      std::cout << '[' << *record << ']';
+    }
+    std::cout << ' ' << (reader.next ().has_value () ? "yes" : "no") << std::endl;
+    std::cout << (spell::Line_Reader (std::string_view ()).next ().has_value () ? "yes" : "no") << ' '
+              << (spell::Line_Reader (std::string_view ("\n")).next ().value ().empty () ? "yes" : "no")
+              << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    // Lines of up to 200000 bytes spread over many reads.
+    auto child = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::Piped)
+      .cast ()
+        .value ();
+    constexpr int LINES = 300;
+    auto line = [] (int i) {
+      return std::string ((i * 7919) % 200000, static_cast<char> ('a' + i % 26));
+    };
+    std::thread writer ([&] () {
+      for (int i = 0; i < LINES; ++i) {
+        const auto l = line (i) + '\n';
+        child.get_stdin ().write_all (l.data (), l.size ());
+      }
+      child.get_stdin ().drop ();
+    });
+    int count = 0;
+    bool same = true;
+    for (const auto l : spell::Line_Reader (child.get_stdout ())) {
+      same = same && l == line (count);
+      ++count;
+    }
+    writer.join ();
+    std::cout << count << ' ' << (same ? "yes" : "no") << ' ' << child.wait ().code () << std::endl;
+  }
+}
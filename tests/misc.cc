@@ -38,5 +38,71 @@ int main () {
     spell::Spell::from_string ("programs/echo.exe H'ell'o World").cast ()->wait ();
     spell::Spell::from_string ("programs/echo.exe 안녕'하세'요").cast ()->wait ();
   }
-}
 
+  std::cout << 4 << std::endl;
+  {
+    spell::Spell ("./echo.exe")
+      .arg ("Hello from programs")
+      .current_dir ("programs")
+      .cast_status ();
+  }
+
+  std::cout << 5 << std::endl;
+  {
+    auto set_path = [] (const std::string &value) {
+    #ifdef _WIN32
+      _putenv_s ("PATH", value.c_str ());
+    #else
+      setenv ("PATH", value.c_str (), 1);
+    #endif
+    };
+  #ifdef _WIN32
+    // Found through SearchPath and CreateProcess.
+    constexpr char SEPARATOR = ';';
+  #else
+    constexpr char SEPARATOR = ':';
+  #endif
+    const auto programs = std::filesystem::absolute ("programs");
+    const std::string path = std::getenv ("PATH");
+    set_path (programs.string () + SEPARATOR + path);
+    auto s = spell::Spell ("echo.exe").arg ("Found in PATH");
+    std::cout << (s.resolve () == programs / "echo.exe" ? "yes" : "no") << std::endl;
+    s.cast_status ();
+    set_path (path);
+    std::cout << (s.resolve ().has_value () ? "yes" : "no") << std::endl;
+    std::cout << (s.cast ().has_value () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 6 << std::endl;
+  {
+    const auto cwd = std::filesystem::current_path ();
+    auto s = spell::Spell ("./echo.exe");
+    std::cout << (s.get_current_dir () == cwd ? "yes" : "no") << ' ';
+    s.current_dir ("programs").current_dir ("..");
+    std::cout << (s.get_current_dir () == std::filesystem::weakly_canonical (cwd) ? "yes" : "no") << std::endl;
+  }
+
+  // The directory is only opened on Unix platforms, Windows uses its path.
+#ifndef _WIN32
+  std::cout << 7 << std::endl;
+  {
+    // The child changes into the opened directory, even after it was moved.
+    char dir[] = "/tmp/spell-misc-XXXXXX";
+    if (mkdtemp (dir) != nullptr) {
+      const std::filesystem::path original = dir;
+      std::filesystem::copy_file ("programs/echo.exe", original / "echo.exe");
+      auto spawned = spell::Spell ("./echo.exe").arg ("Moved");
+      spawned.current_dir (original);
+      auto forked = spawned;
+      forked.nice (0);
+      const auto moved = original.string () + "-moved";
+      std::filesystem::rename (original, moved);
+      spawned.cast_status ();
+      forked.cast_status ();
+      std::filesystem::remove_all (moved);
+    }
+  }
+#else
+  std::cout << "7 skipped" << std::endl;
+#endif
+}
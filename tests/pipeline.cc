@@ -0,0 +1,48 @@
+#include <iostream>
+#include "spell.hh"
+
+int main () {
+  std::cout << 1 << std::endl;
+  {
+    auto statuses = (spell::Spell ("programs/echo.exe").arg ("Hello World")
+                     | spell::Spell ("programs/cat.exe")
+                     | spell::Spell ("programs/cat.exe"))
+      .cast_status ()
+        .value ();
+    for (const auto &s : statuses) {
+      std::cout << s.code () << ' ';
+    }
+    std::cout << std::endl;
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    auto outputs = (spell::Spell ("programs/print_bytes.exe").arg ("200000")
+                    | spell::Spell ("programs/cat.exe")
+                    | spell::Spell ("programs/cat.exe"))
+      .cast_output ()
+        .value ();
+    for (const auto &o : outputs) {
+      std::cout << o.status.code () << ' ' << o.stdout_.size () << ' ' << o.stderr_.size () << std::endl;
+    }
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    auto statuses = (spell::Spell ("programs/echo.exe")
+                     | spell::Spell ("programs/return_number_of_args.exe").args ("a", "b"))
+      .cast_status ()
+        .value ();
+    // The echo may be killed by SIGPIPE if the second stage exits first.
+    const bool echo_ok = statuses[0].code () == 0 || statuses[0].signal () != 0;
+    std::cout << echo_ok << ' ' << statuses[1].code () << std::endl;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    auto children = (spell::Spell ("programs/echo.exe")
+                     | spell::Spell ("i_do_not_exist"))
+      .cast ();
+    std::cout << (children.has_value () ? "yes" : "no") << std::endl;
+  }
+}
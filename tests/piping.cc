@@ -1,6 +1,20 @@
+#include <cstdio>
 #include <iostream>
 #include "spell.hh"
 
+static spell::Pipe_Handle handle_of (std::FILE *f) {
+#ifdef _WIN32
+  return reinterpret_cast<spell::Pipe_Handle> (_get_osfhandle (_fileno (f)));
+#else
+  return fileno (f);
+#endif
+}
+
+static long size_of (std::FILE *f) {
+  std::fseek (f, 0, SEEK_END);
+  return std::ftell (f);
+}
+
 int main () {
   std::cout << 1 << std::endl;
   {
@@ -74,4 +88,239 @@ int main () {
       std::cout << "write fail" << std::endl;
     }
   }
+
+  std::cout << 7 << std::endl;
+  {
+    // More output than fits into the pipe buffers.
+    auto c = spell::Spell ("programs/print_bytes.exe")
+      .arg ("1000000")
+      .cast_output ()
+        .value ();
+    std::cout << c.stdout_.size () << ' ' << c.stderr_.size () << std::endl;
+  }
+
+  std::cout << 8 << std::endl;
+  {
+    auto c = spell::Spell ("programs/print_bytes.exe")
+      .arg ("100000")
+      .set_stdout (spell::Stdio::Piped)
+      .set_stderr (spell::Stdio::Null)
+      .cast ()
+        .value ();
+    std::FILE *f = std::tmpfile ();
+    std::cout << c.get_stdout ().splice_to (handle_of (f)).value_or (0) << ' ';
+    std::cout << size_of (f) << std::endl;
+    std::fclose (f);
+    c.wait ();
+  }
+
+  std::cout << 9 << std::endl;
+  {
+    auto c = spell::Spell ("programs/print_bytes.exe")
+      .arg ("100000")
+      .set_stdout (spell::Stdio::Piped)
+      .set_stderr (spell::Stdio::Null)
+      .cast ()
+        .value ();
+    std::FILE *a = std::tmpfile ();
+    std::FILE *b = std::tmpfile ();
+    std::cout << c.get_stdout ().tee_to (handle_of (a), handle_of (b)).value_or (0) << ' ';
+    std::cout << size_of (a) << ' ' << size_of (b) << std::endl;
+    std::fclose (a);
+    std::fclose (b);
+    c.wait ();
+  }
+
+  std::cout << 10 << std::endl;
+  {
+    std::FILE *f = std::tmpfile ();
+    std::fputs ("Hello World", f);
+    std::fflush (f);
+    std::rewind (f);
+    auto c = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::Piped)
+      .cast ()
+        .value ();
+    std::cout << c.get_stdin ().copy_from_file (handle_of (f)).value_or (0) << std::endl;
+    std::fclose (f);
+    std::cout << c.wait_with_output ().collect_stdout<std::string> () << std::endl;
+  }
+
+  std::cout << 11 << std::endl;
+  {
+    const auto path = std::filesystem::temp_directory_path () / "spell_piping_test.txt";
+    spell::Spell ("programs/echo.exe")
+      .arg ("one")
+      .set_stdout (spell::Stdio::File (path))
+      .cast_status ();
+    spell::Spell ("programs/echo.exe")
+      .arg ("two")
+      .set_stdout (spell::Stdio::File (path, spell::File_Mode::Append))
+      .cast_status ();
+    auto o = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::File (path, spell::File_Mode::Read))
+      .cast_output ()
+        .value ();
+    std::cout << o.collect_stdout<std::string> ();
+    std::filesystem::remove (path);
+    auto s = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::File (path, spell::File_Mode::Read));
+    std::cout << (s.cast ().has_value () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 12 << std::endl;
+  {
+    std::FILE *f = std::tmpfile ();
+    spell::Spell ("programs/hello_world.exe")
+      .set_stdout (spell::Stdio::from_handle (handle_of (f)))
+      .cast_status ();
+    std::cout << size_of (f) << std::endl;
+    std::fclose (f);
+  }
+
+  std::cout << 13 << std::endl;
+  {
+    std::size_t out = 0, err = 0, largest = 0;
+    auto status = spell::Spell ("programs/print_bytes.exe")
+      .arg ("1000000")
+      .cast_streaming (
+        [&] (std::span<const char> chunk) {
+          out += chunk.size ();
+          largest = std::max (largest, chunk.size ());
+        },
+        [&] (std::span<const char> chunk) {
+          err += chunk.size ();
+          largest = std::max (largest, chunk.size ());
+        }
+      );
+    std::cout << status->code () << ' ' << out << ' ' << err << std::endl;
+    std::cout << (largest <= 64 * 1024 ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 14 << std::endl;
+  {
+    auto c = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::Piped)
+      .cast ()
+        .value ();
+    auto &in = c.get_stdin ();
+    auto &out = c.get_stdout ();
+    in.set_nonblocking ();
+    out.set_nonblocking ();
+    char buf[4096];
+    std::cout << (out.try_read (buf, sizeof (buf)).would_block () ? "yes" : "no") << std::endl;
+    std::cout << (out.wait_readable (10) ? "yes" : "no") << std::endl;
+    // Write and read at the same time, the data is larger than both pipes.
+    const std::vector<char> data (1 << 20, 'x');
+    std::size_t written = 0, read = 0;
+    while (read < data.size ()) {
+      if (written < data.size ()) {
+        const auto w = in.try_write (data.data () + written, data.size () - written);
+        if (w.failed ()) {
+          break;
+        }
+        written += w.count ();
+        if (written == data.size ()) {
+          in.drop ();
+        }
+      }
+      const auto r = out.try_read (buf, sizeof (buf));
+      if (r.failed () || (r.done () && r.count () == 0)) {
+        break;
+      }
+      read += r.count ();
+      if (r.would_block ()) {
+        out.wait_readable (10);
+      }
+    }
+    std::cout << written << ' ' << read << ' ' << c.wait ().code () << std::endl;
+  }
+
+  std::cout << 15 << std::endl;
+  {
+    const auto path = std::filesystem::temp_directory_path () / "spell_piping_vectored.txt";
+    auto c = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::File (path))
+      .stdin_capacity (1 << 20)
+      .cast ()
+        .value ();
+    const std::string line = "{\"line\": 1}\n";
+    const std::vector<std::string_view> lines (100000, line);
+    const bool ok = c.get_stdin ().write_all (lines);
+  #ifndef _WIN32
+    char a[] = "a", bc[] = "bc";
+    const iovec vecs[] = {{a, 1}, {bc, 2}, {nullptr, 0}};
+    c.get_stdin ().write_all (vecs);
+  #else
+    c.get_stdin ().write_all ("abc", 3);
+  #endif
+    c.wait ();
+    std::FILE *f = std::fopen (path.string ().c_str (), "rb");
+    std::cout << ok << ' ' << size_of (f) << std::endl;
+    std::fclose (f);
+    std::filesystem::remove (path);
+  }
+
+  std::cout << 16 << std::endl;
+  {
+    auto o = spell::Spell ("programs/print_bytes.exe")
+      .arg ("1000000")
+      .set_stdout (spell::Stdio::Mapped)
+      .cast_output ()
+        .value ();
+    const auto data = o.stdout_data ();
+    std::cout << (o.stdout_mapping_ ? "yes" : "no") << ' ' << o.stdout_.size () << ' ' << data.size () << ' '
+              << std::count (data.begin (), data.end (), 'x') << ' ' << o.stderr_data ().size () << std::endl;
+    auto empty = spell::Spell ("programs/hello_world_stderr.exe")
+      .set_stdout (spell::Stdio::Mapped)
+      .set_stderr (spell::Stdio::Mapped)
+      .cast_output ()
+        .value ();
+    std::cout << (empty.stdout_mapping_ ? "yes" : "no") << ' ' << empty.collect_stdout<std::string> ().size () << ' '
+              << empty.collect_stderr<std::string> ();
+    std::cout << (spell::Spell ("programs/cat.exe").set_stdin (spell::Stdio::Mapped).cast ().has_value () ? "yes" : "no")
+              << std::endl;
+  }
+
+  std::cout << 17 << std::endl;
+  {
+    spell::Buffer_Pool pool;
+    auto spell = spell::Spell ("programs/print_bytes.exe");
+    spell.arg ("100000").buffer_pool (&pool);
+    auto first = spell.cast_output ().value ();
+    const char *const out = first.stdout_.data ();
+    const char *const err = first.stderr_.data ();
+    pool.recycle (std::move (first));
+    std::cout << pool.size () << ' ';
+    auto second = spell.cast_output ().value ();
+    const char *const taken = second.stdout_.data ();
+    std::cout << ((taken == out || taken == err) ? "yes" : "no") << ' ' << pool.size () << ' ';
+    const auto data = second.take_stdout ();
+    std::cout << (data.data () == taken ? "yes" : "no") << ' ' << data.size () << ' ' << second.stdout_.size () << std::endl;
+    pool.release (std::vector<char> {});
+    pool.recycle (std::move (second));
+    std::size_t streamed = 0;
+    spell.cast_streaming ([&streamed] (std::span<const char> chunk) { streamed += chunk.size (); });
+    std::cout << pool.size () << ' ' << streamed << std::endl;
+  }
+
+  // Pipe capacities can only be changed on Linux.
+#ifdef __linux__
+  std::cout << 18 << std::endl;
+  {
+    auto c = spell::Spell ("programs/cat.exe")
+      .set_stdin (spell::Stdio::Piped)
+      .set_stdout (spell::Stdio::Null)
+      .stdin_capacity (1 << 20)
+      .cast ()
+        .value ();
+    std::cout << (c.get_stdin ().capacity ().value_or (0) >= (1 << 20) ? "yes" : "no") << std::endl;
+    c.wait ();
+  }
+#else
+  std::cout << "18 skipped" << std::endl;
+#endif
 }
@@ -0,0 +1,73 @@
+#include <chrono>
+#include <iostream>
+#include <string>
+#include "spell.hh"
+
+int main () {
+#ifndef _WIN32
+  using namespace std::chrono_literals;
+  // The background process keeps the output pipe open after the shell exited.
+  const char *tree = "programs/sleep.exe 10000 & programs/sleep.exe 10000";
+
+  std::cout << 1 << std::endl;
+  {
+    const auto start = std::chrono::steady_clock::now ();
+    auto o = spell::Spell ("sh")
+      .args ("-c", tree)
+      .new_process_group ()
+      .timeout (200ms, 100ms)
+      .cast_output ()
+        .value ();
+    const auto elapsed = std::chrono::steady_clock::now () - start;
+    std::cout << (o.status.timed_out () ? "yes" : "no") << ' '
+              << (elapsed < 5s ? "yes" : "no") << ' '
+              << o.collect_stdout<std::string> ().size () << std::endl;
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    auto child = spell::Spell ("sh")
+      .args ("-c", tree)
+      .new_process_group ()
+      .set_stdout (spell::Stdio::Piped)
+      .cast ()
+        .value ();
+    std::string out;
+    while (out.size () < 16) {
+      char buf[16];
+      const auto n = child.get_stdout ().read (buf, sizeof (buf)).value_or (0);
+      if (n == 0) {
+        break;
+      }
+      out.append (buf, n);
+    }
+    std::cout << (child.kill_tree (true) ? "yes" : "no") << ' '
+              << child.wait ().signal () << ' ';
+    char c;
+    std::cout << child.get_stdout ().read (&c, 1).value_or (-1) << std::endl;
+  }
+#else
+  std::cout << "1 skipped" << std::endl;
+  std::cout << "2 skipped" << std::endl;
+#endif
+
+#ifdef __linux__
+  std::cout << 3 << std::endl;
+  {
+    std::cout << (spell::set_child_subreaper () ? "yes" : "no") << std::endl;
+    auto child = spell::Spell ("sh")
+      .args ("-c", "programs/sleep.exe 10000 > /dev/null &")
+      .new_process_group ()
+      .cast ()
+        .value ();
+    std::cout << child.wait ().code () << std::endl;
+    // The orphaned sleep is now a child of this process.
+    std::cout << (waitpid (-1, nullptr, WNOHANG) == 0 ? "yes" : "no") << ' ';
+    child.kill_tree (true);
+    std::cout << (waitpid (-1, nullptr, WNOHANG) < 0 && errno == ECHILD ? "yes" : "no") << std::endl;
+    spell::set_child_subreaper (false);
+  }
+#else
+  std::cout << "3 skipped" << std::endl;
+#endif
+}
@@ -0,0 +1,17 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Writes the given number of bytes to both stdout and stderr, alternating
+// between them in small chunks.
+int main (int argc, const char **argv) {
+  char chunk[1000];
+  long count = argc > 1 ? atol (argv[1]) : 0;
+  memset (chunk, 'x', sizeof (chunk));
+  while (count > 0) {
+    const long n = count < (long)sizeof (chunk) ? count : (long)sizeof (chunk);
+    fwrite (chunk, 1, n, stdout);
+    fwrite (chunk, 1, n, stderr);
+    count -= n;
+  }
+}
@@ -0,0 +1,24 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+// Prints the niceness of the process and the number of CPUs it may run on.
+int main (void) {
+  int niceness = 0;
+  int cpus = 0;
+#ifndef _WIN32
+  niceness = getpriority (PRIO_PROCESS, 0);
+#endif
+#ifdef __linux__
+  cpu_set_t set;
+  if (sched_getaffinity (0, sizeof (set), &set) == 0) {
+    cpus = CPU_COUNT (&set);
+  }
+#endif
+  printf ("%d %d\n", niceness, cpus);
+}
@@ -0,0 +1,17 @@
+#include <stdio.h>
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+// Prints whether SIGPIPE is ignored and whether it is blocked.
+int main (void) {
+#ifndef _WIN32
+  struct sigaction action;
+  sigaction (SIGPIPE, NULL, &action);
+  sigset_t mask;
+  sigprocmask (SIG_BLOCK, NULL, &mask);
+  printf ("%s %s\n",
+          action.sa_handler == SIG_IGN ? "ignored" : "default",
+          sigismember (&mask, SIGPIPE) ? "blocked" : "unblocked");
+#endif
+}
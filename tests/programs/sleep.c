@@ -0,0 +1,27 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+// Prints "started", then sleeps for the given number of milliseconds.
+// If the second argument is "ignore" SIGTERM is ignored.
+int main (int argc, const char **argv) {
+  const long ms = argc > 1 ? atol (argv[1]) : 0;
+#ifndef _WIN32
+  if (argc > 2 && strcmp (argv[2], "ignore") == 0) {
+    signal (SIGTERM, SIG_IGN);
+  }
+#endif
+  puts ("started");
+  fflush (stdout);
+#ifdef _WIN32
+  Sleep (ms);
+#else
+  usleep (ms * 1000);
+#endif
+}
@@ -0,0 +1,47 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Answers each request with "<n>:<request>", where n counts the requests
+// answered by this process. Exits without answering on "crash".
+// With the argument "length" messages are prefixed with their 32-bit
+// big-endian length, otherwise they are terminated by a newline.
+int main (int argc, const char **argv) {
+  const int length = argc > 1 && strcmp (argv[1], "length") == 0;
+  char request[4096];
+  char response[4200];
+  int served = 0;
+  for (;;) {
+    size_t size;
+    if (length) {
+      unsigned char header[4];
+      if (fread (header, 1, 4, stdin) != 4) {
+        return 0;
+      }
+      size = (size_t)header[0] << 24 | (size_t)header[1] << 16 | (size_t)header[2] << 8 | header[3];
+      if (size >= sizeof (request) || fread (request, 1, size, stdin) != size) {
+        return 1;
+      }
+      request[size] = '\0';
+    }
+    else {
+      if (!fgets (request, sizeof (request), stdin)) {
+        return 0;
+      }
+      request[strcspn (request, "\n")] = '\0';
+    }
+    if (strcmp (request, "crash") == 0) {
+      return 1;
+    }
+    const int n = snprintf (response, sizeof (response), "%d:%s", ++served, request);
+    if (length) {
+      const unsigned char header[4] = {n >> 24, n >> 16, n >> 8, n};
+      fwrite (header, 1, 4, stdout);
+      fwrite (response, 1, n, stdout);
+    }
+    else {
+      printf ("%s\n", response);
+    }
+    fflush (stdout);
+  }
+}
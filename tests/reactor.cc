@@ -0,0 +1,45 @@
+#include <iostream>
+#include <map>
+#include "spell.hh"
+
+int main () {
+#ifdef SPELL_HAS_REACTOR
+  spell::Reactor reactor;
+  std::cout << 1 << std::endl;
+  std::cout << (reactor.valid () ? "yes" : "no") << std::endl;
+
+  std::cout << 2 << std::endl;
+  {
+    struct Result {
+      std::size_t out = 0;
+      std::size_t err = 0;
+      int code = -1;
+    };
+    std::map<std::string, Result> results;
+    auto add = [&] (std::string name, spell::Spell spell) {
+      auto &r = results[name];
+      reactor.add (
+        spell.set_stdout (spell::Stdio::Piped)
+          .set_stderr (spell::Stdio::Piped)
+          .cast ()
+            .value (),
+        [&r] (spell::Child &, spell::Exit_Status status) {
+          r.code = status.code ();
+        },
+        [&r] (spell::Child &, spell::Reactor::Stream stream, std::span<const char> data) {
+          (stream == spell::Reactor::Stream::Stdout ? r.out : r.err) += data.size ();
+        }
+      );
+    };
+    add ("bytes", spell::Spell ("programs/print_bytes.exe").arg ("300000"));
+    add ("hello", spell::Spell ("programs/hello_world.exe"));
+    add ("status", spell::Spell ("programs/return_number_of_args.exe").args ("1", "2", "3"));
+    std::cout << reactor.size () << std::endl;
+    reactor.run ();
+    std::cout << reactor.size () << std::endl;
+    for (const auto &[name, r] : results) {
+      std::cout << name << ' ' << r.out << ' ' << r.err << ' ' << r.code << std::endl;
+    }
+  }
+#endif
+}
@@ -0,0 +1,79 @@
+#include <chrono>
+#include <iostream>
+#include <vector>
+#include "spell.hh"
+
+int main () {
+#ifndef _WIN32
+  std::cout << 1 << std::endl;
+  std::cout << (spell::Reaper::enabled () ? "yes" : "no") << ' '
+            << (spell::Reaper::enable () ? "yes" : "no") << ' '
+            << (spell::Reaper::enabled () ? "yes" : "no") << std::endl;
+
+  std::cout << 2 << std::endl;
+  {
+    std::vector<spell::Child> children;
+    for (int i = 0; i < 50; ++i) {
+      spell::Spell spell ("programs/return_number_of_args.exe");
+      for (int j = 0; j < i % 5; ++j) {
+        spell.arg ("x");
+      }
+      children.push_back (spell.cast ().value ());
+    }
+    int sum = 0;
+    bool usage = true;
+    for (auto &child : children) {
+      const auto status = child.wait ();
+      sum += status.code ();
+      usage = usage && status.resource_usage ().has_value ();
+    }
+    std::cout << sum << ' ' << (usage ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    auto child = spell::Spell ("programs/sleep.exe")
+      .arg ("200")
+      .set_stdout (spell::Stdio::Null)
+      .cast ()
+        .value ();
+    std::cout << (child.try_wait ().has_value () ? "yes" : "no") << ' '
+              << (child.wait_for (std::chrono::milliseconds (10)).has_value () ? "yes" : "no") << ' '
+              << (child.wait_for (std::chrono::seconds (5)).has_value () ? "yes" : "no") << ' '
+              << (child.try_wait ().has_value () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    auto o = spell::Spell ("programs/hello_world.exe")
+      .cast_output ()
+        .value ();
+    std::cout << o.status.code () << ' ' << o.collect_stdout<std::string> ();
+  }
+
+#ifdef SPELL_HAS_REACTOR
+  std::cout << 5 << std::endl;
+  {
+    spell::Reactor reactor;
+    int sum = 0;
+    for (int i = 0; i < 10; ++i) {
+      reactor.add (
+        spell::Spell ("programs/return_number_of_args.exe")
+          .args ("1", "2")
+          .cast ()
+            .value (),
+        [&sum] (spell::Child &, spell::Exit_Status status) {
+          sum += status.code ();
+        }
+      );
+    }
+    reactor.run ();
+    std::cout << sum << std::endl;
+  }
+#else
+  std::cout << "5 skipped" << std::endl;
+#endif
+#else
+  std::cout << "1 skipped" << std::endl;
+#endif
+}
@@ -0,0 +1,118 @@
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spell.hh"
+
+int main () {
+#ifndef _WIN32
+  spell::Spawn_Server server;
+  std::cout << (server.valid () ? "yes" : "no") << std::endl;
+  spell::Spawn_Server *const srv = &server;
+#endif
+  auto with_server = [&] (spell::Spell &s) -> spell::Spell& {
+  #ifndef _WIN32
+    s.spawn_server (srv);
+  #endif
+    return s;
+  };
+
+  std::cout << 1 << std::endl;
+  with_server (spell::Spell ("programs/hello_world.exe").set_stdout (spell::Stdio::Inherit)).cast_status ();
+
+  std::cout << 2 << std::endl;
+  {
+    auto o = with_server (spell::Spell ("programs/print_bytes.exe").arg ("100000"))
+      .cast_output ()
+        .value ();
+    std::cout << o.status.code () << ' ' << o.stdout_.size () << ' ' << o.stderr_.size () << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    auto s = with_server (spell::Spell ("programs/return_number_of_args.exe").args ("a", "b", "c"));
+    std::cout << s.cast_status ()->code () << std::endl;
+    auto c1 = s.cast ().value ();
+    auto c2 = s.arg ("d").cast ().value ();
+    // Exits may be reported in any order.
+    std::cout << c2.wait ().code () << ' ' << c1.wait ().code () << std::endl;
+    while (!c1.try_wait ().has_value ()) {}
+    std::cout << c1.try_wait ()->code () << std::endl;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    with_server (spell::Spell ("programs/print_env.exe").arg ("foo").env ("foo", "bar")).cast_status ();
+    with_server (spell::Spell ("./echo.exe").arg ("here").current_dir ("programs")).cast_status ();
+    auto s = spell::Spell ("programs/does_not_exist.exe");
+    with_server (s);
+    std::cout << (s.cast ().has_value () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 5 << std::endl;
+  {
+    auto s = spell::Spell ("programs/return_number_of_args.exe");
+    with_server (s);
+    const auto status = s.cast_status ().value ();
+    std::cout << (status.resource_usage ().has_value () ? "yes" : "no") << ' '
+              << (status.timings ().exec <= status.timings ().exit ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 6 << std::endl;
+  {
+    // Launches from several threads at once get their own replies.
+    std::vector<std::thread> threads;
+    std::atomic<int> sum = 0;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back ([&with_server, &sum, t] () {
+        for (int i = 0; i < 20; ++i) {
+          auto s = spell::Spell ("programs/return_number_of_args.exe");
+          with_server (s);
+          for (int j = 0; j < t; ++j) {
+            s.arg ("x");
+          }
+          sum += s.cast_status ().value ().code ();
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join ();
+    }
+    std::cout << sum << std::endl;
+  }
+
+#ifndef _WIN32
+  std::cout << 7 << std::endl;
+  {
+    // Signal dispositions are the same as for children of this process.
+    auto s = spell::Spell ("programs/print_sigpipe.exe");
+    s.cast_status ();
+    with_server (s).cast_status ();
+  }
+
+  std::cout << 8 << std::endl;
+  {
+    // Children that are never waited for do not keep their exit around.
+    with_server (spell::Spell ("programs/hello_world.exe").set_stdout (spell::Stdio::Null)).cast ();
+    auto quick = with_server (spell::Spell ("programs/return_number_of_args.exe").args ("a", "b"))
+      .cast ()
+        .value ();
+    auto slow = with_server (spell::Spell ("programs/sleep.exe").arg ("5000").set_stdout (spell::Stdio::Null))
+      .cast ()
+        .value ();
+    // Receives the exits of the other children.
+    std::this_thread::sleep_for (std::chrono::milliseconds (200));
+    std::cout << (slow.try_wait ().has_value () ? "yes" : "no") << ' ';
+    // Exits received before the server was lost are still reported.
+    kill (server.id (), SIGKILL);
+    std::cout << slow.wait ().code () << ' ' << quick.wait ().code () << std::endl;
+    slow.kill ();
+  }
+#else
+  std::cout << "7 skipped" << std::endl;
+  std::cout << "8 skipped" << std::endl;
+#endif
+}
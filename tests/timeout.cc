@@ -0,0 +1,107 @@
+#include <chrono>
+#include <csignal>
+#include <iostream>
+#include <optional>
+#include "spell.hh"
+
+using namespace std::chrono_literals;
+
+int main () {
+  // Statuses of children stopped for their timeout, checked for the signal
+  // that stopped them in case 7.
+  std::optional<spell::Exit_Status> terminated, killed;
+
+  std::cout << 1 << std::endl;
+  {
+    auto c = spell::Spell ("programs/sleep.exe")
+      .arg ("5000")
+      .set_stdout (spell::Stdio::Null)
+      .cast ()
+        .value ();
+    const auto start = std::chrono::steady_clock::now ();
+    std::cout << (c.wait_for (50ms).has_value () ? "yes" : "no") << std::endl;
+    std::cout << (std::chrono::steady_clock::now () - start >= 50ms ? "yes" : "no") << std::endl;
+    c.kill ();
+    std::cout << (c.wait ().success () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    auto c = spell::Spell ("programs/return_number_of_args.exe")
+      .args ("a", "b")
+      .cast ()
+        .value ();
+    const auto status = c.wait_until (std::chrono::system_clock::now () + 5s);
+    std::cout << status->code () << ' ' << status->timed_out () << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    const auto status = spell::Spell ("programs/sleep.exe")
+      .args ("5000")
+      .set_stdout (spell::Stdio::Null)
+      .timeout (100ms)
+      .cast_status ()
+        .value ();
+    std::cout << status.timed_out () << ' ' << status.success () << std::endl;
+    terminated = status;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    const auto status = spell::Spell ("programs/sleep.exe")
+      .args ("5000", "ignore")
+      .set_stdout (spell::Stdio::Null)
+      .timeout (50ms, 50ms)
+      .cast_status ()
+        .value ();
+    std::cout << status.timed_out () << std::endl;
+    killed = status;
+  }
+
+  std::cout << 5 << std::endl;
+  {
+    const auto o = spell::Spell ("programs/sleep.exe")
+      .arg ("5000")
+      .timeout (100ms)
+      .cast_output ()
+        .value ();
+    std::cout << o.collect_stdout<std::string> () << o.status.timed_out () << std::endl;
+  }
+
+  std::cout << 6 << std::endl;
+  {
+    const auto o = spell::Spell ("programs/echo.exe")
+      .arg ("fast")
+      .timeout (5s)
+      .cast_output ()
+        .value ();
+    std::cout << o.collect_stdout<std::string> () << o.status.success () << std::endl;
+  }
+
+  // Children are always terminated with TerminateProcess on Windows.
+#ifndef _WIN32
+  std::cout << 7 << std::endl;
+  std::cout << (terminated->signal () == SIGTERM && terminated->code () == 128 + SIGTERM) << ' '
+            << (killed->signal () == SIGKILL) << std::endl;
+#else
+  std::cout << "7 skipped" << std::endl;
+#endif
+
+#ifndef _WIN32
+  std::cout << 8 << std::endl;
+  {
+    // Reaped by other code, so its exit can no longer be waited for.
+    auto c = spell::Spell ("programs/hello_world.exe")
+      .set_stdout (spell::Stdio::Null)
+      .cast ()
+        .value ();
+    waitpid (c.id (), nullptr, 0);
+    const auto start = std::chrono::steady_clock::now ();
+    std::cout << c.wait_for (5s).has_value () << ' '
+              << (std::chrono::steady_clock::now () - start < 1s ? "yes" : "no") << std::endl;
+  }
+#else
+  std::cout << "8 skipped" << std::endl;
+#endif
+}
@@ -0,0 +1,69 @@
+#include <atomic>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "spell.hh"
+
+int main () {
+  std::cout << 1 << std::endl;
+  {
+    spell::Worker_Pool pool (spell::Spell ("programs/worker.exe"), 1);
+    std::cout << (pool.valid () ? "yes" : "no") << ' ' << pool.size () << std::endl;
+    std::cout << pool.request ("hello").value_or ("failed") << std::endl;
+    std::cout << pool.request ("world").value_or ("failed") << std::endl;
+    // The worker exits without answering and is relaunched for the next one.
+    std::cout << pool.request ("crash").value_or ("failed") << std::endl;
+    std::cout << pool.request ("again").value_or ("failed") << std::endl;
+  }
+
+  std::cout << 2 << std::endl;
+  {
+    spell::Worker_Pool pool (spell::Spell ("programs/worker.exe").arg ("length"), 1, spell::Framing::Length_Prefixed, 2);
+    const std::string big (3000, 'x');
+    for (const char *message : {"a", "b\nwith a newline", "c", ""}) {
+      std::cout << pool.request (message).value_or ("failed") << std::endl;
+    }
+    const auto response = pool.request (big).value_or ("failed");
+    std::cout << response.size () << ' ' << response.substr (0, 4) << std::endl;
+  }
+
+  std::cout << 3 << std::endl;
+  {
+    spell::Worker_Pool pool (spell::Spell ("programs/worker.exe"), 3);
+    std::atomic<int> ok = 0;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back ([&pool, &ok, t] () {
+        for (int i = 0; i < 50; ++i) {
+          const auto message = std::to_string (t) + '-' + std::to_string (i);
+          const auto response = pool.request (message);
+          if (response.has_value () && response->ends_with (':' + message)) {
+            ++ok;
+          }
+        }
+      });
+    }
+    for (auto &t : threads) {
+      t.join ();
+    }
+    std::cout << ok << std::endl;
+  }
+
+  std::cout << 4 << std::endl;
+  {
+    spell::Worker_Pool pool (spell::Spell ("programs/does_not_exist.exe"), 2);
+    std::cout << (pool.valid () ? "yes" : "no") << ' ' << (pool.request ("x").has_value () ? "yes" : "no") << std::endl;
+  }
+
+  std::cout << 5 << std::endl;
+  {
+    // Exits right away, writing to it must not raise SIGPIPE.
+    spell::Worker_Pool pool (spell::Spell ("programs/return_number_of_args.exe"), 1);
+    int failed = 0;
+    for (int i = 0; i < 50; ++i) {
+      failed += !pool.request (std::string (100000, 'x')).has_value ();
+    }
+    std::cout << failed << std::endl;
+  }
+}